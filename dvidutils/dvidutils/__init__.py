@@ -26,3 +26,7 @@ for name in dir(_dvidutils):
         globals()[name] = f
     else:
         globals()[name] = o
+
+# LabelMapper() is a function (overloaded for each dtype pair), not a class,
+# so attach the loader to it, allowing LabelMapper.load_mmap(path).
+LabelMapper.load_mmap = load_label_mapper_mmap
@@ -2,11 +2,19 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <math.h>
 #include <vector>
 #include <stdexcept>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "destripe.hpp"
+#include "parallel.hpp"
 
 using namespace std;
 
@@ -16,6 +24,7 @@ int ROUND(double x) {return x >= 0 ? int(x+0.5) : int (x-0.5);}
 class MeanStd {  // for computing mean and standard deviation
 public:
     MeanStd(){sum = sum2 = 0.0; n=0;}
+    MeanStd(double sum_, double sum2_, long int n_){sum = sum_; sum2 = sum2_; n = n_;}  // from precomputed sums
     void Reset(){sum = sum2 = 0.0; n=0;}
     void Element(double a){sum += a; sum2 += a*a; n++;}
     void Stats(double &avg, double &std){ avg = sum/n; std = sum2/n-avg*avg < 0 ? 0.0 : sqrt(sum2/n - avg*avg);}  // could be off by rounding
@@ -36,32 +45,194 @@ public:
     Correction(){ left = 0.0; right = 0.0;}
 };
 
+// Adds one row of pixels to 16-bit per-column accumulators, from column x_begin onwards.
+static void add_row_to_column_sums(uint8 const * row, size_t x_begin, size_t w, uint16_t * acc)
+{
+    for(size_t x=x_begin; x<w; x++)
+        acc[x] += row[x];
+}
+
+#ifdef __SSE2__
+// Same as above, 16 columns at a time.
+static void add_row_to_column_sums(uint8 const * row, size_t w, uint16_t * acc)
+{
+    __m128i const zero = _mm_setzero_si128();
+    size_t x = 0;
+    for(; x + 16 <= w; x += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(row + x));
+        __m128i * a = reinterpret_cast<__m128i *>(acc + x);
+        _mm_storeu_si128(a,     _mm_add_epi16(_mm_loadu_si128(a),     _mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), _mm_unpackhi_epi8(v, zero)));
+    }
+    add_row_to_column_sums(row, x, w, acc);
+}
+#else
+static void add_row_to_column_sums(uint8 const * row, size_t w, uint16_t * acc)
+{
+    add_row_to_column_sums(row, 0, w, acc);
+}
+#endif
 
-vector<uint8> destripe(uint8 * image, size_t w, size_t h, size_t YC, vector<int> const & seam, bool writeplot)
+// Sums each column of the image (and optionally the squares of its pixels),
+// in a single pass over the rows, so memory is read sequentially.
+// Rows are accumulated in 16-bit sums, which can hold up to 257 rows of 8-bit pixels
+// before they must be added to the 64-bit totals.
+static void column_sums(uint8 const * image, size_t w, size_t h,
+                        vector<uint64_t> &sums, vector<uint64_t> *sums2)
 {
+    const size_t ROWS_PER_BLOCK = 257;  // 257 * 255 == 65535
+    sums.assign(w, 0);
+    if (sums2)
+        sums2->assign(w, 0);
+
+    vector<uint16_t> acc(w);
+    vector<uint32_t> acc2(sums2 ? w : 0);
+    for(size_t y0=0; y0<h; y0 += ROWS_PER_BLOCK) {
+        size_t y1 = min(y0 + ROWS_PER_BLOCK, h);
+        fill(acc.begin(), acc.end(), 0);
+        fill(acc2.begin(), acc2.end(), 0);
+        for(size_t y=y0; y<y1; y++) {
+            uint8 const * row = image + y*w;
+            add_row_to_column_sums(row, w, &acc[0]);
+            if (sums2) {
+                for(size_t x=0; x<w; x++)
+                    acc2[x] += uint32_t(row[x])*row[x];
+            }
+        }
+        for(size_t x=0; x<w; x++)
+            sums[x] += acc[x];
+        if (sums2) {
+            for(size_t x=0; x<w; x++)
+                (*sums2)[x] += acc2[x];
+        }
+    }
+}
+
+// Running (prefix) sums, over the rows of the image, of the pixels in columns [x0, x1]
+// and of their squares: sum[y] is the sum over rows [0, y).
+// The statistics of any range of rows are then the difference of two entries.
+struct BandPrefixSums {
+    vector<uint64_t> sum, sum2;
+    int x0, x1;
+
+    BandPrefixSums(uint8 const * image, size_t w, size_t h, int x0_, int x1_)
+    : sum(h+1), sum2(h+1), x0(max(x0_, 0)), x1(min(x1_, int(w)-1))
+    {
+        for(size_t y=0; y<h; y++) {
+            uint8 const * row = image + y*w;
+            uint64_t s = 0, s2 = 0;
+            for(int x=x0; x<=x1; x++) {
+                s  += row[x];
+                s2 += uint32_t(row[x])*row[x];
+            }
+            sum[y+1]  = sum[y]  + s;
+            sum2[y+1] = sum2[y] + s2;
+        }
+    }
+
+    // Statistics of rows [y0, y1)
+    MeanStd Rows(int y0, int y1) const {
+        long int n = long(y1 - y0) * max(x1 - x0 + 1, 0);
+        return MeanStd(double(sum[y1] - sum[y0]), double(sum2[y1] - sum2[y0]), n);
+    }
+};
+
+
+static double seconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void print_destripe_report(DestripeReport const & report, FILE * fp)
+{
+    fprintf(fp, "%d measurement points in Y\n", int(report.ys.size()) - 2);
+    for(size_t i=0; i<report.ys.size(); i++)
+        fprintf(fp, "ys[%2d] = %5d\n", int(i), report.ys[i]);
+    fprintf(fp, "%d seams\n", int(report.slab_means.size()) + 1);
+    for(double mean : report.slab_means)
+        fprintf(fp, "slab mean is %.2f\n", mean);
+
+    fprintf(fp, "%d of %d seam measurements were plausible\n",
+            int(report.plausible_measurements), int(report.measurements));
+    for(size_t y=0; y<report.ys.size(); y++) {
+        for(size_t x=0; x<report.left_corrections.size(); x++)
+            fprintf(fp, "%5.1f:%5.1f ", report.left_corrections[x][y], report.right_corrections[x][y]);
+        fprintf(fp, "\n");
+    }
+    for(int x : report.unmatched_columns)
+        fprintf(fp, "No X at %d\n", x);
+    if (report.misplaced_rows)
+        fprintf(fp, "Oops.  %d rows were outside of their Y slot\n", int(report.misplaced_rows));
+
+    fprintf(fp, "Timing (%d threads):\n", report.num_threads);
+    fprintf(fp, "  column stats:        %8.3f s\n", report.column_stats_seconds);
+    fprintf(fp, "  slab normalization:  %8.3f s\n", report.slab_normalization_seconds);
+    fprintf(fp, "  seam stats:          %8.3f s\n", report.seam_stats_seconds);
+    fprintf(fp, "  correction:          %8.3f s\n", report.correction_seconds);
+    if (report.io_seconds > 0)
+        fprintf(fp, "  reading/writing:     %8.3f s\n", report.io_seconds);
+    fprintf(fp, "  total:               %8.3f s\n", report.total_seconds);
+}
+
+// The measurement windows are centered DX to SX pixels from each seam.
+const int DX = 10;
+const int SX = 100;
 
-    printf("%d measurement points in Y\n", int(YC));
+// Checks the seam definitions, and returns the Y values of the measurement points
+// (with an extra point one past each end).
+static vector<int> measurement_rows(size_t w, size_t h, size_t YC, vector<int> const & seam)
+{
     vector<int> ys(YC+2);
     ys[0] = -1;
     for(size_t i=1; i<=YC; i++)
         ys[i] = int((double(i)-0.5)/YC * h);
     ys[YC+1] = int(h);
-    for(size_t i=0; i<ys.size(); i++) {
-        printf("ys[%2d] = %5d\n", int(i), ys[i]);
-    }
+
     // here are the X values of the seams.  Also two at ends.
     //int seam[] = {-1, 2066,4684,7574,10385,13222,15937,18531,21198,23826,26506,29175,31772, int(w)};
     //size_t NS = sizeof(seam)/sizeof(int);
 
     size_t NS = seam.size();
-    printf("%d seams\n", int(NS));
 
-    if (seam[0] != -1 or seam[NS-1] != int(w)) {
+    if (NS < 2 or seam[0] != -1 or seam[NS-1] != int(w)) {
         throw std::runtime_error("seam definitions must start with -1 and end with the image width!");
     }
+    for(size_t i=0; i<NS-1; i++) {
+        if (seam[i] >= seam[i+1])
+            throw std::runtime_error("seam definitions must be in increasing order!");
+    }
+    return ys;
+}
+
+// Adds the column sums of n rows to 'sums' (and 'sums2'), splitting the rows among T threads.
+static void add_column_sums(uint8 const * rows, size_t w, size_t n, int T,
+                            vector<uint64_t> &sums, vector<uint64_t> *sums2)
+{
+    vector<vector<uint64_t>> band_sums(T), band_sums2(T);
+    dvidutils::parallel_for_slabs(T, T, [&](size_t t_begin, size_t t_end) {
+        for(size_t t=t_begin; t<t_end; t++) {
+            size_t y0 = n*t/T, y1 = n*(t+1)/T;
+            column_sums(rows + y0*w, w, y1-y0, band_sums[t], sums2 ? &band_sums2[t] : nullptr);
+        }
+    });
+    for(int t=0; t<T; t++) {
+        for(size_t x=0; x<w; x++)
+            sums[x] += band_sums[t][x];
+        if (sums2) {
+            for(size_t x=0; x<w; x++)
+                (*sums2)[x] += band_sums2[t][x];
+        }
+    }
+}
 
-    // look at normalizing through one section.   First make plot
+// Finds the amount to add to each column, to bring its mean to the mean of its slab.
+// (Columns on the seams are left alone.)  Writes the plot of the column statistics, if requested.
+static vector<int> column_deltas(vector<uint64_t> const & col_sums, vector<uint64_t> const & col_sums2,
+                                 size_t w, size_t h, vector<int> const & seam, bool writeplot, DestripeReport & rep)
+{
     vector<double> means_by_col(w);
+    for(size_t x=0; x<w; x++)
+        means_by_col[x] = double(col_sums[x])/h;
 
     if (writeplot) {
         FILE *fp = fopen("pl", "w");
@@ -69,118 +240,354 @@ vector<uint8> destripe(uint8 * image, size_t w, size_t h, size_t YC, vector<int>
             throw std::runtime_error("Could not open 'pl'\n");
         }
         for(size_t x=0; x<w; x++) {
-            MeanStd m;
-            for(size_t y=0; y<h; y++)
-                m.Element(image[x+y*w]);
+            MeanStd m(double(col_sums[x]), double(col_sums2[x]), long(h));
             fprintf(fp, "%d %.2f %.2f\n", int(x), m.Mean(), m.Std() );
-            means_by_col[x] = m.Mean();
         }
         fclose(fp);
-        printf("Wrote file 'fp'\n");
     }
 
-    for(size_t i=0; i<NS-1; i++) {
+    vector<int> col_delta(w, 0);
+    for(size_t i=0; i<seam.size()-1; i++) {
         size_t xmin = static_cast<size_t>(max(seam[i]+1, 0));
         size_t xmax = static_cast<size_t>(min(seam[i+1]-1, int(w)-1));
         MeanStd overall;
         for(size_t x=xmin; x <= xmax; x++)
             overall.Element(means_by_col[x]);
-        printf("slab mean is %.2f\n", overall.Mean());
-        for(size_t x=xmin; x <= xmax; x++) {
-            int delta = ROUND(overall.Mean() - means_by_col[x]);
-            for(size_t y=0; y<h; y++) {
-                int pix = image[x+y*w] + delta;
+        rep.slab_means.push_back(overall.Mean());
+        for(size_t x=xmin; x <= xmax; x++)
+            col_delta[x] = ROUND(overall.Mean() - means_by_col[x]);
+    }
+    return col_delta;
+}
+
+// Normalizes n rows (in may be the same as out), splitting them among T threads.
+static void normalize_rows(uint8 const * in, uint8 * out, size_t w, size_t n, vector<int> const & col_delta, int T)
+{
+    dvidutils::parallel_for_slabs(n, T, [&](size_t y0, size_t y1) {
+        for(size_t y=y0; y<y1; y++) {
+            uint8 const * row = in + y*w;
+            uint8 * out_row = out + y*w;
+            for(size_t x=0; x<w; x++) {
+                int pix = row[x] + col_delta[x];
                 pix = min(pix, 255);
                 pix = max(pix,   0);
-                image[x+y*w] = static_cast<uint8>(pix);
+                out_row[x] = static_cast<uint8>(pix);
             }
         }
-    }
-
-    // Create an array of corrections.  It's unevenly spaced in X and Y, but with a constant number of points in each row/column.
-    // Two extra points in each direction; one at 0 and one at the far edge.  All measured points are interior.
+    });
+}
 
+// Create an array of corrections.  It's unevenly spaced in X and Y, but with a constant number of points in each row/column.
+// Two extra points in each direction; one at 0 and one at the far edge.  All measured points are interior.
+//
+// Each measurement averages a window of 1000 rows, in the bands of columns
+// from DX to SX pixels away from the seam, on either side.
+// band_sums(i) returns the (left, right) BandPrefixSums of seam i, over the normalized image.
+// Each seam's bands are independent, so the seams are divided among the threads.
+template <typename band_sums_fn>
+static vector<vector<Correction>> seam_corrections(size_t h, vector<int> const & seam, vector<int> const & ys,
+                                                   band_sums_fn band_sums, int num_threads, DestripeReport & rep)
+{
+    size_t NS = seam.size();
     size_t XSIZE = NS;
-    size_t YSIZE = YC+2;
+    size_t YSIZE = ys.size();
     vector<vector<Correction>  >corr(XSIZE, vector<Correction>(YSIZE));
-    printf("Correction vector has %lu entries, %lu by %lu\n", corr.size(), XSIZE, YSIZE);
+
+    vector<vector<MeanStd>> left_stats(XSIZE), right_stats(XSIZE);
+    dvidutils::parallel_for_slabs(NS-2, num_threads, [&](size_t begin, size_t end) {
+        for(size_t i=begin+1; i<end+1; i++) {
+            auto bands = band_sums(i);
+            for(size_t iy=1; iy < YSIZE-1; iy++) {
+                int y0 = ys[iy];
+                int ybegin = max(y0-500, 0);
+                int yend = min(y0+500, int(h));
+                left_stats[i] .push_back(bands.first .Rows(ybegin, yend));
+                right_stats[i].push_back(bands.second.Rows(ybegin, yend));
+            }
+        }
+    });
 
     for(size_t i=1; i<NS-1; i++) {
-        int xmid = seam[i];
-        const int DX = 10;
-        const int SX = 100;
         for(size_t iy=1; iy < YSIZE-1; iy++) {
-            int y0 = ys[iy];
-            MeanStd left, right;
-            for(int y=y0-500; y<y0+500 && y < int(h); y++) {
-                for(int x=DX; x<=SX; x++) {
-                    left .Element(image[xmid-x + y*int(w)]);
-                    right.Element(image[xmid+x + y*int(w)]);
-                }
-            }
-            printf("At y=%5d and xmid = %d, left %.2f %.3f, right %.2f %.3f\n", y0, xmid, left.Mean(), left.Std(), right.Mean(), right.Std() );
+            MeanStd & left  = left_stats[i][iy-1];
+            MeanStd & right = right_stats[i][iy-1];
             // If both values look plausible, set corrections at this location.
             // Plausible means values between 100-200, std between 15 and 60.
             bool PlausLeft   = left.Mean() > 100 &&  left.Mean() < 220 &&  left.Std() > 15 &&  left.Std() < 60;
             bool PlausRight = right.Mean() > 100 && right.Mean() < 220 && right.Std() > 15 && right.Std() < 60;
+            rep.measurements++;
             if (PlausLeft && PlausRight) {
                 double mid = (left.Mean() + right.Mean())/2.0;
                 corr[i][iy].left = mid - left.Mean();  // amount to add
                 corr[i][iy].right= mid - right.Mean();
+                rep.plausible_measurements++;
             }
         }
     }
-    for(size_t y=0; y<YSIZE; y++) {
-        for(size_t x=0; x<XSIZE; x++)
-            printf("%5.1f:%5.1f ", corr[x][y].left, corr[x][y].right);
-        printf("\n");
-    }
-
-    // Find the corrections.  Put the X loop on the outside, even though that's bad for the cache, since the X computation is more expensive.
-    vector<uint8> fake(w*h, 127);
-    double yslot = double(h)/YC;
-    for(int x=0; x<int(w); x++) {
-        // find the x bin.  May not exist since exact seams don't count
-        size_t ix;
-        for(ix = 0; ix < XSIZE-1; ix++)
-            if (x > seam[ix] && x < seam[ix+1])
-                break;
-
-        if (ix >= XSIZE-1) {// found nothing.  Just copy this column.  Fix the case where it's black, since Shinya prefers white.
-            printf("No X at %d\n", int(x));
-            for(size_t y=0; y<h; y++) {
-                uint8 pix = image[x+int(y*w)];
-                if (pix == 0 && (image[size_t(x)+y*w-1] != 0 || image[size_t(x)+y*w+1] != 0)) // if not in a completely black area
-                    pix = 225;  // Set to a very white value
-                fake[size_t(x)+y*w] = pix;
+    rep.left_corrections.assign(XSIZE, vector<double>(YSIZE));
+    rep.right_corrections.assign(XSIZE, vector<double>(YSIZE));
+    for(size_t x=0; x<XSIZE; x++) {
+        for(size_t y=0; y<YSIZE; y++) {
+            rep.left_corrections[x][y] = corr[x][y].left;
+            rep.right_corrections[x][y] = corr[x][y].right;
+        }
+    }
+    return corr;
+}
+
+// Interpolates the corrections into the (normalized) image, one row at a time, in-place.
+// The X bin of each column (and its alpha) and the Y slot of each row (and its beta)
+// are computed once, up front.
+class RowCorrector {
+public:
+    RowCorrector(size_t w_, size_t h, size_t YC, vector<int> const & seam, vector<int> const & ys,
+                 vector<vector<Correction>> const & corr, DestripeReport & rep)
+    : w(w_), col_bin(w_, -1), col_alpha(w_), col_one_minus_alpha(w_),
+      row_slot(h), row_beta(h), row_one_minus_beta(h)
+    {
+        size_t XSIZE = seam.size();
+        size_t YSIZE = ys.size();
+
+        // find the x bin of each column.  May not exist since exact seams don't count
+        for(int x=0; x<int(w); x++) {
+            size_t ix;
+            for(ix = 0; ix < XSIZE-1; ix++)
+                if (x > seam[ix] && x < seam[ix+1])
+                    break;
+            if (ix >= XSIZE-1) {
+                unmatched_columns.push_back(x);
+                continue;
             }
-            continue;
+            col_bin[x] = int(ix);
+            col_alpha[x] = (double(x) - seam[ix])/(seam[ix+1] - seam[ix]);
+            col_one_minus_alpha[x] = 1 - col_alpha[x];
         }
-        double alpha = (double(x) - seam[ix])/(seam[ix+1] - seam[ix]);
-        //printf("alpha %f\n", alpha);
+        rep.unmatched_columns = unmatched_columns;
+
+        double yslot = double(h)/YC;
         for(size_t y=0; y<h; y++) {
             size_t slot = static_cast<size_t>(double(y)/yslot + 0.5);
-            // check
             if (int(y) < ys[slot] || int(y) > ys[slot+1])
-                printf("Oops.  yslot %f, slot %d, ys %d %d\n", yslot, int(slot), ys[slot], ys[slot+1]);
+                rep.misplaced_rows++;
+            row_slot[y] = slot;
+            row_beta[y] = (double(y) - ys[slot])/(ys[slot+1] - ys[slot]);
+            row_one_minus_beta[y] = 1 - row_beta[y];
+        }
+
+        // The corrections, indexed by [slot][x bin], so each row uses two contiguous rows of them.
+        corr_by_slot.assign(YSIZE, vector<Correction>(XSIZE));
+        for(size_t x=0; x<XSIZE; x++)
+            for(size_t y=0; y<YSIZE; y++)
+                corr_by_slot[y][x] = corr[x][y];
+    }
+
+    // Corrects n rows, starting with row y_begin of the image, splitting them among T threads.
+    void correct_rows(uint8 * rows, size_t y_begin, size_t n, int T) const
+    {
+        dvidutils::parallel_for_slabs(n, T, [&](size_t r0, size_t r1) {
+            vector<uint8> unmatched_pixels(unmatched_columns.size());
+            for(size_t r=r0; r<r1; r++) {
+                size_t y = y_begin + r;
+                vector<Correction> const & corr_above = corr_by_slot[row_slot[y]];
+                vector<Correction> const & corr_below = corr_by_slot[row_slot[y]+1];
+                double const beta = row_beta[y];
+                double const one_minus_beta = row_one_minus_beta[y];
+                uint8 * row = rows + r*w;
 
-            // OK, interpolate
-            double beta = (double(y) - ys[slot])/(ys[slot+1] - ys[slot]);
+                // Columns with no X bin are just copied.  Fix the case where it's black, since Shinya prefers white.
+                // (These depend on their neighbors, so they're found before any of the row is overwritten.)
+                for(size_t i=0; i<unmatched_pixels.size(); i++) {
+                    size_t x = unmatched_columns[i];
+                    uint8 pix = row[x];
+                    if (pix == 0 && ((x > 0 && row[x-1] != 0) || (x+1 < w && row[x+1] != 0))) // if not in a completely black area
+                        pix = 225;  // Set to a very white value
+                    unmatched_pixels[i] = pix;
+                }
+
+                for(size_t x=0; x<w; x++) {
+                    int ix = col_bin[x];
+                    if (ix < 0)
+                        continue;
+
+                    double alpha = col_alpha[x];
+                    double one_minus_alpha = col_one_minus_alpha[x];
+                    double incr = one_minus_alpha*one_minus_beta*corr_above[ix  ].right +
+                                  (alpha         )*one_minus_beta*corr_above[ix+1].left  +
+                                  one_minus_alpha*(beta         )*corr_below[ix  ].right +
+                                  (alpha         )*(beta         )*corr_below[ix+1].left  ;
+
+                    int delta = incr >= 0 ? int(incr + 0.5) : int(incr - 0.5);  // round to integer
+
+                    int pix = int(row[x]) + delta;
+                    pix = min(pix, 255);
+                    pix = max(pix,   0);
+                    row[x] = static_cast<uint8>(pix);
+                }
+
+                for(size_t i=0; i<unmatched_pixels.size(); i++)
+                    row[unmatched_columns[i]] = unmatched_pixels[i];
+            }
+        });
+    }
+
+private:
+    size_t w;
+    vector<int> col_bin;
+    vector<double> col_alpha, col_one_minus_alpha;
+    vector<int> unmatched_columns;
+    vector<size_t> row_slot;
+    vector<double> row_beta, row_one_minus_beta;
+    vector<vector<Correction>> corr_by_slot;
+};
+
+
+void destripe(uint8 const * image, uint8 * output, size_t w, size_t h, size_t YC, vector<int> const & seam,
+              bool writeplot, int num_threads, DestripeReport * report)
+{
+    auto const start = chrono::steady_clock::now();
+    DestripeReport local_report;
+    DestripeReport & rep = report ? *report : local_report;
+    rep = DestripeReport();
 
-            double incr = (1-alpha)*(1-beta)*corr[ix  ][slot  ].right +
-                          (alpha  )*(1-beta)*corr[ix+1][slot  ].left  +
-                          (1-alpha)*(beta  )*corr[ix  ][slot+1].right +
-                          (alpha  )*(beta  )*corr[ix+1][slot+1].left  ;
+    // Work is split into bands of rows, so each thread reads (and writes) contiguous memory.
+    int T = dvidutils::resolve_num_threads(h, num_threads);
+    rep.num_threads = T;
 
-            int delta = incr >= 0 ? int(incr + 0.5) : int(incr - 0.5);  // round to integer
+    vector<int> ys = measurement_rows(w, h, YC, seam);
+    rep.ys = ys;
 
-            int pix = int(image[size_t(x)+y*w]) + delta;
-            //pix = 127 + delta;  // just testing
-            pix = min(pix, 255);
-            pix = max(pix,   0);
-            fake[size_t(x)+y*w] = static_cast<uint8>(pix);
+    // look at normalizing through one section.   First find the column means (and make a plot, if requested)
+    auto phase_start = chrono::steady_clock::now();
+    vector<uint64_t> col_sums(w), col_sums2(writeplot ? w : 0);
+    add_column_sums(image, w, h, T, col_sums, writeplot ? &col_sums2 : nullptr);
+    vector<int> col_delta = column_deltas(col_sums, col_sums2, w, h, seam, writeplot, rep);
+    rep.column_stats_seconds = seconds_since(phase_start);
+
+    // Normalize each column to the mean of its slab.
+    // (The normalized image goes straight into the output, which is corrected in-place below.)
+    phase_start = chrono::steady_clock::now();
+    normalize_rows(image, output, w, h, col_delta, T);
+    rep.slab_normalization_seconds = seconds_since(phase_start);
+
+    phase_start = chrono::steady_clock::now();
+    auto band_sums = [&](size_t i) {
+        int xmid = seam[i];
+        return make_pair(BandPrefixSums(output, w, h, xmid-SX, xmid-DX),
+                         BandPrefixSums(output, w, h, xmid+DX, xmid+SX));
+    };
+    auto corr = seam_corrections(h, seam, ys, band_sums, num_threads, rep);
+    rep.seam_stats_seconds = seconds_since(phase_start);
+
+    phase_start = chrono::steady_clock::now();
+    RowCorrector corrector(w, h, YC, seam, ys, corr, rep);
+    corrector.correct_rows(output, 0, h, T);
+    rep.correction_seconds = seconds_since(phase_start);
+    rep.total_seconds = seconds_since(start);
+}
+
+vector<uint8> destripe(uint8 const * image, size_t w, size_t h, size_t YC, vector<int> const & seam, bool writeplot,
+                       int num_threads, DestripeReport * report)
+{
+    vector<uint8> output(w*h);
+    destripe(image, output.data(), w, h, YC, seam, writeplot, num_threads, report);
+    return output;
+}
+
+// The pixels of one measurement band (a range of columns beside a seam), in every row.
+struct SeamBandPixels {
+    int x0, x1;  // clamped to the image
+    vector<uint8> pixels;  // h rows of (x1 - x0 + 1) pixels
+
+    SeamBandPixels(size_t w, size_t h, int x0_, int x1_)
+    : x0(max(x0_, 0)), x1(min(x1_, int(w)-1)), pixels(size_t(Width()) * h)
+    {
+    }
+
+    int Width() const {return max(x1 - x0 + 1, 0);}
+
+    void CopyRows(uint8 const * rows, size_t w, size_t y_begin, size_t n) {
+        for(size_t r=0; r<n; r++)
+            copy(rows + r*w + x0, rows + r*w + x0 + Width(), pixels.data() + (y_begin + r)*Width());
+    }
+};
+
+void destripe_streaming(size_t w, size_t h, size_t YC, vector<int> const & seam,
+                        destripe_row_reader const & read_rows, destripe_row_writer const & write_rows,
+                        size_t band_height, bool writeplot, int num_threads, DestripeReport * report)
+{
+    auto const start = chrono::steady_clock::now();
+    DestripeReport local_report;
+    DestripeReport & rep = report ? *report : local_report;
+    rep = DestripeReport();
+
+    band_height = max<size_t>(min(band_height, h), 1);
+    int T = dvidutils::resolve_num_threads(band_height, num_threads);
+    rep.num_threads = T;
+
+    vector<int> ys = measurement_rows(w, h, YC, seam);
+    rep.ys = ys;
+    size_t NS = seam.size();
+
+    vector<uint8> band(w * band_height);
+    auto timed_io = [&](std::function<void()> f) {
+        auto io_start = chrono::steady_clock::now();
+        f();
+        rep.io_seconds += seconds_since(io_start);
+    };
+
+    // First pass: column sums, and a copy of the measurement bands beside each seam.
+    // (The measurements must be taken after normalization, which needs every row's column sums.)
+    auto phase_start = chrono::steady_clock::now();
+    vector<uint64_t> col_sums(w), col_sums2(writeplot ? w : 0);
+    vector<SeamBandPixels> left_bands, right_bands;
+    for(size_t i=0; i<NS; i++) {
+        int xmid = seam[i];
+        bool interior = (i > 0 && i < NS-1);
+        left_bands .push_back(SeamBandPixels(w, interior ? h : 0, xmid-SX, xmid-DX));
+        right_bands.push_back(SeamBandPixels(w, interior ? h : 0, xmid+DX, xmid+SX));
+    }
+    for(size_t y0=0; y0<h; y0 += band_height) {
+        size_t n = min(band_height, h - y0);
+        timed_io([&]{ read_rows(y0, n, band.data()); });
+        add_column_sums(band.data(), w, n, T, col_sums, writeplot ? &col_sums2 : nullptr);
+        for(size_t i=1; i<NS-1; i++) {
+            left_bands[i] .CopyRows(band.data(), w, y0, n);
+            right_bands[i].CopyRows(band.data(), w, y0, n);
         }
     }
+    vector<int> col_delta = column_deltas(col_sums, col_sums2, w, h, seam, writeplot, rep);
+    rep.column_stats_seconds = seconds_since(phase_start) - rep.io_seconds;
+
+    // Normalize the saved bands, and measure them.
+    phase_start = chrono::steady_clock::now();
+    auto band_sums = [&](size_t i) {
+        for(SeamBandPixels * b : {&left_bands[i], &right_bands[i]}) {
+            vector<int> delta(col_delta.begin() + b->x0, col_delta.begin() + b->x0 + b->Width());
+            normalize_rows(b->pixels.data(), b->pixels.data(), b->Width(), h, delta, 1);
+        }
+        return make_pair(BandPrefixSums(left_bands[i].pixels.data(), left_bands[i].Width(), h, 0, left_bands[i].Width()-1),
+                         BandPrefixSums(right_bands[i].pixels.data(), right_bands[i].Width(), h, 0, right_bands[i].Width()-1));
+    };
+    auto corr = seam_corrections(h, seam, ys, band_sums, num_threads, rep);
+    left_bands.clear();
+    right_bands.clear();
+    rep.seam_stats_seconds = seconds_since(phase_start);
+
+    // Second pass: normalize, correct and write each band of rows.
+    RowCorrector corrector(w, h, YC, seam, ys, corr, rep);
+    for(size_t y0=0; y0<h; y0 += band_height) {
+        size_t n = min(band_height, h - y0);
+        timed_io([&]{ read_rows(y0, n, band.data()); });
 
-    return fake;
+        phase_start = chrono::steady_clock::now();
+        normalize_rows(band.data(), band.data(), w, n, col_delta, T);
+        rep.slab_normalization_seconds += seconds_since(phase_start);
+
+        phase_start = chrono::steady_clock::now();
+        corrector.correct_rows(band.data(), y0, n, T);
+        rep.correction_seconds += seconds_since(phase_start);
+
+        timed_io([&]{ write_rows(y0, n, band.data()); });
+    }
+    rep.total_seconds = seconds_since(start);
 }
@@ -1,11 +1,68 @@
 #ifndef DESTRIPE_HPP
 #define DESTRIPE_HPP
 
+#include <functional>
 #include <vector>
+#include <cstddef>
 #include <cstdint>
-#include "destripe.hpp"
+#include <cstdio>
 
-std::vector<uint8_t> destripe(uint8_t * image, size_t w, size_t h, size_t YC,
-                              std::vector<int> const & seam, bool writeplot=false);
+// Timings and diagnostics from one destripe() call.
+// (destripe() itself prints nothing; pass one of these to see what it did.)
+struct DestripeReport {
+    // Wall-clock seconds spent in each phase
+    double column_stats_seconds = 0.0;        // column means (and the plot, if any)
+    double slab_normalization_seconds = 0.0;  // normalizing each column to its slab's mean
+    double seam_stats_seconds = 0.0;          // measurements on either side of each seam
+    double correction_seconds = 0.0;          // interpolating the seam corrections into the output
+    double io_seconds = 0.0;                  // reading and writing rows (destripe_streaming() only)
+    double total_seconds = 0.0;
+    int num_threads = 1;
+
+    std::vector<int> ys;              // rows of the measurement points (plus one past each end)
+    std::vector<double> slab_means;   // mean of each slab (which its columns are normalized to)
+    size_t measurements = 0;          // seam measurements taken
+    size_t plausible_measurements = 0;  // ...of which were used as corrections
+    std::vector<std::vector<double>> left_corrections;   // [seam][ys index]
+    std::vector<std::vector<double>> right_corrections;  // [seam][ys index]
+    std::vector<int> unmatched_columns;  // columns on seams, which were copied without correction
+    size_t misplaced_rows = 0;           // rows outside of their Y slot (should be none)
+};
+
+// Writes a human-readable summary of the report.
+void print_destripe_report(DestripeReport const & report, FILE * fp);
+
+// Removes the brightness differences between the vertical slabs of an image,
+// which are separated by the given seam columns, and writes the corrected image to 'output'.
+// The seams must be increasing, starting with -1 and ending with the image width.
+//
+// Both images are w x h, in row-major order.  The input image is not modified,
+// unless output == image, which is allowed (for in-place correction).
+void destripe(uint8_t const * image, uint8_t * output, size_t w, size_t h, size_t YC,
+              std::vector<int> const & seam, bool writeplot=false,
+              int num_threads=1, DestripeReport * report=nullptr);
+
+// Same as above, but returns the corrected image in a new buffer.
+std::vector<uint8_t> destripe(uint8_t const * image, size_t w, size_t h, size_t YC,
+                              std::vector<int> const & seam, bool writeplot=false,
+                              int num_threads=1, DestripeReport * report=nullptr);
+
+// Reads rows [y, y+n) of the input image into buf (n*w bytes).
+typedef std::function<void(size_t y, size_t n, uint8_t * buf)> destripe_row_reader;
+
+// Writes rows [y, y+n) of the output image from buf (n*w bytes).
+typedef std::function<void(size_t y, size_t n, uint8_t const * buf)> destripe_row_writer;
+
+// Same as destripe(), but for images too large to hold in memory.
+// The input is read twice, in bands of band_height rows, from top to bottom:
+// first to find the column means (keeping only the narrow bands of pixels beside each seam),
+// and then again to correct each band and pass it to write_rows().
+//
+// Memory use is O(w * band_height), plus O(h) for the pixels beside the seams
+// (about 180 columns per seam).  The output is identical to destripe().
+void destripe_streaming(size_t w, size_t h, size_t YC, std::vector<int> const & seam,
+                        destripe_row_reader const & read_rows, destripe_row_writer const & write_rows,
+                        size_t band_height=256, bool writeplot=false,
+                        int num_threads=1, DestripeReport * report=nullptr);
 
 #endif // DESTRIPE_HPP
@@ -1,35 +1,489 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <strings.h>
+#include <thread>
+#include <vector>
+
+#include <glob.h>
+
 #include "destripe.hpp"
 #include "pngutils.hpp"
 
 
+// The seams (interior X values) from a seam file, or the default seams if there's no file.
+// A seam file lists the interior seam columns, separated by whitespace.  Lines starting with '#' are ignored.
+class Seams {
+public:
+    Seams() : use_default(true) {}
+
+    explicit Seams(const char *file_name) : use_default(false) {
+        std::ifstream f(file_name);
+        if (!f)
+            throw std::runtime_error(std::string("Could not open seam file '") + file_name + "'");
+        std::string line;
+        while (std::getline(f, line)) {
+            if (!line.empty() && line[0] == '#')
+                continue;
+            size_t pos = 0;
+            while (pos < line.size() && isspace(line[pos]))
+                pos++;
+            while (pos < line.size()) {
+                size_t used = 0;
+                interior.push_back(std::stoi(line.substr(pos), &used));
+                pos += used;
+                while (pos < line.size() && isspace(line[pos]))
+                    pos++;
+            }
+        }
+    }
+
+    // The complete seam list for an image of width w, including -1 and w.
+    std::vector<int> for_width(int w) const {
+        if (use_default)
+            return std::vector<int>{-1, 2066,4684,7574,10385,13222,15937,18531,21198,23826,26506,29175,31772, w};
+        std::vector<int> seam{-1};
+        seam.insert(seam.end(), interior.begin(), interior.end());
+        seam.push_back(w);
+        return seam;
+    }
+
+private:
+    bool use_default;
+    std::vector<int> interior;
+};
+
+// Destripes a png file too large to hold in memory, by reading it twice, band_rows at a time.
+int destripe_streaming_main(const char *input, const char *output, Seams const & seams, int band_rows,
+                            PngWriteOptions const & png_options, bool debug, bool verbose, int num_threads)
+{
+    try {
+        std::unique_ptr<PngRowReader> reader(new PngRowReader(input));
+        int w = reader->width(), h = reader->height();
+        if (reader->bit_depth() != 8)
+            throw std::runtime_error(std::string("Only 8 bit images can be destriped: '") + input + "'");
+        printf("opened '%s', w=%d h=%d (streaming, %d rows at a time)\n", input, w, h, band_rows);
+
+        // The file is reopened for the second pass.
+        size_t rows_read = 0;
+        auto read_rows = [&](size_t y, size_t n, uint8_t *buf) {
+            if (y == 0 && rows_read > 0)
+                reader.reset(new PngRowReader(input));
+            reader->read_rows(buf, int(n));
+            rows_read += n;
+        };
+
+        PngRowWriter writer(output, w, h, png_options);
+        auto write_rows = [&](size_t, size_t n, uint8_t const *buf) {
+            writer.write_rows(buf, int(n));
+        };
+
+        DestripeReport report;
+        destripe_streaming(size_t(w), size_t(h), size_t(h)/1000, seams.for_width(w), read_rows, write_rows,
+                           size_t(band_rows), debug, num_threads, &report);
+        writer.finish();
+        if (verbose)
+            print_destripe_report(report, stdout);
+        printf("Output file is '%s', %d x %d\n", output, w, h);
+    }
+    catch (std::exception const & e) {
+        printf("%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
+
+
+//
+// Batch mode: a pipeline of three stages (decode, destripe, encode), each with its own threads,
+// connected by bounded queues, so the stages of different images overlap
+// while only a few decoded images are in memory at once.
+//
+
+struct BatchImage {
+    std::string input, output;
+    int w = 0, h = 0;
+    std::vector<uint8_t> pixels;
+};
+typedef std::unique_ptr<BatchImage> batch_image_ptr;
+
+// A blocking FIFO with a maximum size.
+// Once close() is called (and the queue is empty), pop() returns false.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity_) : capacity(std::max<size_t>(capacity_, 1)) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [&]{ return items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    bool pop(T & item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&]{ return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable not_full, not_empty;
+};
+
+// Throughput statistics for one stage of the pipeline.
+struct StageStats {
+    const char *name;
+    int workers;
+    std::mutex mutex;
+    double busy_seconds = 0.0;  // summed over the workers
+    size_t images = 0;
+    size_t failures = 0;
+    double megapixels = 0.0;
+
+    StageStats(const char *name_, int workers_) : name(name_), workers(workers_) {}
+
+    void add(double seconds, BatchImage const & image) {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy_seconds += seconds;
+        images++;
+        megapixels += double(image.w) * image.h / 1e6;
+    }
+
+    void fail(BatchImage const & image, std::exception const & e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        failures++;
+        fprintf(stderr, "%s failed for '%s': %s\n", name, image.input.c_str(), e.what());
+    }
+
+    // Throughput is per thread of the stage (i.e. while busy), and in total (given the stage's threads).
+    void print() const {
+        double per_thread = busy_seconds / workers;
+        double rate = per_thread > 0 ? images / per_thread : 0.0;
+        printf("  %-9s %2d threads  %6d images  %8.1f Mpix  busy %8.2f s/thread  %7.2f images/s  %8.1f Mpix/s  (%d failed)\n",
+               name, workers, int(images), megapixels, per_thread, rate,
+               per_thread > 0 ? megapixels / per_thread : 0.0, int(failures));
+    }
+};
+
+// Starts 'workers' threads running f(); the last one to finish calls done()
+// (e.g. to close the stage's output queue).
+template <typename F, typename D>
+void start_stage(int workers, F f, D done, std::vector<std::thread> & threads) {
+    auto remaining = std::make_shared<std::atomic<int>>(workers);
+    for(int i=0; i<workers; i++) {
+        threads.emplace_back([=]() {
+            f();
+            if (--(*remaining) == 0)
+                done();
+        });
+    }
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Expands glob patterns (or plain file names) into a list of input files.
+// (Quote the pattern to avoid the shell's limit on the length of the command line.)
+std::vector<std::string> expand_inputs(std::vector<char *> const & patterns)
+{
+    std::vector<std::string> inputs;
+    for(char *pattern : patterns) {
+        glob_t g;
+        if (glob(pattern, 0, NULL, &g) == 0) {
+            for(size_t i=0; i<g.gl_pathc; i++)
+                inputs.push_back(g.gl_pathv[i]);
+        }
+        else {
+            inputs.push_back(pattern);  // No matches; the decode stage will report it.
+        }
+        globfree(&g);
+    }
+    return inputs;
+}
+
+// Reads a list of input files (one per line).
+void read_input_list(const char *file_name, std::vector<std::string> & inputs)
+{
+    std::ifstream f(file_name);
+    if (!f)
+        throw std::runtime_error(std::string("Could not open input list '") + file_name + "'");
+    std::string line;
+    while (std::getline(f, line)) {
+        if (!line.empty())
+            inputs.push_back(line);
+    }
+}
+
+// The output path for each input:  the input's file name, in output_dir.
+// Returns false (after reporting every problem) if any output would overwrite its own input,
+// or if two inputs have the same file name (so one output would replace the other).
+bool batch_output_paths(std::vector<std::string> const & inputs, std::string const & output_dir,
+                        std::vector<std::string> & outputs)
+{
+    bool ok = true;
+    std::map<std::string, size_t> first_input;  // output file name -> index of the first input with it
+    char *real_dir = realpath(output_dir.c_str(), NULL);
+    for(size_t i=0; i<inputs.size(); i++) {
+        size_t slash = inputs[i].rfind('/');
+        std::string name = inputs[i].substr(slash == std::string::npos ? 0 : slash+1);
+        outputs.push_back(output_dir + "/" + name);
+
+        auto inserted = first_input.insert(std::make_pair(name, i));
+        if (!inserted.second) {
+            printf("'%s' and '%s' would both be written to '%s'\n",
+                   inputs[inserted.first->second].c_str(), inputs[i].c_str(), outputs[i].c_str());
+            ok = false;
+        }
+
+        // Compare the real paths, so e.g. "-o ." or a symlinked directory is caught, too.
+        char *real_input = realpath(inputs[i].c_str(), NULL);
+        if (real_dir && real_input && std::string(real_dir) + "/" + name == real_input) {
+            printf("Output for '%s' would overwrite the input\n", inputs[i].c_str());
+            ok = false;
+        }
+        free(real_input);
+    }
+    free(real_dir);
+    return ok;
+}
+
+// Destripes every input, writing each output (with the same file name) to output_dir.
+// Images which can't be read, corrected, or written are reported and skipped.
+// Nothing is done if the outputs would overwrite any inputs (or each other).
+int destripe_batch_main(std::vector<std::string> const & inputs, std::string const & output_dir, Seams const & seams,
+                        int decode_workers, int destripe_workers, int encode_workers,
+                        int num_threads, size_t queue_size, PngWriteOptions const & png_options)
+{
+    std::vector<std::string> outputs;
+    if (!batch_output_paths(inputs, output_dir, outputs))
+        return 1;
+
+    auto const start = std::chrono::steady_clock::now();
+    BoundedQueue<batch_image_ptr> decoded(queue_size), destriped(queue_size);
+    StageStats decode_stats("decode", decode_workers);
+    StageStats destripe_stats("destripe", destripe_workers);
+    StageStats encode_stats("encode", encode_workers);
+    std::atomic<size_t> next_input(0);
+
+    auto decode = [&]() {
+        for(size_t i = next_input++; i < inputs.size(); i = next_input++) {
+            batch_image_ptr image(new BatchImage);
+            image->input = inputs[i];
+            image->output = outputs[i];
+            try {
+                auto t0 = std::chrono::steady_clock::now();
+                PngRowReader reader(inputs[i].c_str());
+                if (reader.bit_depth() != 8)
+                    throw std::runtime_error("Only 8 bit images can be destriped");
+                image->w = reader.width();
+                image->h = reader.height();
+                image->pixels.resize(size_t(image->w) * image->h);
+                reader.read_rows(image->pixels.data(), image->h);
+                decode_stats.add(seconds_since(t0), *image);
+            }
+            catch (std::exception const & e) {
+                decode_stats.fail(*image, e);
+                continue;
+            }
+            decoded.push(std::move(image));
+        }
+    };
+
+    auto correct = [&]() {
+        batch_image_ptr image;
+        while (decoded.pop(image)) {
+            try {
+                auto t0 = std::chrono::steady_clock::now();
+                uint8_t *pixels = image->pixels.data();
+                destripe(pixels, pixels, size_t(image->w), size_t(image->h), size_t(image->h)/1000,
+                         seams.for_width(image->w), false, num_threads, nullptr);
+                destripe_stats.add(seconds_since(t0), *image);
+            }
+            catch (std::exception const & e) {
+                destripe_stats.fail(*image, e);
+                continue;
+            }
+            destriped.push(std::move(image));
+        }
+    };
+
+    auto encode = [&]() {
+        batch_image_ptr image;
+        while (destriped.pop(image)) {
+            try {
+                auto t0 = std::chrono::steady_clock::now();
+                write_8bit_png(image->output.c_str(), image->pixels.data(), image->w, image->h, png_options);
+                encode_stats.add(seconds_since(t0), *image);
+            }
+            catch (std::exception const & e) {
+                encode_stats.fail(*image, e);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    start_stage(decode_workers, decode, [&]{ decoded.close(); }, threads);
+    start_stage(destripe_workers, correct, [&]{ destriped.close(); }, threads);
+    start_stage(encode_workers, encode, []{}, threads);
+    for(auto & t : threads)
+        t.join();
+
+    double wall_seconds = seconds_since(start);
+    printf("Destriped %d of %d images in %.2f s (%.2f images/s)\n",
+           int(encode_stats.images), int(inputs.size()), wall_seconds,
+           wall_seconds > 0 ? encode_stats.images / wall_seconds : 0.0);
+    decode_stats.print();
+    destripe_stats.print();
+    encode_stats.print();
+    return (encode_stats.images == inputs.size()) ? 0 : 1;
+}
+
+
 int main(int argc, char **argv) {
 
     std::vector<char *> noa;    // all non-option arguments
     bool debug = false;  // product debug images
+    bool verbose = false;  // print the diagnostics and timing report
+    int num_threads = 1;
+    int band_rows = 0;  // if non-zero, stream the image in bands of this many rows
+    const char *seam_file = nullptr;
+    const char *output_dir = nullptr;  // if given, run in batch mode
+    const char *input_list = nullptr;
+    int decode_workers = 1, destripe_workers = 1, encode_workers = 1;
+    int queue_size = 2;
+    PngWriteOptions png_options;
     for(int i=1; i<argc; i++) {
         if (argv[i][0] != '-')
             noa.push_back(argv[i]);
         else if (strcasecmp(argv[i], "-d") == 0)
             debug = true;
+        else if (strcasecmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if (strcasecmp(argv[i], "-t") == 0 && i+1 < argc)
+            num_threads = atoi(argv[++i]);  // 0 means one per core
+        else if (strcasecmp(argv[i], "-s") == 0 && i+1 < argc)
+            band_rows = atoi(argv[++i]);
+        else if (strcasecmp(argv[i], "-seams") == 0 && i+1 < argc)
+            seam_file = argv[++i];
+        else if (strcasecmp(argv[i], "-o") == 0 && i+1 < argc)
+            output_dir = argv[++i];
+        else if (strcasecmp(argv[i], "-l") == 0 && i+1 < argc)
+            input_list = argv[++i];
+        else if (strcasecmp(argv[i], "-p") == 0 && i+1 < argc) {
+            // threads for each stage: <decode>,<destripe>,<encode>
+            if (sscanf(argv[++i], "%d,%d,%d", &decode_workers, &destripe_workers, &encode_workers) != 3
+                || decode_workers < 1 || destripe_workers < 1 || encode_workers < 1) {
+                printf("Bad stage thread counts: %s\n", argv[i]);
+                return 42;
+            }
+        }
+        else if (strcasecmp(argv[i], "-q") == 0 && i+1 < argc) {
+            // images waiting between stages
+            if (sscanf(argv[++i], "%d", &queue_size) != 1 || queue_size < 1) {
+                printf("Bad queue size: %s\n", argv[i]);
+                return 42;
+            }
+        }
+        else if (strcasecmp(argv[i], "-z") == 0 && i+1 < argc) {
+            png_options.compression_level = atoi(argv[++i]);  // 0-9; low is fast (for intermediate products)
+            if (png_options.compression_level < 0 || png_options.compression_level > 9) {
+                printf("Bad png compression level %s (should be 0-9)\n", argv[i]);
+                return 42;
+            }
+        }
+        else if (strcasecmp(argv[i], "-f") == 0 && i+1 < argc) {
+            png_options.filters = png_filters_from_names(argv[++i]);
+            if (png_options.filters == 0) {
+                printf("Unknown png filter %s (should be none, sub, up, avg, paeth, all, or a list like up,sub)\n", argv[i]);
+                return 42;
+            }
+        }
         else {
             printf("Unknown option %s\n", argv[i]);
             return 42;
         }
     }
+
+    // The encoder uses the same number of threads (per image) as destripe()
+    png_options.num_threads = num_threads;
+
+    std::unique_ptr<Seams> seams;
+    std::vector<std::string> inputs;
+    try {
+        seams.reset(seam_file ? new Seams(seam_file) : new Seams());
+        if (output_dir) {
+            inputs = expand_inputs(noa);
+            if (input_list)
+                read_input_list(input_list, inputs);
+        }
+    }
+    catch (std::exception const & e) {
+        printf("%s\n", e.what());
+        return 1;
+    }
+
+    if (output_dir)
+        return destripe_batch_main(inputs, output_dir, *seams, decode_workers, destripe_workers, encode_workers,
+                                   num_threads, size_t(queue_size), png_options);
+
     if (noa.size() < 2) {
-        printf("Usage:  Destripe [-d] <input file> <output file>\n");
+        printf("Usage:  Destripe [-d] [-v] [-t <threads>] [-s <band rows>] [-seams <seam file>] [-z <level>] [-f <filter>]\n"
+               "                 <input file> <output file>\n");
+        printf("        Destripe [-t <threads>] [-seams <seam file>] [-z <level>] [-f <filter>]\n"
+               "                 [-p <decode>,<destripe>,<encode> threads] [-q <queue size>]\n"
+               "                 -o <output dir> [-l <input list file>] [<input file or glob> ...]\n");
         return 42;
     }
+    if (band_rows > 0)
+        return destripe_streaming_main(noa[0], noa[1], *seams, band_rows, png_options, debug, verbose, num_threads);
+
     int w, h;
     uint8 *image = read_8bit_png_file(noa[0], w, h);
+    if (image == NULL) {
+        printf("Could not read '%s'\n", noa[0]);
+        return 1;
+    }
     printf("opened '%s', w=%d h=%d\n", noa[0], w, h);
 
-    std::vector<int> seam{-1, 2066,4684,7574,10385,13222,15937,18531,21198,23826,26506,29175,31772, int(w)};
-
-
+    std::vector<int> seam = seams->for_width(w);
     size_t YC = size_t(h)/1000;
-    auto output = destripe(image, size_t(w), size_t(h), YC, seam);
+    // Correct the image in-place, so only one copy of it is in memory.
+    DestripeReport report;
+    destripe(image, image, size_t(w), size_t(h), YC, seam, debug, num_threads, &report);
+    if (verbose)
+        print_destripe_report(report, stdout);
 
     printf("Output file is '%s', %d x %d\n", noa[1], w, h);
-    write_8bit_png_file(noa[1], &output[0], w, h);
+    bool written = write_8bit_png_file(noa[1], image, w, h, png_options);
+    free(image);
+    return written ? 0 : 1;
 }
@@ -0,0 +1,401 @@
+#ifndef DVIDUTILS_DOWNSAMPLE_GRAYSCALE_HPP
+#define DVIDUTILS_DOWNSAMPLE_GRAYSCALE_HPP
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xtensor/xarray.hpp"
+
+#include "downsample_labels.hpp"
+#include "parallel.hpp"
+
+namespace dvidutils {
+
+    enum class GrayscaleReduction { mean, min, max };
+
+    inline GrayscaleReduction parse_grayscale_reduction(std::string const & name)
+    {
+        if (name == "mean")
+        {
+            return GrayscaleReduction::mean;
+        }
+        if (name == "min")
+        {
+            return GrayscaleReduction::min;
+        }
+        if (name == "max")
+        {
+            return GrayscaleReduction::max;
+        }
+        throw std::runtime_error("Unknown grayscale downsampling method: '" + name + "' (expected 'mean', 'min', or 'max')");
+    }
+
+    // Accumulator type for block sums (wide enough for any practical factor).
+    template <typename T> struct grayscale_sum_type { typedef T type; };
+    template <> struct grayscale_sum_type<uint8_t> { typedef uint32_t type; };
+    template <> struct grayscale_sum_type<uint16_t> { typedef uint64_t type; };
+
+    // Integer means are rounded (half up); float means are not.
+    template <typename T, typename sum_t>
+    typename std::enable_if<std::is_integral<T>::value, T>::type
+    mean_of_sum(sum_t sum, int n)
+    {
+        return static_cast<T>((sum + n/2) / n);
+    }
+
+    template <typename T, typename sum_t>
+    typename std::enable_if<!std::is_integral<T>::value, T>::type
+    mean_of_sum(sum_t sum, int n)
+    {
+        return static_cast<T>(sum / n);
+    }
+
+    // Reductions over one block. Values are always visited in C order,
+    // so float results don't depend on which kernel computed them.
+    template <typename T>
+    struct MeanReduction
+    {
+        typename grayscale_sum_type<T>::type sum;
+        int n;
+
+        void init(T v) { sum = v; n = 1; }
+        void add(T v) { sum += v; ++n; }
+        T result() const { return mean_of_sum<T>(sum, n); }
+    };
+
+    template <typename T>
+    struct MinReduction
+    {
+        T m;
+
+        void init(T v) { m = v; }
+        void add(T v) { m = (v < m) ? v : m; }
+        T result() const { return m; }
+    };
+
+    template <typename T>
+    struct MaxReduction
+    {
+        T m;
+
+        void init(T v) { m = v; }
+        void add(T v) { m = (v > m) ? v : m; }
+        T result() const { return m; }
+    };
+
+    // Generic kernel: any factor and any strides.
+    // Computes output slices [begin, end) (along the first axis) of the C-order result.
+    template <int N, typename reduction_t, typename T>
+    void downsample_grayscale_slab_generic( T const * image, std::ptrdiff_t const * strides, int factor,
+                                            std::vector<int> const & output_shape, size_t begin, size_t end,
+                                            T * res )
+    {
+        size_t const num_rows = (N == 3) ? output_shape[1] : 1;
+        size_t const width = output_shape[N-1];
+        int const block_rows = (N == 3) ? factor*factor : factor;
+
+        std::vector<T const *> rows(block_rows);
+        for (size_t i = begin; i < end; ++i)
+        {
+            for (size_t row = 0; row < num_rows; ++row)
+            {
+                // Input rows of this output row, in C order
+                for (int r = 0; r < block_rows; ++r)
+                {
+                    if (N == 3)
+                    {
+                        rows[r] = image + (i*factor + r/factor)*strides[0] + (row*factor + r%factor)*strides[1];
+                    }
+                    else
+                    {
+                        rows[r] = image + (i*factor + r)*strides[0];
+                    }
+                }
+
+                T * res_row = res + (i*num_rows + row)*width;
+                for (size_t x = 0; x < width; ++x)
+                {
+                    reduction_t reduction;
+                    reduction.init(rows[0][(x*factor)*strides[N-1]]);
+                    for (int r = 0; r < block_rows; ++r)
+                    {
+                        for (int dx = (r == 0) ? 1 : 0; dx < factor; ++dx)
+                        {
+                            reduction.add(rows[r][(x*factor + dx)*strides[N-1]]);
+                        }
+                    }
+                    res_row[x] = reduction.result();
+                }
+            }
+        }
+    }
+
+    // Factor-2 row kernel, for contiguous rows: reduces R input rows
+    // (2 in 2D, 4 in 3D) into one output row, starting at output column x_begin.
+    // The SIMD overloads below handle a prefix of the row and use this for the remainder.
+    template <typename reduction_t, typename T>
+    void downsample_grayscale_row_x2( T const * const * rows, int R, size_t x_begin, size_t width,
+                                      GrayscaleReduction, T * res_row )
+    {
+        for (size_t x = x_begin; x < width; ++x)
+        {
+            reduction_t reduction;
+            reduction.init(rows[0][2*x]);
+            reduction.add(rows[0][2*x + 1]);
+            for (int r = 1; r < R; ++r)
+            {
+                reduction.add(rows[r][2*x]);
+                reduction.add(rows[r][2*x + 1]);
+            }
+            res_row[x] = reduction.result();
+        }
+    }
+
+#ifdef __SSE2__
+    // uint8: 16 outputs per iteration.
+    // Adjacent pixels are separated into the low and high bytes of 16-bit lanes,
+    // so sums can't overflow and min/max can use the 16-bit instructions.
+    template <typename reduction_t>
+    void downsample_grayscale_row_x2( uint8_t const * const * rows, int R, size_t x_begin, size_t width,
+                                      GrayscaleReduction reduction, uint8_t * res_row )
+    {
+        __m128i const low_bytes = _mm_set1_epi16(0x00FF);
+        size_t x = x_begin;
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i result[2];
+            for (int half = 0; half < 2; ++half)
+            {
+                auto load = [&](int r) { return _mm_loadu_si128(reinterpret_cast<__m128i const *>(rows[r] + 2*x + 16*half)); };
+                if (reduction == GrayscaleReduction::mean)
+                {
+                    // n = 2R is 4 or 8; round half up.
+                    __m128i sum = _mm_set1_epi16(R);
+                    for (int r = 0; r < R; ++r)
+                    {
+                        __m128i v = load(r);
+                        sum = _mm_add_epi16(sum, _mm_and_si128(v, low_bytes));
+                        sum = _mm_add_epi16(sum, _mm_srli_epi16(v, 8));
+                    }
+                    result[half] = _mm_srl_epi16(sum, _mm_cvtsi32_si128((R == 2) ? 2 : 3));
+                }
+                else if (reduction == GrayscaleReduction::min)
+                {
+                    __m128i m = load(0);
+                    for (int r = 1; r < R; ++r)
+                    {
+                        m = _mm_min_epu8(m, load(r));
+                    }
+                    result[half] = _mm_min_epi16(_mm_and_si128(m, low_bytes), _mm_srli_epi16(m, 8));
+                }
+                else
+                {
+                    __m128i m = load(0);
+                    for (int r = 1; r < R; ++r)
+                    {
+                        m = _mm_max_epu8(m, load(r));
+                    }
+                    result[half] = _mm_max_epi16(_mm_and_si128(m, low_bytes), _mm_srli_epi16(m, 8));
+                }
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(res_row + x), _mm_packus_epi16(result[0], result[1]));
+        }
+        downsample_grayscale_row_x2<reduction_t, uint8_t>(rows, R, x, width, reduction, res_row);
+    }
+
+    // uint16: 8 outputs per iteration.
+    // SSE2 only has signed 16-bit min/max (and multiply-add), so pixels are biased by 0x8000
+    // (flipping the top bit), which maps unsigned order onto signed order.
+    template <typename reduction_t>
+    void downsample_grayscale_row_x2( uint16_t const * const * rows, int R, size_t x_begin, size_t width,
+                                      GrayscaleReduction reduction, uint16_t * res_row )
+    {
+        __m128i const bias = _mm_set1_epi16(short(0x8000));
+        size_t x = x_begin;
+        for (; x + 8 <= width; x += 8)
+        {
+            // 32-bit lanes of (signed, biased) results, for 4 outputs each
+            __m128i result[2];
+            for (int half = 0; half < 2; ++half)
+            {
+                auto load = [&](int r)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(rows[r] + 2*x + 8*half));
+                    return _mm_xor_si128(v, bias);
+                };
+                if (reduction == GrayscaleReduction::mean)
+                {
+                    // Adjacent biased pixels sum to (a + b - 65536) in 32 bits, which is corrected for here,
+                    // along with rounding half up (n = 2R is 4 or 8).
+                    __m128i sum = _mm_set1_epi32(R * 65536 + R);
+                    for (int r = 0; r < R; ++r)
+                    {
+                        sum = _mm_add_epi32(sum, _mm_madd_epi16(load(r), _mm_set1_epi16(1)));
+                    }
+                    __m128i mean = _mm_srl_epi32(sum, _mm_cvtsi32_si128((R == 2) ? 2 : 3));
+                    result[half] = _mm_sub_epi32(mean, _mm_set1_epi32(32768));
+                }
+                else
+                {
+                    bool is_min = (reduction == GrayscaleReduction::min);
+                    __m128i m = load(0);
+                    for (int r = 1; r < R; ++r)
+                    {
+                        m = is_min ? _mm_min_epi16(m, load(r)) : _mm_max_epi16(m, load(r));
+                    }
+                    // Sign-extend the even and odd columns to 32 bits.  (The 16-bit min/max of those
+                    // also picks the matching upper halves, since they're the sign extensions.)
+                    __m128i even = _mm_srai_epi32(_mm_slli_epi32(m, 16), 16);
+                    __m128i odd = _mm_srai_epi32(m, 16);
+                    result[half] = is_min ? _mm_min_epi16(even, odd) : _mm_max_epi16(even, odd);
+                }
+            }
+            __m128i packed = _mm_packs_epi32(result[0], result[1]);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(res_row + x), _mm_xor_si128(packed, bias));
+        }
+        downsample_grayscale_row_x2<reduction_t, uint16_t>(rows, R, x, width, reduction, res_row);
+    }
+
+    // float32: 4 outputs per iteration, in the same order of operations as the scalar reductions.
+    template <typename reduction_t>
+    void downsample_grayscale_row_x2( float const * const * rows, int R, size_t x_begin, size_t width,
+                                      GrayscaleReduction reduction, float * res_row )
+    {
+        // Splits 8 consecutive pixels of row r into their even and odd columns
+        auto split = [&](size_t x, int r, __m128 & even, __m128 & odd)
+        {
+            __m128 a = _mm_loadu_ps(rows[r] + 2*x);
+            __m128 b = _mm_loadu_ps(rows[r] + 2*x + 4);
+            even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0));
+            odd = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1));
+        };
+
+        auto combine = [&](__m128 acc, __m128 v)
+        {
+            if (reduction == GrayscaleReduction::mean)
+            {
+                return _mm_add_ps(acc, v);
+            }
+            if (reduction == GrayscaleReduction::min)
+            {
+                return _mm_min_ps(v, acc);
+            }
+            return _mm_max_ps(v, acc);
+        };
+
+        size_t x = x_begin;
+        for (; x + 4 <= width; x += 4)
+        {
+            __m128 even, odd;
+            split(x, 0, even, odd);
+            __m128 acc = combine(even, odd);
+            for (int r = 1; r < R; ++r)
+            {
+                split(x, r, even, odd);
+                acc = combine(acc, even);
+                acc = combine(acc, odd);
+            }
+            if (reduction == GrayscaleReduction::mean)
+            {
+                acc = _mm_div_ps(acc, _mm_set1_ps(2.0f*R));
+            }
+            _mm_storeu_ps(res_row + x, acc);
+        }
+        downsample_grayscale_row_x2<reduction_t, float>(rows, R, x, width, reduction, res_row);
+    }
+#endif
+
+    // Factor-2 kernel for images with contiguous rows.
+    template <int N, typename reduction_t, typename T>
+    void downsample_grayscale_slab_x2( T const * image, std::ptrdiff_t const * strides,
+                                       std::vector<int> const & output_shape, size_t begin, size_t end,
+                                       GrayscaleReduction reduction, T * res )
+    {
+        size_t const num_rows = (N == 3) ? output_shape[1] : 1;
+        size_t const width = output_shape[N-1];
+        int const R = (N == 3) ? 4 : 2;
+
+        T const * rows[4];
+        for (size_t i = begin; i < end; ++i)
+        {
+            for (size_t row = 0; row < num_rows; ++row)
+            {
+                for (int r = 0; r < R; ++r)
+                {
+                    if (N == 3)
+                    {
+                        rows[r] = image + (2*i + r/2)*strides[0] + (2*row + r%2)*strides[1];
+                    }
+                    else
+                    {
+                        rows[r] = image + (2*i + r)*strides[0];
+                    }
+                }
+                downsample_grayscale_row_x2<reduction_t>(rows, R, 0, width, reduction, res + (i*num_rows + row)*width);
+            }
+        }
+    }
+
+    template <int N, typename reduction_t, typename T>
+    void downsample_grayscale_slab( T const * image, std::ptrdiff_t const * strides, int factor,
+                                    std::vector<int> const & output_shape, size_t begin, size_t end,
+                                    GrayscaleReduction reduction, T * res )
+    {
+        if (factor == 2 && strides[N-1] == 1)
+        {
+            downsample_grayscale_slab_x2<N, reduction_t>(image, strides, output_shape, begin, end, reduction, res);
+        }
+        else
+        {
+            downsample_grayscale_slab_generic<N, reduction_t>(image, strides, factor, output_shape, begin, end, res);
+        }
+    }
+
+    // Downsamples a grayscale image or volume by the given factor,
+    // reducing each block to its mean (rounded, for integer types), min, or max.
+    // Multi-threaded over slabs of the output, like downsample_labels().
+    template <typename array_t, int N>
+    xt::xarray<typename array_t::value_type>
+    downsample_grayscale( array_t const & image, int factor, GrayscaleReduction reduction, int num_threads=1 )
+    {
+        using T = typename array_t::value_type;
+        using result_type = xt::xarray<T>;
+
+        std::vector<int> output_shape = downsample_labels_output_shape(image.shape(), factor);
+        auto res = result_type::from_shape(output_shape);
+
+        // Note: The strides of size-1 axes don't matter, since their index is always 0.
+        std::ptrdiff_t strides[N];
+        std::copy(image.strides().begin(), image.strides().end(), strides);
+        if (image.shape()[N-1] == 1)
+        {
+            strides[N-1] = 1;
+        }
+
+        parallel_for_slabs(output_shape[0], num_threads, [&](size_t begin, size_t end)
+        {
+            switch (reduction)
+            {
+                case GrayscaleReduction::mean:
+                    downsample_grayscale_slab<N, MeanReduction<T>>(image.data(), strides, factor, output_shape, begin, end, reduction, res.data());
+                    break;
+                case GrayscaleReduction::min:
+                    downsample_grayscale_slab<N, MinReduction<T>>(image.data(), strides, factor, output_shape, begin, end, reduction, res.data());
+                    break;
+                case GrayscaleReduction::max:
+                    downsample_grayscale_slab<N, MaxReduction<T>>(image.data(), strides, factor, output_shape, begin, end, reduction, res.data());
+                    break;
+            }
+        });
+        return res;
+    }
+}
+
+#endif
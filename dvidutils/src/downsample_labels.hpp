@@ -2,6 +2,8 @@
 #define DVIDUTILS_DOWNSAMPLE_LABELS_HPP
 
 #include <algorithm>
+#include <limits>
+#include <vector>
 #include <boost/container/flat_map.hpp>
 
 #include "xtensor/xarray.hpp"
@@ -11,13 +13,15 @@
 #include "xtensor/xvectorize.hpp"
 #include "xtensor/xeval.hpp"
 
+#include "parallel.hpp"
+
 namespace dvidutils {
     
     template <typename label_array_t, int N>
     struct downsample_labels_functor
     {
         using result_type = xt::xarray<typename label_array_t::value_type>;
-        result_type operator()( label_array_t const & labels, int factor, bool suppress_zero=false );
+        result_type operator()( label_array_t const & labels, int factor, bool suppress_zero=false, int num_threads=1 );
     };
 
     template <class pair_t>
@@ -43,90 +47,373 @@ namespace dvidutils {
         }
         return p1.second < p2.second;
     }
-    
-    
-    template <typename label_array_t>
-    struct downsample_labels_functor<label_array_t, 3>
+
+    // Returns the label with the maximum count in the given (ordered) count map.
+    template <typename counts_t>
+    typename counts_t::key_type mode_of_counts(counts_t const & counts, bool suppress_zero)
     {
-        using result_type = xt::xarray<typename label_array_t::value_type>;
-        result_type operator()( label_array_t const & labels, int factor, bool suppress_zero=false )
+        // Note: This function guarantees that ties are resolved in favor of the lower value.
+        //       Since flat_map is ordered, and max_element chooses the first tied value,
+        //       we're in compliance with that guarantee.
+        auto max_pair = counts.begin();
+        if (suppress_zero)
         {
-            using label_t = typename label_array_t::value_type;
-            
-            std::vector<int> output_shape = {};
-            for (auto s : labels.shape())
+            max_pair = std::max_element( counts.begin(), counts.end(),
+                                        compare_pairs_suppress_zero<typename counts_t::value_type>);
+        }
+        else
+        {
+            max_pair = std::max_element( counts.begin(), counts.end(),
+                                        compare_pairs<typename counts_t::value_type>);
+        }
+        return max_pair->first;
+    }
+
+
+    // Returns the most frequent of the N labels in 'block', with the same
+    // guarantees as the flat_map path below: ties are resolved in favor of the
+    // lower value, and with suppress_zero, 0 only wins if the block is all zeros.
+    // Note: 'block' may be reordered.
+    template <int N, typename label_t>
+    label_t block_mode(label_t * block, bool suppress_zero)
+    {
+        label_t best = 0;
+        int best_count = 0;
+
+        if (N <= 8)
+        {
+            // Small blocks: count pairwise equalities.
+            for (int i = 0; i < N; ++i)
+            {
+                label_t label = block[i];
+                if (suppress_zero && label == 0)
+                {
+                    continue;
+                }
+                int count = 0;
+                for (int j = 0; j < N; ++j)
+                {
+                    count += (block[j] == label);
+                }
+                if (count > best_count || (count == best_count && label < best))
+                {
+                    best = label;
+                    best_count = count;
+                }
+            }
+            return best;
+        }
+
+        // Larger blocks: sort, then scan the runs in ascending order,
+        // so the first run with the maximum count is the lowest label.
+        std::sort(block, block + N);
+        for (int i = 0; i < N; )
+        {
+            int j = i + 1;
+            while (j < N && block[j] == block[i])
             {
-                output_shape.push_back(s);
+                ++j;
             }
-            for (auto & s : output_shape)
+            if ((j - i) > best_count && !(suppress_zero && block[i] == 0))
             {
-                if (s == 0) {
-                    // Technically, we could omit this check -- it should simply result in a zero-size output.
-                    std::ostringstream ss;
-                    ss << "Precondition violation: zero-size array.  Shape: (";
-                    for (auto d : labels.shape())
+                best = block[i];
+                best_count = j - i;
+            }
+            i = j;
+        }
+        return best;
+    }
+
+    // The default label map for the kernels below.
+    struct identity_label_map
+    {
+        template <typename label_t>
+        label_t operator()(label_t label) const
+        {
+            return label;
+        }
+    };
+
+    // Specialized kernels for small, fixed downsampling factors (2 and 4).
+    // They read the input through raw pointers, which requires its rows
+    // (the last axis) to be contiguous, and write into a C-order result.
+    //
+    // Each input label is passed through 'map' before it is counted,
+    // so the result is the mode of the MAPPED labels in each block.
+    template <int F, typename label_t, typename out_t, typename map_t=identity_label_map>
+    void downsample_labels_slab_3d( label_t const * labels, std::ptrdiff_t stride_z, std::ptrdiff_t stride_y,
+                                    std::vector<int> const & output_shape, size_t z_begin, size_t z_end,
+                                    bool suppress_zero, out_t * res, map_t map=map_t() )
+    {
+        out_t block[F*F*F];
+        label_t const * rows[F*F];
+        for (size_t z_res = z_begin; z_res < z_end; ++z_res)
+        {
+            for (size_t y_res = 0; y_res < output_shape[1]; ++y_res)
+            {
+                for (int dz = 0; dz < F; ++dz)
+                {
+                    for (int dy = 0; dy < F; ++dy)
                     {
-                        ss << d << ", ";
+                        rows[dz*F + dy] = labels + (z_res*F + dz)*stride_z + (y_res*F + dy)*stride_y;
                     }
-                    ss << ")";
-                    throw std::runtime_error(ss.str().c_str());
                 }
-                if (s % factor != 0)
+
+                out_t * res_row = res + (z_res*output_shape[1] + y_res)*output_shape[2];
+                for (size_t x_res = 0; x_res < output_shape[2]; ++x_res)
                 {
-                    std::ostringstream ss;
-                    ss << "Precondition violation: Downsampling factor must divide cleanly into array shape: (";
-                    for (auto d : labels.shape())
+                    for (int r = 0; r < F*F; ++r)
                     {
-                        ss << d << ", ";
+                        for (int dx = 0; dx < F; ++dx)
+                        {
+                            block[r*F + dx] = map(rows[r][x_res*F + dx]);
+                        }
                     }
-                    ss << ")";
-                    throw std::runtime_error(ss.str().c_str());
+                    res_row[x_res] = block_mode<F*F*F>(block, suppress_zero);
                 }
-                
-                s /= factor;
             }
+        }
+    }
 
-            auto res = result_type::from_shape(output_shape);
+    template <int F, typename label_t, typename out_t, typename map_t=identity_label_map>
+    void downsample_labels_slab_2d( label_t const * labels, std::ptrdiff_t stride_y,
+                                    std::vector<int> const & output_shape, size_t y_begin, size_t y_end,
+                                    bool suppress_zero, out_t * res, map_t map=map_t() )
+    {
+        out_t block[F*F];
+        label_t const * rows[F];
+        for (size_t y_res = y_begin; y_res < y_end; ++y_res)
+        {
+            for (int dy = 0; dy < F; ++dy)
+            {
+                rows[dy] = labels + (y_res*F + dy)*stride_y;
+            }
+
+            out_t * res_row = res + y_res*output_shape[1];
+            for (size_t x_res = 0; x_res < output_shape[1]; ++x_res)
+            {
+                for (int r = 0; r < F; ++r)
+                {
+                    for (int dx = 0; dx < F; ++dx)
+                    {
+                        block[r*F + dx] = map(rows[r][x_res*F + dx]);
+                    }
+                }
+                res_row[x_res] = block_mode<F*F>(block, suppress_zero);
+            }
+        }
+    }
+
+    // Kernels for any other factor, with the same raw-pointer traversal,
+    // counting each block into one re-used flat_map.
+    template <typename label_t, typename out_t, typename map_t=identity_label_map>
+    void downsample_labels_slab_3d( label_t const * labels, std::ptrdiff_t stride_z, std::ptrdiff_t stride_y, int factor,
+                                    std::vector<int> const & output_shape, size_t z_begin, size_t z_end,
+                                    bool suppress_zero, out_t * res, map_t map=map_t() )
+    {
+        boost::container::flat_map<out_t, int> counts;
+        std::vector<label_t const *> rows(factor*factor);
+        for (size_t z_res = z_begin; z_res < z_end; ++z_res)
+        {
+            for (size_t y_res = 0; y_res < output_shape[1]; ++y_res)
+            {
+                for (int dz = 0; dz < factor; ++dz)
+                {
+                    for (int dy = 0; dy < factor; ++dy)
+                    {
+                        rows[dz*factor + dy] = labels + (z_res*factor + dz)*stride_z + (y_res*factor + dy)*stride_y;
+                    }
+                }
 
-            // Create just one flat_map to re-use for every block
-            boost::container::flat_map<label_t, int> counts;
+                out_t * res_row = res + (z_res*output_shape[1] + y_res)*output_shape[2];
+                for (size_t x_res = 0; x_res < output_shape[2]; ++x_res)
+                {
+                    counts.clear();
+                    for (auto row : rows)
+                    {
+                        row += x_res*factor;
+                        for (int dx = 0; dx < factor; ++dx)
+                        {
+                            counts[map(row[dx])] += 1;
+                        }
+                    }
+                    res_row[x_res] = mode_of_counts(counts, suppress_zero);
+                }
+            }
+        }
+    }
+
+    template <typename label_t, typename out_t, typename map_t=identity_label_map>
+    void downsample_labels_slab_2d( label_t const * labels, std::ptrdiff_t stride_y, int factor,
+                                    std::vector<int> const & output_shape, size_t y_begin, size_t y_end,
+                                    bool suppress_zero, out_t * res, map_t map=map_t() )
+    {
+        boost::container::flat_map<out_t, int> counts;
+        for (size_t y_res = y_begin; y_res < y_end; ++y_res)
+        {
+            out_t * res_row = res + y_res*output_shape[1];
+            for (size_t x_res = 0; x_res < output_shape[1]; ++x_res)
+            {
+                counts.clear();
+                for (int dy = 0; dy < factor; ++dy)
+                {
+                    label_t const * row = labels + (y_res*factor + dy)*stride_y + x_res*factor;
+                    for (int dx = 0; dx < factor; ++dx)
+                    {
+                        counts[map(row[dx])] += 1;
+                    }
+                }
+                res_row[x_res] = mode_of_counts(counts, suppress_zero);
+            }
+        }
+    }
+
+    // Downsamples output slices [begin, end) (along the first axis) of the C-order
+    // result 'res', picking the kernel for the given factor.
+    // The rows of 'labels' must be contiguous; 'strides' gives its remaining strides.
+    template <int N, typename label_t, typename out_t, typename map_t=identity_label_map>
+    void downsample_labels_slab( label_t const * labels, std::ptrdiff_t const * strides, int factor,
+                                 std::vector<int> const & output_shape, size_t begin, size_t end,
+                                 bool suppress_zero, out_t * res, map_t const & map=map_t() )
+    {
+        if (N == 3)
+        {
+            if (factor == 2)
+            {
+                downsample_labels_slab_3d<2>(labels, strides[0], strides[1], output_shape, begin, end, suppress_zero, res, map);
+            }
+            else if (factor == 4)
+            {
+                downsample_labels_slab_3d<4>(labels, strides[0], strides[1], output_shape, begin, end, suppress_zero, res, map);
+            }
+            else
+            {
+                downsample_labels_slab_3d(labels, strides[0], strides[1], factor, output_shape, begin, end, suppress_zero, res, map);
+            }
+        }
+        else
+        {
+            if (factor == 2)
+            {
+                downsample_labels_slab_2d<2>(labels, strides[0], output_shape, begin, end, suppress_zero, res, map);
+            }
+            else if (factor == 4)
+            {
+                downsample_labels_slab_2d<4>(labels, strides[0], output_shape, begin, end, suppress_zero, res, map);
+            }
+            else
+            {
+                downsample_labels_slab_2d(labels, strides[0], factor, output_shape, begin, end, suppress_zero, res, map);
+            }
+        }
+    }
+
+    // True if the last axis of the given array can be traversed with a plain pointer.
+    template <typename array_t>
+    bool rows_are_contiguous(array_t const & a)
+    {
+        auto const & shape = a.shape();
+        auto const & strides = a.strides();
+        size_t last = shape.size() - 1;
+        return (shape[last] <= 1 || strides[last] == 1);
+    }
+
+
+    // Returns the shape of the downsampled array,
+    // after checking that the factor divides cleanly into the given shape.
+    template <typename shape_t>
+    std::vector<int> downsample_labels_output_shape( shape_t const & shape, int factor )
+    {
+        // FIXME: Why is this weird shape initialization necessary?
+        //        When I tried something more straightforward, (auto output_shape = labels.shape())
+        //        It didn't give me a copy, it gave me some weird adaptor that was a reference to the original...
+        std::vector<int> output_shape = {};
+        for (auto s : shape)
+        {
+            output_shape.push_back(s);
+        }
+        for (auto & s : output_shape)
+        {
+            if (s == 0) {
+                // Technically, we could omit this check -- it should simply result in a zero-size output.
+                std::ostringstream ss;
+                ss << "Precondition violation: zero-size array.  Shape: (";
+                for (auto d : shape)
+                {
+                    ss << d << ", ";
+                }
+                ss << ")";
+                throw std::runtime_error(ss.str().c_str());
+            }
+            if (s % factor != 0)
+            {
+                std::ostringstream ss;
+                ss << "Precondition violation: Downsampling factor must divide cleanly into array shape: (";
+                for (auto d : shape)
+                {
+                    ss << d << ", ";
+                }
+                ss << ")";
+                throw std::runtime_error(ss.str().c_str());
+            }
+            
+            s /= factor;
+        }
+        return output_shape;
+    }
+    
+    
+    template <typename label_array_t>
+    struct downsample_labels_functor<label_array_t, 3>
+    {
+        using result_type = xt::xarray<typename label_array_t::value_type>;
+        result_type operator()( label_array_t const & labels, int factor, bool suppress_zero=false, int num_threads=1 )
+        {
+            using label_t = typename label_array_t::value_type;
             
-            for (size_t z_res = 0; z_res < output_shape[0]; ++z_res)
+            std::vector<int> output_shape = downsample_labels_output_shape(labels.shape(), factor);
+
+            auto res = result_type::from_shape(output_shape);
+
+            // Each thread handles a slab of output z-slices
+            // (the default is a single slab, i.e. serial).
+            if (rows_are_contiguous(labels))
             {
-                size_t z = z_res*factor;
-                for (size_t y_res = 0; y_res < output_shape[1]; ++y_res)
+                std::ptrdiff_t strides[2] = { labels.strides()[0], labels.strides()[1] };
+                parallel_for_slabs(output_shape[0], num_threads, [&](size_t z_begin, size_t z_end)
                 {
-                    size_t y = y_res*factor;
-                    for (size_t x_res = 0; x_res < output_shape[2]; ++x_res)
+                    downsample_labels_slab<3>(labels.data(), strides, factor, output_shape, z_begin, z_end, suppress_zero, res.data());
+                });
+                return res;
+            }
+
+            // Fallback for arrays whose rows aren't contiguous: one view per block.
+            parallel_for_slabs(output_shape[0], num_threads, [&](size_t z_begin, size_t z_end)
+            {
+                // Create just one flat_map to re-use for every block
+                boost::container::flat_map<label_t, int> counts;
+            
+                for (size_t z_res = z_begin; z_res < z_end; ++z_res)
+                {
+                    size_t z = z_res*factor;
+                    for (size_t y_res = 0; y_res < output_shape[1]; ++y_res)
                     {
-                        size_t x = x_res*factor;
+                        size_t y = y_res*factor;
+                        for (size_t x_res = 0; x_res < output_shape[2]; ++x_res)
+                        {
+                            size_t x = x_res*factor;
                         
-                        auto block = xt::view(labels, xt::range(z,z+factor), xt::range(y,y+factor), xt::range(x,x+factor));
+                            auto block = xt::view(labels, xt::range(z,z+factor), xt::range(y,y+factor), xt::range(x,x+factor));
                         
-                        // Load the counts
-                        counts.clear();
-                        xt::eval(xt::vectorize([&](label_t label) { counts[label] += 1; return 0;})(block));
+                            // Load the counts
+                            counts.clear();
+                            xt::eval(xt::vectorize([&](label_t label) { counts[label] += 1; return 0;})(block));
                         
-                        // Find the maximum count
-                        // Note: This function guarantees that ties are resolved in favor of the lower value.
-                        //       Since flat_map is ordered, and max_element chooses the first tied value,
-                        //       we're in compliance with that guarantee.
-                        auto max_pair = counts.begin();
-                        if (suppress_zero)
-                        {
-                            max_pair = std::max_element( counts.begin(), counts.end(),
-                                                        compare_pairs_suppress_zero<typename decltype(counts)::value_type>);
+                            res(z_res, y_res, x_res) = mode_of_counts(counts, suppress_zero);
                         }
-                        else
-                        {
-                            max_pair = std::max_element( counts.begin(), counts.end(),
-                                                        compare_pairs<typename decltype(counts)::value_type>);
-                        }
-                        
-                        res(z_res, y_res, x_res) = max_pair->first;
                     }
                 }
-            }
+            });
             
             return res;
         }
@@ -136,90 +423,292 @@ namespace dvidutils {
     struct downsample_labels_functor<label_array_t, 2>
     {
         using result_type = xt::xarray<typename label_array_t::value_type>;
-        result_type operator()( label_array_t const & labels, int factor, bool suppress_zero=false )
+        result_type operator()( label_array_t const & labels, int factor, bool suppress_zero=false, int num_threads=1 )
         {
             using label_t = typename label_array_t::value_type;
 
-            // FIXME: Why is this weird shape initialization necessary?
-            //        When I tried something more straightforward, (auto output_shape = labels.shape())
-            //        It didn't give me a copy, it gave me some weird adaptor that was a reference to the original...
-            std::vector<int> output_shape = {};
-            for (auto s : labels.shape())
+            std::vector<int> output_shape = downsample_labels_output_shape(labels.shape(), factor);
+            auto res = result_type::from_shape(output_shape);
+
+            // Each thread handles a slab of output rows
+            // (the default is a single slab, i.e. serial).
+            if (rows_are_contiguous(labels))
+            {
+                std::ptrdiff_t strides[1] = { labels.strides()[0] };
+                parallel_for_slabs(output_shape[0], num_threads, [&](size_t y_begin, size_t y_end)
+                {
+                    downsample_labels_slab<2>(labels.data(), strides, factor, output_shape, y_begin, y_end, suppress_zero, res.data());
+                });
+                return res;
+            }
+
+            // Fallback for arrays whose rows aren't contiguous: one view per block.
+            parallel_for_slabs(output_shape[0], num_threads, [&](size_t y_begin, size_t y_end)
+            {
+                // Create just one flat_map to re-use for every block
+                boost::container::flat_map<label_t, int> counts;
+                for (size_t y_res = y_begin; y_res < y_end; ++y_res)
+                {
+                    size_t y = y_res*factor;
+                    for (size_t x_res = 0; x_res < output_shape[1]; ++x_res)
+                    {
+                        size_t x = x_res*factor;
+                    
+                        auto block = xt::view(labels, xt::range(y,y+factor), xt::range(x,x+factor));
+                    
+                        // Load the counts
+                        counts.clear();
+                        xt::eval(xt::vectorize([&](label_t label) { counts[label] += 1; return 0;})(block));
+                    
+                        res(y_res, x_res) = mode_of_counts(counts, suppress_zero);
+                    }
+                }
+            });
+            
+            return res;
+        }
+    };
+    
+    template <typename labelarray_t, int N>
+    labelarray_t downsample_labels(labelarray_t const & labels, int factor, bool suppress_zero, int num_threads=1 )
+    {
+        return downsample_labels_functor<labelarray_t, N>()(labels, factor, suppress_zero, num_threads);
+    }
+
+    // Equivalent to downsample_labels(mapper.apply(labels, allow_unmapped), ...),
+    // but each label is mapped on the fly inside the downsampling kernel,
+    // so the full-resolution mapped array is never materialized.
+    // (Each thread uses its own mapper.cached_lookup().)
+    template <typename labelarray_t, int N, typename mapper_t>
+    xt::xarray<typename mapper_t::codomain_type>
+    downsample_labels_mapped( labelarray_t const & labels, mapper_t & mapper, int factor,
+                              bool suppress_zero=false, bool allow_unmapped=false, int num_threads=1 )
+    {
+        using label_t = typename labelarray_t::value_type;
+        using result_type = xt::xarray<typename mapper_t::codomain_type>;
+
+        if (!rows_are_contiguous(labels))
+        {
+            // The fused kernels need contiguous rows.
+            auto mapped = mapper.apply(labels, allow_unmapped);
+            return downsample_labels<result_type, N>(mapped, factor, suppress_zero, num_threads);
+        }
+
+        std::vector<int> output_shape = downsample_labels_output_shape(labels.shape(), factor);
+        auto res = result_type::from_shape(output_shape);
+
+        std::ptrdiff_t strides[N-1];
+        std::copy(labels.strides().begin(), labels.strides().begin() + (N-1), strides);
+
+        auto lookup = mapper.template cached_lookup<label_t>(allow_unmapped);
+        parallel_for_slabs(output_shape[0], num_threads, [&](size_t begin, size_t end)
+        {
+            downsample_labels_slab<N>(labels.data(), strides, factor, output_shape, begin, end, suppress_zero, res.data(), lookup);
+        });
+        return res;
+    }
+
+
+    // Returns the shapes of levels 1..levels of a factor-2 label pyramid,
+    // i.e. the shapes produced by calling downsample_labels(..., 2) repeatedly.
+    template <typename shape_t>
+    std::vector<std::vector<size_t>> downsample_labels_pyramid_shapes(shape_t const & shape, int levels)
+    {
+        if (levels < 1)
+        {
+            std::ostringstream ss;
+            ss << "Precondition violation: levels must be at least 1 (got " << levels << ")";
+            throw std::runtime_error(ss.str().c_str());
+        }
+
+        // 2**levels is only computed once it's known to fit in a size_t;
+        // beyond that, no (nonzero) dimension can be divisible by it anyway.
+        bool const representable = (levels < std::numeric_limits<size_t>::digits);
+
+        std::vector<size_t> level_shape(shape.begin(), shape.end());
+        for (auto s : level_shape)
+        {
+            if (s == 0 || !representable || s % (size_t(1) << levels) != 0)
             {
-                output_shape.push_back(s);
+                std::ostringstream ss;
+                ss << "Precondition violation: Array shape must be divisible by 2**" << levels << ": (";
+                for (auto d : shape)
+                {
+                    ss << d << ", ";
+                }
+                ss << ")";
+                throw std::runtime_error(ss.str().c_str());
             }
-            for (auto & s : output_shape)
+        }
+
+        std::vector<std::vector<size_t>> shapes;
+        for (int level = 1; level <= levels; ++level)
+        {
+            for (auto & s : level_shape)
+            {
+                s /= 2;
+            }
+            shapes.push_back(level_shape);
+        }
+        return shapes;
+    }
+
+    // Downsamples (by 2) the box [begin, end) of the OUTPUT array 'dst'
+    // from the array 'src'. Both are given as a data pointer and element strides,
+    // so any memory order is acceptable for either one.
+    template <int N, typename label_t>
+    void downsample_labels_box_x2( label_t const * src, std::ptrdiff_t const * src_strides,
+                                   label_t * dst, std::ptrdiff_t const * dst_strides,
+                                   size_t const * begin, size_t const * end, bool suppress_zero )
+    {
+        label_t block[8];
+        if (N == 3)
+        {
+            for (size_t z = begin[0]; z < end[0]; ++z)
             {
-                if (s == 0) {
-                    // Technically, we could omit this check -- it should simply result in a zero-size output.
-                    std::ostringstream ss;
-                    ss << "Precondition violation: zero-size array.  Shape: (";
-                    for (auto d : labels.shape())
+                for (size_t y = begin[1]; y < end[1]; ++y)
+                {
+                    label_t const * rows[4];
+                    for (int dz = 0; dz < 2; ++dz)
+                    {
+                        for (int dy = 0; dy < 2; ++dy)
+                        {
+                            rows[dz*2 + dy] = src + (2*z + dz)*src_strides[0] + (2*y + dy)*src_strides[1];
+                        }
+                    }
+
+                    label_t * dst_row = dst + z*dst_strides[0] + y*dst_strides[1];
+                    for (size_t x = begin[2]; x < end[2]; ++x)
                     {
-                        ss << d << ", ";
+                        for (int r = 0; r < 4; ++r)
+                        {
+                            block[r*2 + 0] = rows[r][(2*x + 0)*src_strides[2]];
+                            block[r*2 + 1] = rows[r][(2*x + 1)*src_strides[2]];
+                        }
+                        dst_row[x*dst_strides[2]] = block_mode<8>(block, suppress_zero);
                     }
-                    ss << ")";
-                    throw std::runtime_error(ss.str().c_str());
                 }
-                if (s % factor != 0)
+            }
+        }
+        else
+        {
+            for (size_t y = begin[0]; y < end[0]; ++y)
+            {
+                label_t const * rows[2] = { src + (2*y)*src_strides[0],
+                                            src + (2*y + 1)*src_strides[0] };
+
+                label_t * dst_row = dst + y*dst_strides[0];
+                for (size_t x = begin[1]; x < end[1]; ++x)
                 {
-                    std::ostringstream ss;
-                    ss << "Precondition violation: Downsampling factor must divide cleanly into array shape: (";
-                    for (auto d : labels.shape())
+                    for (int r = 0; r < 2; ++r)
                     {
-                        ss << d << ", ";
+                        block[r*2 + 0] = rows[r][(2*x + 0)*src_strides[1]];
+                        block[r*2 + 1] = rows[r][(2*x + 1)*src_strides[1]];
                     }
-                    ss << ")";
-                    throw std::runtime_error(ss.str().c_str());
+                    dst_row[x*dst_strides[1]] = block_mode<4>(block, suppress_zero);
                 }
-                
-                s /= factor;
             }
-            auto res = result_type::from_shape(output_shape);
+        }
+    }
 
-            // Create just one flat_map to re-use for every block
-            boost::container::flat_map<label_t, int> counts;
-            for (size_t y_res = 0; y_res < output_shape[0]; ++y_res)
+    // Computes levels 1..L of a factor-2 label pyramid in a single traversal of 'labels'.
+    //
+    // The full-resolution array is processed in tiles which each yield a whole
+    // tile of every coarser level, so each level is computed from its parent
+    // while the parent tile is still in cache.
+    // The results are identical to repeated calls to downsample_labels(..., 2)
+    // (including the tie-breaking rules).
+    //
+    // The 'pyramid' arrays must already be allocated with the shapes given by
+    // downsample_labels_pyramid_shapes(), which lets the caller choose the array type.
+    template <int N, typename label_array_t, typename result_array_t>
+    void downsample_labels_pyramid_into( label_array_t const & labels, std::vector<result_array_t> & pyramid,
+                                         bool suppress_zero=false, int num_threads=1 )
+    {
+        using label_t = typename label_array_t::value_type;
+        int const levels = pyramid.size();
+        if (levels < 1 || levels >= std::numeric_limits<size_t>::digits)
+        {
+            std::ostringstream ss;
+            ss << "Precondition violation: Bad number of pyramid levels (" << levels << ")";
+            throw std::runtime_error(ss.str().c_str());
+        }
+
+        // Tile edge length, in full-resolution voxels
+        size_t const tile_edge = std::max<size_t>((N == 3) ? 64 : 256, size_t(1) << levels);
+
+        // Tiles are laid out on the grid of the coarsest level.
+        size_t coarse_shape[N];
+        size_t coarse_tile = tile_edge >> levels;
+        size_t num_tiles[N];
+        for (int d = 0; d < N; ++d)
+        {
+            coarse_shape[d] = pyramid[levels-1].shape()[d];
+            num_tiles[d] = (coarse_shape[d] + coarse_tile - 1) / coarse_tile;
+        }
+
+        // Element strides of every level (including level 0), N per level
+        std::vector<std::ptrdiff_t> strides(labels.strides().begin(), labels.strides().end());
+        for (auto const & level : pyramid)
+        {
+            strides.insert(strides.end(), level.strides().begin(), level.strides().end());
+        }
+
+        // Each thread handles a slab of tiles along the first axis.
+        parallel_for_slabs(num_tiles[0], num_threads, [&](size_t tile_begin, size_t tile_end)
+        {
+            size_t tile[N];
+            for (tile[0] = tile_begin; tile[0] < tile_end; ++tile[0])
             {
-                size_t y = y_res*factor;
-                for (size_t x_res = 0; x_res < output_shape[1]; ++x_res)
+                // Visit every tile in this slab (row-major order over the remaining axes)
+                std::fill(tile+1, tile+N, 0);
+                while (true)
                 {
-                    size_t x = x_res*factor;
-                    
-                    auto block = xt::view(labels, xt::range(y,y+factor), xt::range(x,x+factor));
-                    
-                    // Load the counts
-                    counts.clear();
-                    xt::eval(xt::vectorize([&](label_t label) { counts[label] += 1; return 0;})(block));
-                    
-                    // Find the maximum count
-                    // Note: This function guarantees that ties are resolved in favor of the lower value.
-                    //       Since flat_map is ordered, and max_element chooses the first tied value,
-                    //       we're in compliance with that guarantee.
-                    auto max_pair = counts.begin();
-                    if (suppress_zero)
+                    for (int level = 1; level <= levels; ++level)
                     {
-                        max_pair = std::max_element( counts.begin(), counts.end(),
-                                                    compare_pairs_suppress_zero<typename decltype(counts)::value_type>);
+                        int const shift = levels - level;
+                        size_t begin[N];
+                        size_t end[N];
+                        for (int d = 0; d < N; ++d)
+                        {
+                            begin[d] = (tile[d] * coarse_tile) << shift;
+                            end[d] = std::min((tile[d] + 1) * coarse_tile, coarse_shape[d]) << shift;
+                        }
+
+                        label_t const * src = (level == 1) ? labels.data() : pyramid[level-2].data();
+                        label_t * dst = pyramid[level-1].data();
+                        downsample_labels_box_x2<N>( src, &strides[(level-1)*N], dst, &strides[level*N],
+                                                     begin, end, suppress_zero );
+                    }
+
+                    int d = N-1;
+                    while (d > 0 && ++tile[d] == num_tiles[d])
+                    {
+                        tile[d] = 0;
+                        --d;
                     }
-                    else
+                    if (d == 0)
                     {
-                        max_pair = std::max_element( counts.begin(), counts.end(),
-                                                    compare_pairs<typename decltype(counts)::value_type>);
+                        break;
                     }
-                    
-                    res(y_res, x_res) = max_pair->first;
                 }
             }
-            
-            return res;
-        }
-    };
-    
+        });
+    }
+
+    // Convenience wrapper: returns levels 1..L of the pyramid as new arrays.
     template <typename labelarray_t, int N>
-    labelarray_t downsample_labels(labelarray_t const & labels, int factor, bool suppress_zero )
+    std::vector<xt::xarray<typename labelarray_t::value_type>>
+    downsample_labels_pyramid(labelarray_t const & labels, int levels, bool suppress_zero=false, int num_threads=1 )
     {
-        return downsample_labels_functor<labelarray_t, N>()(labels, factor, suppress_zero);
+        using result_type = xt::xarray<typename labelarray_t::value_type>;
+        std::vector<result_type> pyramid;
+        for (auto const & shape : downsample_labels_pyramid_shapes(labels.shape(), levels))
+        {
+            pyramid.push_back(result_type::from_shape(shape));
+        }
+        downsample_labels_pyramid_into<N>(labels, pyramid, suppress_zero, num_threads);
+        return pyramid;
     }
 }
 
@@ -0,0 +1,220 @@
+#ifndef DVIDUTILS_DOWNSAMPLE_LABELS_CHUNKED_HPP
+#define DVIDUTILS_DOWNSAMPLE_LABELS_CHUNKED_HPP
+
+#include <algorithm>
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "downsample_labels.hpp"
+
+namespace dvidutils {
+
+    // A slab of input labels (a range of the first axis),
+    // whose rows must be contiguous.
+    template <typename label_t>
+    struct label_slab
+    {
+        label_t const * data;
+        std::vector<std::ptrdiff_t> strides;
+    };
+
+    // Default slab size (of the input) when the caller doesn't choose one.
+    const size_t DEFAULT_CHUNKED_SLAB_BYTES = 64 << 20;
+
+    // Returns the number of output slices per slab.
+    // If slab_depth is 0, it is chosen so that each input slab is roughly DEFAULT_CHUNKED_SLAB_BYTES.
+    inline size_t chunked_slab_depth(std::vector<size_t> const & input_shape, int factor, size_t label_size, int slab_depth)
+    {
+        if (slab_depth > 0)
+        {
+            return slab_depth;
+        }
+        size_t slice_bytes = label_size * factor;
+        for (size_t d = 1; d < input_shape.size(); ++d)
+        {
+            slice_bytes *= input_shape[d];
+        }
+        return std::max<size_t>(1, DEFAULT_CHUNKED_SLAB_BYTES / std::max<size_t>(1, slice_bytes));
+    }
+
+    // Downsamples a volume which need not fit in memory, one slab
+    // (a range of the first axis, aligned to the factor) at a time.
+    //
+    // The input is obtained from load_slab(begin, end), which returns a label_slab
+    // for input slices [begin, end). That slab must remain valid until the
+    // following call to load_slab() returns, i.e. at most two slabs are needed at once.
+    // The next slab is loaded on the calling thread while the current one is
+    // being downsampled on a worker thread, so I/O overlaps computation.
+    //
+    // The result is written into 'out', which must be a C-order buffer
+    // of shape input_shape/factor (e.g. a memory-mapped file).
+    template <int N, typename label_t, typename load_slab_t>
+    void downsample_labels_streaming( load_slab_t && load_slab, std::vector<size_t> const & input_shape,
+                                      label_t * out, int factor, bool suppress_zero=false,
+                                      int slab_depth=0, int num_threads=1 )
+    {
+        std::vector<int> output_shape;
+        for (auto s : input_shape)
+        {
+            if (s == 0 || s % factor != 0)
+            {
+                std::ostringstream ss;
+                ss << "Precondition violation: Downsampling factor must divide cleanly into (non-empty) array shape: (";
+                for (auto d : input_shape)
+                {
+                    ss << d << ", ";
+                }
+                ss << ")";
+                throw std::runtime_error(ss.str().c_str());
+            }
+            output_shape.push_back(s / factor);
+        }
+
+        size_t out_slice_size = 1;
+        for (int d = 1; d < N; ++d)
+        {
+            out_slice_size *= output_shape[d];
+        }
+
+        size_t depth = chunked_slab_depth(input_shape, factor, sizeof(label_t), slab_depth);
+        size_t num_slabs = (output_shape[0] + depth - 1) / depth;
+
+        auto slab_begin = [&](size_t slab) { return slab * depth; };
+        auto slab_end = [&](size_t slab) { return std::min<size_t>((slab + 1) * depth, output_shape[0]); };
+
+        label_slab<label_t> current = load_slab(slab_begin(0) * factor, slab_end(0) * factor);
+        for (size_t slab = 0; slab < num_slabs; ++slab)
+        {
+            std::exception_ptr error;
+            std::thread worker([&]()
+            {
+                try
+                {
+                    std::vector<int> slab_shape = output_shape;
+                    slab_shape[0] = slab_end(slab) - slab_begin(slab);
+                    label_t * res = out + slab_begin(slab) * out_slice_size;
+                    parallel_for_slabs(slab_shape[0], num_threads, [&](size_t begin, size_t end)
+                    {
+                        downsample_labels_slab<N>( current.data, current.strides.data(), factor,
+                                                   slab_shape, begin, end, suppress_zero, res );
+                    });
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+            });
+
+            // Read ahead while the worker is busy.
+            label_slab<label_t> next = current;
+            try
+            {
+                if (slab + 1 < num_slabs)
+                {
+                    next = load_slab(slab_begin(slab+1) * factor, slab_end(slab+1) * factor);
+                }
+            }
+            catch (...)
+            {
+                worker.join();
+                throw;
+            }
+
+            worker.join();
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+            current = next;
+        }
+    }
+
+    // Reads (one element per page of) the given slab, so that a memory-mapped
+    // array is paged in before the downsampling kernel needs it.
+    // Returns a meaningless checksum, so the reads can't be optimized away.
+    template <typename label_t>
+    label_t prefetch_slab(label_t const * data, std::vector<size_t> const & slab_shape, std::vector<std::ptrdiff_t> const & strides)
+    {
+        const size_t page_elements = std::max<size_t>(1, 4096 / sizeof(label_t));
+
+        size_t num_rows = 1;
+        for (size_t d = 0; d+1 < slab_shape.size(); ++d)
+        {
+            num_rows *= slab_shape[d];
+        }
+
+        label_t sink = 0;
+        for (size_t row = 0; row < num_rows; ++row)
+        {
+            // Offset of this row (row-major order over all but the last axis)
+            std::ptrdiff_t offset = 0;
+            size_t r = row;
+            for (int d = int(slab_shape.size()) - 2; d >= 0; --d)
+            {
+                offset += (r % slab_shape[d]) * strides[d];
+                r /= slab_shape[d];
+            }
+            label_t const * row_data = data + offset;
+            for (size_t x = 0; x < slab_shape.back(); x += page_elements)
+            {
+                sink ^= row_data[x];
+            }
+        }
+        return sink;
+    }
+
+    // Checks that 'out' is a C-order array of shape input_shape/factor.
+    template <typename shape_t, typename out_array_t>
+    void check_chunked_output(shape_t const & input_shape, int factor, out_array_t const & out)
+    {
+        bool ok = (out.shape().size() == input_shape.size()) && is_c_contiguous(out);
+        for (size_t d = 0; ok && d < input_shape.size(); ++d)
+        {
+            ok = (out.shape()[d] * factor == input_shape[d]);
+        }
+        if (!ok)
+        {
+            std::ostringstream ss;
+            ss << "Output array must be C-contiguous, with shape (input shape / " << factor << ").  Got shape: (";
+            for (auto d : out.shape())
+            {
+                ss << d << ", ";
+            }
+            ss << ")";
+            throw std::runtime_error(ss.str().c_str());
+        }
+    }
+
+    // Chunked downsampling of an array that is already addressable (typically memory-mapped),
+    // with readahead of each slab's pages.
+    template <int N, typename label_array_t>
+    void downsample_labels_chunked( label_array_t const & labels, typename label_array_t::value_type * out,
+                                    int factor, bool suppress_zero=false, int slab_depth=0, int num_threads=1 )
+    {
+        using label_t = typename label_array_t::value_type;
+        if (!rows_are_contiguous(labels))
+        {
+            throw std::runtime_error("Chunked downsampling requires an input array with contiguous rows");
+        }
+
+        std::vector<size_t> shape(labels.shape().begin(), labels.shape().end());
+        std::vector<std::ptrdiff_t> strides(labels.strides().begin(), labels.strides().end());
+
+        auto load_slab = [&](size_t begin, size_t end)
+        {
+            label_t const * data = labels.data() + begin * strides[0];
+            std::vector<size_t> slab_shape = shape;
+            slab_shape[0] = end - begin;
+            volatile label_t checksum = prefetch_slab(data, slab_shape, strides);
+            (void)checksum;
+            return label_slab<label_t>{data, strides};
+        };
+
+        downsample_labels_streaming<N>(load_slab, shape, out, factor, suppress_zero, slab_depth, num_threads);
+    }
+}
+
+#endif
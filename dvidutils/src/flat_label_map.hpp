@@ -0,0 +1,621 @@
+#ifndef DVIDUTILS_FLAT_LABEL_MAP_HPP
+#define DVIDUTILS_FLAT_LABEL_MAP_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dvidutils
+{
+    // Mappings with more entries than this are stored as sorted arrays
+    // rather than in a hash table. At that size, (nearly) every hash lookup
+    // is a cache miss anyway, and the sorted arrays need half the memory or less.
+    const size_t FLAT_LABEL_MAP_SORTED_THRESHOLD = size_t(1) << 26;
+
+    // Default memory cap for the 'dense' strategy's lookup table.
+    const size_t DEFAULT_DENSE_MAX_BYTES = size_t(256) << 20;
+
+    // Key ranges up to this size are always considered compact enough for a dense table
+    // (if it fits in the memory cap), no matter how few keys there are.
+    // That covers every uint8 and uint16 domain.
+    const uint64_t DENSE_ALWAYS_RANGE = uint64_t(1) << 16;
+
+    // Fibonacci hashing: scrambles sequential labels, and the top bits are used as the slot.
+    inline uint64_t fibonacci_hash(uint64_t key)
+    {
+        return key * 0x9E3779B97F4A7C15ull;
+    }
+
+    // A read-only array, which either owns its elements
+    // or refers to memory owned by something else (e.g. a memory-mapped file),
+    // which it keeps alive. Copies share the same elements.
+    template <typename T>
+    class flat_array
+    {
+    public:
+        flat_array()
+        {
+        }
+
+        flat_array(std::vector<T> && elements)
+        {
+            auto owner = std::make_shared<std::vector<T>>(std::move(elements));
+            _data = owner->data();
+            _size = owner->size();
+            _owner = owner;
+        }
+
+        flat_array(std::shared_ptr<void const> owner, T const * data, size_t size)
+        : _owner(std::move(owner))
+        , _data(data)
+        , _size(size)
+        {
+        }
+
+        T const * data() const { return _data; }
+        size_t size() const { return _size; }
+        T const & operator[](size_t i) const { return _data[i]; }
+
+    private:
+        std::shared_ptr<void const> _owner;
+        T const * _data = nullptr;
+        size_t _size = 0;
+    };
+
+    // The header of a FlatLabelMap file (see FlatLabelMap::save()).
+    // Each array follows at the given offset (a multiple of 64 bytes).
+    // Everything is in native byte order.
+    struct flat_label_map_header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t strategy;
+        uint32_t key_size;
+        uint32_t value_size;
+        uint64_t size;
+        uint64_t dense_base;
+        uint64_t zero_value;
+        int32_t shift;
+        uint32_t has_zero;
+        uint64_t keys_offset;
+        uint64_t num_keys;
+        uint64_t values_offset;
+        uint64_t num_values;
+        uint64_t valid_bits_offset;
+        uint64_t num_valid_words;
+        uint64_t file_size;
+    };
+
+    const char FLAT_LABEL_MAP_MAGIC[8] = {'D', 'V', 'I', 'D', 'L', 'M', 'A', 'P'};
+    const uint32_t FLAT_LABEL_MAP_VERSION = 1;
+
+    // Maps the given file (read-only, shared), and returns its header.
+    // The mapping is released when the last copy of 'mapping' is destroyed.
+    inline flat_label_map_header mmap_flat_label_map(std::string const & path, std::shared_ptr<void const> & mapping)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Could not open " + path + ": " + std::strerror(errno));
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            int error = errno;
+            ::close(fd);
+            throw std::runtime_error("Could not stat " + path + ": " + std::strerror(error));
+        }
+
+        size_t length = st.st_size;
+        if (length < sizeof(flat_label_map_header))
+        {
+            ::close(fd);
+            throw std::runtime_error("Not a LabelMapper file (too small): " + path);
+        }
+
+        void * addr = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        int error = errno;
+        ::close(fd);
+        if (addr == MAP_FAILED)
+        {
+            throw std::runtime_error("Could not mmap " + path + ": " + std::strerror(error));
+        }
+        mapping = std::shared_ptr<void const>(addr, [length](void const * p) { ::munmap(const_cast<void *>(p), length); });
+
+        flat_label_map_header header;
+        std::memcpy(&header, addr, sizeof(header));
+        if (std::memcmp(header.magic, FLAT_LABEL_MAP_MAGIC, sizeof(header.magic)) != 0)
+        {
+            throw std::runtime_error("Not a LabelMapper file: " + path);
+        }
+        if (header.version != FLAT_LABEL_MAP_VERSION)
+        {
+            throw std::runtime_error("Unsupported LabelMapper file version (" + std::to_string(header.version) + "): " + path);
+        }
+        if (header.file_size != length)
+        {
+            throw std::runtime_error("LabelMapper file is truncated or corrupt: " + path);
+        }
+        return header;
+    }
+
+    // A read-only mapping from key_t to value_t, built in bulk.
+    //
+    // If the keys span a compact range (at most 4x the number of keys, or DENSE_ALWAYS_RANGE)
+    // and a table for that range fits within dense_max_bytes, the values are stored in a
+    // direct-indexed table with a validity bitmap ('dense').
+    // Otherwise, small and medium mappings are stored in an open-addressing (linear probing)
+    // hash table, with keys and values in flat arrays ('hash'),
+    // and large mappings are stored as sorted key/value arrays, searched with a branchless binary search ('sorted').
+    //
+    // If the same key is given more than once during construction, the last value wins
+    // (as if the entries were inserted one at a time).
+    //
+    // The tables can be saved to a file, and later memory-mapped (read-only) instead of rebuilt,
+    // so that several processes on a machine share a single copy in the page cache.
+    template <typename key_t, typename value_t>
+    class FlatLabelMap
+    {
+    public:
+        enum class Strategy { dense, hash, sorted };
+
+        FlatLabelMap()
+        {
+            _build_hash(0, [](size_t) { return key_t(0); }, [](size_t) { return value_t(0); });
+        }
+
+        // Builds the map from n entries, given as key_at(i) and value_at(i).
+        template <typename key_at_t, typename value_at_t>
+        FlatLabelMap( size_t n, key_at_t && key_at, value_at_t && value_at,
+                      size_t dense_max_bytes=DEFAULT_DENSE_MAX_BYTES,
+                      size_t sorted_threshold=FLAT_LABEL_MAP_SORTED_THRESHOLD )
+        {
+            if (n > 0)
+            {
+                key_t min_key = key_at(0);
+                key_t max_key = min_key;
+                for (size_t i = 1; i < n; ++i)
+                {
+                    key_t key = key_at(i);
+                    min_key = std::min(min_key, key);
+                    max_key = std::max(max_key, key);
+                }
+
+                // (Careful: the full uint64 range has no representable size.)
+                uint64_t span = uint64_t(max_key) - uint64_t(min_key);
+                uint64_t max_range = std::max<uint64_t>(4 * uint64_t(n), DENSE_ALWAYS_RANGE);
+                uint64_t max_entries = dense_max_bytes / (sizeof(value_t) + 1.0/8);
+                if (span < max_range && span < max_entries)
+                {
+                    _build_dense(n, key_at, value_at, min_key, span + 1);
+                    return;
+                }
+            }
+
+            if (n > sorted_threshold)
+            {
+                _build_sorted(n, key_at, value_at);
+            }
+            else
+            {
+                _build_hash(n, key_at, value_at);
+            }
+        }
+
+        Strategy strategy() const
+        {
+            return _strategy;
+        }
+
+        std::string strategy_name() const
+        {
+            switch (_strategy)
+            {
+                case Strategy::dense: return "dense";
+                case Strategy::hash: return "hash";
+                default: return "sorted";
+            }
+        }
+
+        size_t size() const
+        {
+            return _size;
+        }
+
+        // Writes the tables to a file, which can be loaded with load_mmap().
+        void save(std::string const & path) const
+        {
+            flat_label_map_header header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.magic, FLAT_LABEL_MAP_MAGIC, sizeof(header.magic));
+            header.version = FLAT_LABEL_MAP_VERSION;
+            header.strategy = uint32_t(_strategy);
+            header.key_size = sizeof(key_t);
+            header.value_size = sizeof(value_t);
+            header.size = _size;
+            header.dense_base = uint64_t(_dense_base);
+            header.zero_value = uint64_t(_zero_value);
+            header.shift = _shift;
+            header.has_zero = _has_zero;
+
+            auto align = [](uint64_t offset) { return (offset + 63) / 64 * 64; };
+            header.keys_offset = align(sizeof(header));
+            header.num_keys = _keys.size();
+            header.values_offset = align(header.keys_offset + _keys.size() * sizeof(key_t));
+            header.num_values = _values.size();
+            header.valid_bits_offset = align(header.values_offset + _values.size() * sizeof(value_t));
+            header.num_valid_words = _valid_bits.size();
+            header.file_size = header.valid_bits_offset + _valid_bits.size() * sizeof(uint64_t);
+
+            // Write to a temporary file in the same directory, and then rename it over the target,
+            // so processes that have the old file mapped (see load_mmap()) keep their (unchanged) copy,
+            // instead of crashing when it's truncated.
+            std::string tmp_path = path + ".tmp." + std::to_string(::getpid())
+                                 + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+            std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+            if (!f)
+            {
+                throw std::runtime_error("Could not open " + tmp_path + " for writing");
+            }
+            auto write_at = [&](uint64_t offset, void const * data, size_t bytes)
+            {
+                std::vector<char> padding(offset - uint64_t(f.tellp()), 0);
+                f.write(padding.data(), padding.size());
+                f.write(static_cast<char const *>(data), bytes);
+            };
+            write_at(0, &header, sizeof(header));
+            write_at(header.keys_offset, _keys.data(), _keys.size() * sizeof(key_t));
+            write_at(header.values_offset, _values.data(), _values.size() * sizeof(value_t));
+            write_at(header.valid_bits_offset, _valid_bits.data(), _valid_bits.size() * sizeof(uint64_t));
+            f.close();
+            if (!f)
+            {
+                std::remove(tmp_path.c_str());
+                throw std::runtime_error("Failed to write " + path);
+            }
+            if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+            {
+                int error = errno;
+                std::remove(tmp_path.c_str());
+                throw std::runtime_error("Could not rename " + tmp_path + " to " + path + ": " + std::strerror(error));
+            }
+        }
+
+        // Maps a file written by save(), without copying the tables.
+        static FlatLabelMap load_mmap(std::string const & path)
+        {
+            std::shared_ptr<void const> mapping;
+            auto header = mmap_flat_label_map(path, mapping);
+            if (header.key_size != sizeof(key_t) || header.value_size != sizeof(value_t))
+            {
+                throw std::runtime_error("LabelMapper file " + path + " has the wrong key/value sizes: "
+                                         + std::to_string(header.key_size) + "/" + std::to_string(header.value_size));
+            }
+            if (header.strategy > uint32_t(Strategy::sorted))
+            {
+                throw std::runtime_error("LabelMapper file is corrupt (bad strategy): " + path);
+            }
+
+            _check_header(header, path);
+
+            auto const * base = static_cast<char const *>(mapping.get());
+            FlatLabelMap m;
+            m._strategy = Strategy(header.strategy);
+            m._size = header.size;
+            m._dense_base = key_t(header.dense_base);
+            m._zero_value = value_t(header.zero_value);
+            m._shift = header.shift;
+            m._has_zero = header.has_zero;
+            m._keys = flat_array<key_t>(mapping, reinterpret_cast<key_t const *>(base + header.keys_offset), header.num_keys);
+            m._values = flat_array<value_t>(mapping, reinterpret_cast<value_t const *>(base + header.values_offset), header.num_values);
+            m._valid_bits = flat_array<uint64_t>(mapping, reinterpret_cast<uint64_t const *>(base + header.valid_bits_offset), header.num_valid_words);
+
+            // Probing stops at an empty slot, so there must be one.
+            // (At a load factor of at most 3/4, this finds one almost immediately.)
+            if ( m._strategy == Strategy::hash
+                 && std::find(m._keys.data(), m._keys.data() + m._keys.size(), key_t(0)) == m._keys.data() + m._keys.size() )
+            {
+                throw std::runtime_error("LabelMapper file is corrupt (hash table has no empty slots): " + path);
+            }
+            return m;
+        }
+
+        // Returns true (and the value) if the key is present.
+        bool find(key_t key, value_t & value) const
+        {
+            switch (_strategy)
+            {
+                case Strategy::dense: return _find_dense(key, value);
+                case Strategy::hash: return _find_hash(key, value);
+                default: return _find_sorted(key, value);
+            }
+        }
+
+        // Dense strategy only: maps n values from src into dst, with no branches,
+        // so the compiler can vectorize the loop.
+        // Returns false if any of the values was missing, in which case
+        // the corresponding entries of dst are garbage, and the caller must handle them.
+        template <typename input_t, typename output_t>
+        bool gather(input_t const * src, output_t * dst, size_t n) const
+        {
+            uint64_t const range = _values.size();
+            value_t const * values = _values.data();
+            uint64_t const * valid_bits = _valid_bits.data();
+
+            bool all_valid = true;
+            for (size_t i = 0; i < n; ++i)
+            {
+                uint64_t index = uint64_t(src[i]) - uint64_t(_dense_base);
+                bool in_range = (index < range);
+                index = in_range ? index : 0;
+                all_valid &= in_range & bool((valid_bits[index >> 6] >> (index & 63)) & 1);
+                dst[i] = static_cast<output_t>(values[index]);
+            }
+            return all_valid;
+        }
+
+    private:
+
+        // Checks that the arrays described by a file's header lie within the file,
+        // and that they are consistent with its strategy, so a corrupt file can't cause
+        // out-of-bounds reads (or endless probing) later.
+        // (The file's size has already been checked against header.file_size.)
+        static void _check_header(flat_label_map_header const & header, std::string const & path)
+        {
+            auto corrupt = [&](std::string const & what)
+            {
+                return std::runtime_error("LabelMapper file is corrupt (" + what + "): " + path);
+            };
+
+            auto check_array = [&](char const * name, uint64_t offset, uint64_t count, uint64_t item_size)
+            {
+                if (offset % 64 != 0 || offset < sizeof(flat_label_map_header) || offset > header.file_size
+                    || count > (header.file_size - offset) / item_size)
+                {
+                    throw corrupt(std::string("bad ") + name + " array");
+                }
+            };
+            check_array("key", header.keys_offset, header.num_keys, sizeof(key_t));
+            check_array("value", header.values_offset, header.num_values, sizeof(value_t));
+            check_array("valid bits", header.valid_bits_offset, header.num_valid_words, sizeof(uint64_t));
+
+            switch (Strategy(header.strategy))
+            {
+                case Strategy::dense:
+                {
+                    // The table covers [dense_base, dense_base + num_values), which must be within key_t's range.
+                    uint64_t max_key = uint64_t(std::numeric_limits<key_t>::max());
+                    if ( header.num_keys != 0
+                         || header.num_values == 0
+                         || header.num_valid_words != (header.num_values + 63) / 64
+                         || header.dense_base > max_key
+                         || header.num_values - 1 > max_key - header.dense_base
+                         || header.size > header.num_values )
+                    {
+                        throw corrupt("bad dense table");
+                    }
+                    break;
+                }
+                case Strategy::hash:
+                {
+                    // The capacity must be a power of two, matching the hash shift,
+                    // with empty slots to end the probing.
+                    uint64_t capacity = header.num_keys;
+                    if ( capacity == 0
+                         || (capacity & (capacity - 1)) != 0
+                         || header.num_values != capacity
+                         || header.num_valid_words != 0
+                         || header.shift < 1 || header.shift > 63
+                         || (uint64_t(1) << (64 - header.shift)) != capacity
+                         || header.has_zero > 1
+                         || header.size > capacity * 3 / 4 + header.has_zero )
+                    {
+                        throw corrupt("bad hash table");
+                    }
+                    break;
+                }
+                default:
+                    if ( header.num_values != header.num_keys
+                         || header.num_valid_words != 0
+                         || header.size != header.num_keys )
+                    {
+                        throw corrupt("bad sorted table");
+                    }
+            }
+        }
+
+        template <typename key_at_t, typename value_at_t>
+        void _build_dense(size_t n, key_at_t const & key_at, value_at_t const & value_at, key_t base, uint64_t range)
+        {
+            _strategy = Strategy::dense;
+            _dense_base = base;
+            std::vector<value_t> values(range, value_t(0));
+            std::vector<uint64_t> valid_bits((range + 63) / 64, 0);
+            _size = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                uint64_t index = uint64_t(key_at(i)) - uint64_t(base);
+                uint64_t bit = uint64_t(1) << (index & 63);
+                _size += !(valid_bits[index >> 6] & bit);
+                valid_bits[index >> 6] |= bit;
+                values[index] = value_at(i);
+            }
+            _values = std::move(values);
+            _valid_bits = std::move(valid_bits);
+        }
+
+        template <typename key_at_t, typename value_at_t>
+        void _build_hash(size_t n, key_at_t const & key_at, value_at_t const & value_at)
+        {
+            _strategy = Strategy::hash;
+
+            // Keep the load factor at or below 3/4.
+            size_t capacity = 16;
+            _shift = 60;
+            while (capacity * 3 < n * 4)
+            {
+                capacity *= 2;
+                --_shift;
+            }
+
+            // Key 0 marks an empty slot, so it is stored separately.
+            std::vector<key_t> keys(capacity, key_t(0));
+            std::vector<value_t> values(capacity, value_t(0));
+            _has_zero = false;
+            _zero_value = 0;
+            _size = 0;
+
+            size_t mask = capacity - 1;
+            for (size_t i = 0; i < n; ++i)
+            {
+                key_t key = key_at(i);
+                value_t value = value_at(i);
+                if (key == 0)
+                {
+                    _size += !_has_zero;
+                    _has_zero = true;
+                    _zero_value = value;
+                    continue;
+                }
+
+                size_t slot = _slot_of(key);
+                while (keys[slot] != 0 && keys[slot] != key)
+                {
+                    slot = (slot + 1) & mask;
+                }
+                _size += (keys[slot] == 0);
+                keys[slot] = key;
+                values[slot] = value;
+            }
+            _keys = std::move(keys);
+            _values = std::move(values);
+        }
+
+        template <typename key_at_t, typename value_at_t>
+        void _build_sorted(size_t n, key_at_t const & key_at, value_at_t const & value_at)
+        {
+            _strategy = Strategy::sorted;
+
+            // Sort (key, index) pairs; for duplicate keys, the last entry wins.
+            std::vector<std::pair<key_t, size_t>> order(n);
+            for (size_t i = 0; i < n; ++i)
+            {
+                order[i] = std::make_pair(key_at(i), i);
+            }
+            std::sort(order.begin(), order.end());
+
+            std::vector<key_t> keys;
+            std::vector<value_t> values;
+            keys.reserve(n);
+            values.reserve(n);
+            for (size_t j = 0; j < n; ++j)
+            {
+                if (j + 1 < n && order[j+1].first == order[j].first)
+                {
+                    continue;
+                }
+                keys.push_back(order[j].first);
+                values.push_back(value_at(order[j].second));
+            }
+            order = std::vector<std::pair<key_t, size_t>>();
+            keys.shrink_to_fit();
+            values.shrink_to_fit();
+            _size = keys.size();
+            _keys = std::move(keys);
+            _values = std::move(values);
+        }
+
+        size_t _slot_of(key_t key) const
+        {
+            return size_t(fibonacci_hash(uint64_t(key)) >> _shift);
+        }
+
+        bool _find_dense(key_t key, value_t & value) const
+        {
+            uint64_t index = uint64_t(key) - uint64_t(_dense_base);
+            if (index >= _values.size() || !((_valid_bits[index >> 6] >> (index & 63)) & 1))
+            {
+                return false;
+            }
+            value = _values[index];
+            return true;
+        }
+
+        bool _find_hash(key_t key, value_t & value) const
+        {
+            if (key == 0)
+            {
+                value = _zero_value;
+                return _has_zero;
+            }
+            size_t mask = _keys.size() - 1;
+            for (size_t slot = _slot_of(key); _keys[slot] != 0; slot = (slot + 1) & mask)
+            {
+                if (_keys[slot] == key)
+                {
+                    value = _values[slot];
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool _find_sorted(key_t key, value_t & value) const
+        {
+            size_t n = _keys.size();
+            if (n == 0)
+            {
+                return false;
+            }
+
+            // Branchless lower_bound
+            key_t const * base = _keys.data();
+            while (n > 1)
+            {
+                size_t half = n / 2;
+                base = (base[half - 1] < key) ? base + half : base;
+                n -= half;
+            }
+            base += (*base < key);
+            if (base == _keys.data() + _keys.size() || *base != key)
+            {
+                return false;
+            }
+            value = _values[base - _keys.data()];
+            return true;
+        }
+
+        Strategy _strategy = Strategy::hash;
+        flat_array<key_t> _keys;
+        flat_array<value_t> _values;
+        size_t _size = 0;
+
+        // dense strategy only (_values holds the table)
+        key_t _dense_base = 0;
+        flat_array<uint64_t> _valid_bits;
+
+        // hash strategy only
+        int _shift = 60;
+        bool _has_zero = false;
+        value_t _zero_value = 0;
+    };
+}
+
+#endif
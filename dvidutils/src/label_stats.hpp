@@ -0,0 +1,252 @@
+#ifndef DVIDUTILS_LABEL_STATS_HPP
+#define DVIDUTILS_LABEL_STATS_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "parallel.hpp"
+
+namespace dvidutils {
+
+    // Voxel count and (inclusive) bounding box of a single label.
+    template <typename label_t, int N>
+    struct label_stats_entry
+    {
+        label_t label;
+        uint64_t count; // 0 means 'empty slot' in LabelStatsTable
+        std::array<int64_t, N> min_corner;
+        std::array<int64_t, N> max_corner;
+    };
+
+    // An open-addressing (linear probing) hash table of label_stats_entry,
+    // for accumulating statistics without a heap allocation per label.
+    // Each thread owns its own table, so no locking is needed.
+    template <typename label_t, int N>
+    class LabelStatsTable
+    {
+    public:
+        typedef label_stats_entry<label_t, N> entry_t;
+
+        LabelStatsTable()
+        {
+            rehash(1024);
+        }
+
+        // Adds a run of 'length' voxels with the given label, all in one row:
+        // 'coord' is the coordinate of the first voxel, and the run extends along the last axis.
+        void add_run(label_t label, std::array<int64_t, N> const & coord, int64_t length)
+        {
+            entry_t & entry = find_or_insert(label);
+            if (entry.count == 0)
+            {
+                entry.min_corner = coord;
+                entry.max_corner = coord;
+            }
+            entry.count += length;
+            for (int d = 0; d < N-1; ++d)
+            {
+                entry.min_corner[d] = std::min(entry.min_corner[d], coord[d]);
+                entry.max_corner[d] = std::max(entry.max_corner[d], coord[d]);
+            }
+            entry.min_corner[N-1] = std::min(entry.min_corner[N-1], coord[N-1]);
+            entry.max_corner[N-1] = std::max(entry.max_corner[N-1], coord[N-1] + length - 1);
+        }
+
+        // Appends all (non-empty) entries to the given vector, in no particular order.
+        void extract(std::vector<entry_t> & entries) const
+        {
+            for (auto const & entry : slots_)
+            {
+                if (entry.count != 0)
+                {
+                    entries.push_back(entry);
+                }
+            }
+        }
+
+    private:
+        size_t slot_of(label_t label) const
+        {
+            // Fibonacci hashing: scrambles sequential labels across the table.
+            return size_t((uint64_t(label) * 0x9E3779B97F4A7C15ull) >> shift_);
+        }
+
+        entry_t & find_or_insert(label_t label)
+        {
+            size_t mask = slots_.size() - 1;
+            for (size_t slot = slot_of(label); ; slot = (slot + 1) & mask)
+            {
+                entry_t & entry = slots_[slot];
+                if (entry.count != 0 && entry.label == label)
+                {
+                    return entry;
+                }
+                if (entry.count == 0)
+                {
+                    // Keep the load factor below 1/2.
+                    if (2 * (size_ + 1) > slots_.size())
+                    {
+                        rehash(2 * slots_.size());
+                        return find_or_insert(label);
+                    }
+                    ++size_;
+                    entry.label = label;
+                    return entry;
+                }
+            }
+        }
+
+        // Capacity must be a power of two.
+        void rehash(size_t capacity)
+        {
+            std::vector<entry_t> old_slots(capacity, entry_t());
+            std::swap(slots_, old_slots);
+
+            shift_ = 64;
+            for (size_t c = capacity; c > 1; c >>= 1)
+            {
+                --shift_;
+            }
+
+            size_t mask = capacity - 1;
+            for (auto const & entry : old_slots)
+            {
+                if (entry.count == 0)
+                {
+                    continue;
+                }
+                size_t slot = slot_of(entry.label);
+                while (slots_[slot].count != 0)
+                {
+                    slot = (slot + 1) & mask;
+                }
+                slots_[slot] = entry;
+            }
+        }
+
+        std::vector<entry_t> slots_;
+        size_t size_ = 0;
+        int shift_ = 64;
+    };
+
+    // The statistics of every label in a volume, sorted by label.
+    template <typename label_t, int N>
+    struct label_stats_result
+    {
+        std::vector<label_t> ids;
+        std::vector<uint64_t> counts;
+        std::vector<std::array<int64_t, N>> min_corners;
+        std::vector<std::array<int64_t, N>> max_corners;  // inclusive
+    };
+
+    // Computes the voxel count and bounding box of every label
+    // (including 0) in the given 2D or 3D array, in a single pass.
+    //
+    // The first axis is split into slabs, each of which is processed
+    // by its own thread (into its own table). Runs of identical labels
+    // along each row are counted with a single table lookup.
+    //
+    // The bounding boxes are returned as inclusive min/max corners,
+    // in the same axis order as the array.
+    template <typename label_array_t, int N>
+    label_stats_result<typename label_array_t::value_type, N> label_stats( label_array_t const & labels, int num_threads=1 )
+    {
+        using label_t = typename label_array_t::value_type;
+        using table_t = LabelStatsTable<label_t, N>;
+        using entry_t = typename table_t::entry_t;
+
+        std::array<size_t, N> shape;
+        std::array<std::ptrdiff_t, N> strides;
+        for (int d = 0; d < N; ++d)
+        {
+            shape[d] = labels.shape()[d];
+            strides[d] = labels.strides()[d];
+        }
+        label_t const * data = labels.data();
+
+        size_t row_count = 1;
+        for (int d = 1; d < N-1; ++d)
+        {
+            row_count *= shape[d];
+        }
+        size_t const row_length = shape[N-1];
+
+        int T = resolve_num_threads(shape[0], num_threads);
+        std::vector<table_t> tables(T);
+
+        parallel_for_slabs(T, T, [&](size_t t_begin, size_t t_end)
+        {
+            for (size_t t = t_begin; t < t_end; ++t)
+            {
+                table_t & table = tables[t];
+                size_t const slab_begin = shape[0] * t / T;
+                size_t const slab_end = shape[0] * (t+1) / T;
+
+                std::array<int64_t, N> coord;
+                for (size_t z = slab_begin; z < slab_end; ++z)
+                {
+                    for (size_t r = 0; r < row_count; ++r)
+                    {
+                        // Coordinates of this row (row-major order over the middle axes)
+                        label_t const * row = data + z * strides[0];
+                        coord[0] = z;
+                        size_t rem = r;
+                        for (int d = N-2; d >= 1; --d)
+                        {
+                            coord[d] = rem % shape[d];
+                            rem /= shape[d];
+                            row += coord[d] * strides[d];
+                        }
+
+                        std::ptrdiff_t const sx = strides[N-1];
+                        size_t x = 0;
+                        while (x < row_length)
+                        {
+                            label_t const label = row[x * sx];
+                            size_t const run_begin = x;
+                            while (++x < row_length && row[x * sx] == label)
+                            {
+                            }
+                            coord[N-1] = run_begin;
+                            table.add_run(label, coord, x - run_begin);
+                        }
+                    }
+                }
+            }
+        });
+
+        // Merge the per-thread tables.
+        std::vector<entry_t> entries;
+        for (auto const & table : tables)
+        {
+            table.extract(entries);
+        }
+        std::sort(entries.begin(), entries.end(), [](entry_t const & a, entry_t const & b) { return a.label < b.label; });
+
+        label_stats_result<label_t, N> result;
+        for (auto const & entry : entries)
+        {
+            if (!result.ids.empty() && result.ids.back() == entry.label)
+            {
+                auto & min_corner = result.min_corners.back();
+                auto & max_corner = result.max_corners.back();
+                result.counts.back() += entry.count;
+                for (int d = 0; d < N; ++d)
+                {
+                    min_corner[d] = std::min(min_corner[d], entry.min_corner[d]);
+                    max_corner[d] = std::max(max_corner[d], entry.max_corner[d]);
+                }
+                continue;
+            }
+            result.ids.push_back(entry.label);
+            result.counts.push_back(entry.count);
+            result.min_corners.push_back(entry.min_corner);
+            result.max_corners.push_back(entry.max_corner);
+        }
+        return result;
+    }
+}
+
+#endif
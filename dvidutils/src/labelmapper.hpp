@@ -1,8 +1,10 @@
 #ifndef DVIDUTILS_LABELMAPPER_HPP
 #define DVIDUTILS_LABELMAPPER_HPP
 
+#include <algorithm>
 #include <utility>
 #include <unordered_map>
+#include <vector>
 
 #include "xtensor/xarray.hpp"
 #include "xtensor/xtensor.hpp"
@@ -10,17 +12,25 @@
 #include "xtensor/xnoalias.hpp"
 #include "xtensor/xvectorize.hpp"
 
+#include "flat_label_map.hpp"
+#include "parallel.hpp"
+
 namespace dvidutils
 {
 
     // Stores a mapping from an original set of labels (the domain)
     // to a new set of labels (the codomain), and exposes a function "apply()"
     // to convert arrays of domain label voxels into arrays of codomain label voxels.
+    //
+    // The mapping itself is stored in a FlatLabelMap (see flat_label_map.hpp),
+    // which is built in bulk and never modified.
     template<typename domain_t, typename codomain_t>
     class LabelMapper
     {
     public:
         typedef std::unordered_map<domain_t, codomain_t> mapping_t;
+        typedef FlatLabelMap<domain_t, codomain_t> flat_mapping_t;
+        typedef codomain_t codomain_type;
 
         typedef xt::xarray<domain_t> domain_array_t;
         typedef xt::xarray<codomain_t> codomain_array_t;
@@ -31,14 +41,27 @@ namespace dvidutils
         };
         
         // Construct directly from a pre-existing mapping
-        LabelMapper(mapping_t mapping)
+        LabelMapper(mapping_t const & mapping, size_t dense_max_bytes=DEFAULT_DENSE_MAX_BYTES)
+        {
+            std::vector<std::pair<domain_t, codomain_t>> items(mapping.begin(), mapping.end());
+            _mapping = flat_mapping_t( items.size(),
+                                       [&](size_t i) { return items[i].first; },
+                                       [&](size_t i) { return items[i].second; },
+                                       dense_max_bytes );
+        }
+
+        // Construct from an already-built table (e.g. from load_mmap())
+        explicit LabelMapper(flat_mapping_t mapping)
         : _mapping(std::move(mapping))
         {
         }
 
-        // Construct from domain and codomain lists
+        // Construct from domain and codomain lists.
+        // If the domain spans a compact range, the mapping is stored in a
+        // direct-indexed table, as long as it needs no more than dense_max_bytes.
         template <typename domain_list_t, typename codomain_list_t>
-        LabelMapper(domain_list_t const & domain, codomain_list_t const & codomain)
+        LabelMapper(domain_list_t const & domain, codomain_list_t const & codomain,
+                    size_t dense_max_bytes=DEFAULT_DENSE_MAX_BYTES)
         {
             if (domain.shape().size() != 1 || codomain.shape().size() != 1)
             {
@@ -51,93 +74,217 @@ namespace dvidutils
             }
 
             // Load up the mapping
-            for (size_t i = 0; i < domain.shape()[0]; ++i)
-            {
-                _mapping[domain(i)] = codomain(i);
-            }
+            _mapping = flat_mapping_t( domain.shape()[0],
+                                       [&](size_t i) { return domain_t(domain(i)); },
+                                       [&](size_t i) { return codomain_t(codomain(i)); },
+                                       dense_max_bytes );
+        }
+
+        // "dense", "hash" or "sorted", depending on the size and range of the mapping.
+        std::string strategy() const
+        {
+            return _mapping.strategy_name();
+        }
+
+        size_t size() const
+        {
+            return _mapping.size();
+        }
+
+        // Saves the mapping's tables to a file, in a layout which load_mmap() can use in-place.
+        void save(std::string const & path) const
+        {
+            _mapping.save(path);
+        }
+
+        // Loads a mapping saved with save(), by memory-mapping it (read-only).
+        // Nothing is rebuilt or copied, and every process which maps the same file
+        // shares its pages.
+        static LabelMapper load_mmap(std::string const & path)
+        {
+            return LabelMapper(flat_mapping_t::load_mmap(path));
         }
 
+        // The apply functions accept an optional num_threads.
+        // If an unmapped label is encountered (and not allowed), the KeyError
+        // reports the first such label in array (C) order, regardless of num_threads.
         template <typename array_t>
-        codomain_array_t apply( array_t const & src, bool allow_unmapped=false )
+        codomain_array_t apply( array_t const & src, bool allow_unmapped=false, int num_threads=1 )
         {
             auto res = codomain_array_t::from_shape(src.shape());
-            _apply_impl(src, res, allow_unmapped, 0, false);
+            _apply_impl(src, res, allow_unmapped, 0, false, num_threads);
             return res;
         }
 
         template <typename array_t>
-        codomain_array_t apply_with_default( array_t const & src, typename array_t::value_type default_value=0 )
+        codomain_array_t apply_with_default( array_t const & src, typename array_t::value_type default_value=0, int num_threads=1 )
         {
             auto res = codomain_array_t::from_shape(src.shape());
-            _apply_impl(src, res, true, default_value, true);
+            _apply_impl(src, res, true, default_value, true, num_threads);
             return res;
         }
         // FIXME: It would be nice to figure out how to allow unified function
         //        signatures that handle in-place and non-in-place calls...
         template <typename array_t>
-        void apply_inplace( array_t & src, bool allow_unmapped=false )
+        void apply_inplace( array_t & src, bool allow_unmapped=false, int num_threads=1 )
         {
-            _apply_impl(src, src, allow_unmapped, 0, false);
+            _apply_impl(src, src, allow_unmapped, 0, false, num_threads);
         }
 
-    private:
-        
-        template <typename input_array_t, typename output_array_t>
-        void _apply_impl( input_array_t const & src, output_array_t & res, bool allow_unmapped,
-                         typename output_array_t::value_type default_value, bool use_default )
+        // Maps one voxel at a time, with the same semantics as apply()/apply_with_default().
+        //
+        // We assume the global mapping may be quite large,
+        // but each input array apply() probably contains duplicate values.
+        // The most recently used values are kept in a small direct-mapped cache,
+        // so the global mapping is only consulted when a cache slot misses.
+        // The cached mapping type is based on the INPUT array dtypes (not the stored mapping dtypes)
+        //
+        // Each CachedLookup has its own cache, so it is cheap to copy
+        // (one per thread, for instance) but not thread-safe to share.
+        template <typename input_dtype, typename output_dtype>
+        class CachedLookup
         {
-            typedef typename input_array_t::value_type input_dtype;
-            typedef typename output_array_t::value_type output_dtype;
-            
-            // We assume the global mapping may be quite large,
-            // but each input array apply() probably contains duplicate values.
-            // Caching the mapping values found in src gives a ~10x speed boost.
-            // The cached mapping type is based on the INPUT array dtypes (not the stored mapping dtypes)
-            
-            // This cached mapping is stored in terms of the input/output arrays,
-            // because it will also store 'identity' entries.
-            typedef std::unordered_map<input_dtype, output_dtype> cached_mapping_t;
+        public:
+            static const int CACHE_BITS = 10;
 
-            cached_mapping_t cached_mapping;
-            
-            auto lookup_voxel = [&](input_dtype px) -> output_dtype {
-                
-                auto cache_iter = cached_mapping.find(px);
-                if (cache_iter != cached_mapping.end())
+            CachedLookup( flat_mapping_t const & mapping, bool allow_unmapped, output_dtype default_value, bool use_default )
+            : _mapping(&mapping)
+            , _allow_unmapped(allow_unmapped)
+            , _default_value(default_value)
+            , _use_default(use_default)
+            , _cache(size_t(1) << CACHE_BITS)
+            {
+            }
+
+            output_dtype operator()(input_dtype px) const
+            {
+                // A dense table is faster than the cache.
+                if (_mapping->strategy() == flat_mapping_t::Strategy::dense)
+                {
+                    return _lookup(px);
+                }
+
+                cache_entry & entry = _cache[fibonacci_hash(uint64_t(px)) >> (64 - CACHE_BITS)];
+                if (entry.valid && entry.key == px)
                 {
-                    return cache_iter->second;
+                    return entry.value;
                 }
-                
-                auto iter = _mapping.find(px);
-                if (iter != _mapping.end())
+
+                output_dtype value = _lookup(px);
+                entry.key = px;
+                entry.value = value;
+                entry.valid = true;
+                return value;
+            }
+
+        private:
+            output_dtype _lookup(input_dtype px) const
+            {
+                // Values that don't fit in domain_t can't be in the mapping
+                // (they must not be truncated into some other label).
+                codomain_t mapped;
+                domain_t key = static_cast<domain_t>(px);
+                if (static_cast<input_dtype>(key) == px && _mapping->find(key, mapped))
                 {
-                    auto value = iter->second;
-                    cached_mapping[px] = value;
-                    return value;
+                    return mapped;
                 }
-                
-                if (allow_unmapped)
+
+                if (_allow_unmapped)
                 {
                     // Key is missing.
                     // Return the original value or the default value, depending on use_default.
-                    auto value = default_value;
-                    if (!use_default)
+                    if (_use_default)
                     {
-                        value = static_cast<output_dtype>(px);
+                        return _default_value;
                     }
-                    cached_mapping[px] = value;
-                    return value;
+                    return static_cast<output_dtype>(px);
                 }
-                
+
                 throw KeyError("Label not found in mapping: " + std::to_string(+px));
-                return 0; // unreachable line
+            }
+
+            // This cache is stored in terms of the input/output arrays,
+            // because it will also store 'identity' entries.
+            struct cache_entry
+            {
+                input_dtype key = 0;
+                output_dtype value = 0;
+                bool valid = false;
             };
+
+            flat_mapping_t const * _mapping;
+            bool _allow_unmapped;
+            output_dtype _default_value;
+            bool _use_default;
+            mutable std::vector<cache_entry> _cache;
+        };
+
+        template <typename input_dtype, typename output_dtype=codomain_t>
+        CachedLookup<input_dtype, output_dtype> cached_lookup( bool allow_unmapped=false,
+                                                               output_dtype default_value=0,
+                                                               bool use_default=false ) const
+        {
+            return CachedLookup<input_dtype, output_dtype>(_mapping, allow_unmapped, default_value, use_default);
+        }
+
+    private:
+        
+        template <typename input_array_t, typename output_array_t>
+        void _apply_impl( input_array_t const & src, output_array_t & res, bool allow_unmapped,
+                         typename output_array_t::value_type default_value, bool use_default, int num_threads )
+        {
+            typedef typename input_array_t::value_type input_dtype;
+            typedef typename output_array_t::value_type output_dtype;
             
+            auto lookup_voxel = cached_lookup<input_dtype, output_dtype>(allow_unmapped, default_value, use_default);
+
+            // Contiguous arrays are split into flat ranges, one per thread, each with its own cache.
+            // Since each thread works in array order, and parallel_for_slabs() reports
+            // the exception from the earliest range, a KeyError names the first missing label.
+            bool const dense = (_mapping.strategy() == flat_mapping_t::Strategy::dense);
+            if ((num_threads != 1 || dense) && is_c_contiguous(src) && is_c_contiguous(res))
+            {
+                input_dtype const * src_data = src.data();
+                output_dtype * res_data = res.data();
+                parallel_for_slabs(src.size(), num_threads, [&](size_t begin, size_t end)
+                {
+                    auto local_lookup = lookup_voxel;
+                    if (!dense)
+                    {
+                        for (size_t i = begin; i < end; ++i)
+                        {
+                            res_data[i] = local_lookup(src_data[i]);
+                        }
+                        return;
+                    }
+
+                    // Gather one block at a time (src and res may be the same array).
+                    // A block with any missing labels is redone one voxel at a time,
+                    // to handle them according to allow_unmapped/default_value.
+                    const size_t BLOCK_SIZE = 1024;
+                    output_dtype block[BLOCK_SIZE];
+                    for (size_t block_begin = begin; block_begin < end; block_begin += BLOCK_SIZE)
+                    {
+                        size_t block_size = std::min(BLOCK_SIZE, end - block_begin);
+                        if (_mapping.gather(src_data + block_begin, block, block_size))
+                        {
+                            std::copy(block, block + block_size, res_data + block_begin);
+                            continue;
+                        }
+                        for (size_t i = block_begin; i < block_begin + block_size; ++i)
+                        {
+                            res_data[i] = local_lookup(src_data[i]);
+                        }
+                    }
+                });
+                return;
+            }
+
             xt::noalias(res) = xt::vectorize(lookup_voxel)(src);
         }
         
     private:
-        mapping_t _mapping;
+        flat_mapping_t _mapping;
     };
 }
 
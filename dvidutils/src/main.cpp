@@ -18,9 +18,14 @@
 #include "utils.hpp"
 #include "labelmapper.hpp"
 #include "downsample_labels.hpp"
+#include "downsample_labels_chunked.hpp"
+#include "downsample_grayscale.hpp"
+#include "mesh_labels.hpp"
+#include "label_stats.hpp"
 #include "remap_duplicates.hpp"
 #include "pydraco.hpp"
 #include "destripe.hpp"
+#include "pngutils.hpp"
 
 namespace py = pybind11;
 using namespace pybind11::literals;
@@ -30,9 +35,109 @@ namespace dvidutils
     // The LabelMapper constructor, but wrapped in a normal function
     template<typename domain_t, typename codomain_t>
     LabelMapper<domain_t, codomain_t> make_label_mapper( xt::pyarray<domain_t> domain,
-                                                         xt::pyarray<codomain_t> codomain )
+                                                         xt::pyarray<codomain_t> codomain,
+                                                         size_t dense_max_bytes )
     {
-        return LabelMapper<domain_t, codomain_t>(domain, codomain);
+        return LabelMapper<domain_t, codomain_t>(domain, codomain, dense_max_bytes);
+    }
+
+    // Remaps run-length encoded labels: runs of values[i], lengths[i] voxels long, starting at starts[i].
+    // Only the run values are mapped, so the cost scales with the number of runs, not voxels.
+    // Returns (starts, lengths, mapped_values), i.e. the same encoding.
+    template<typename LabelMapper_t, typename T>
+    py::tuple py_apply_rle( LabelMapper_t & mapper, py::array starts, py::array lengths,
+                            xt::pyarray<T> const & values, bool allow_unmapped )
+    {
+        if (starts.ndim() != 1 || lengths.ndim() != 1 || values.dimension() != 1
+            || size_t(starts.shape(0)) != values.shape()[0] || size_t(lengths.shape(0)) != values.shape()[0])
+        {
+            throw std::runtime_error("apply_rle(): starts, lengths, and values must be 1D arrays of the same length");
+        }
+
+        typename LabelMapper_t::codomain_array_t mapped;
+        {
+            py::gil_scoped_release nogil;
+            mapped = mapper.apply(values, allow_unmapped);
+        }
+        return py::make_tuple(starts, lengths, std::move(mapped));
+    }
+
+    // Remaps a palette-compressed block: voxel i has label palette[indices[i]].
+    // Only the palette is mapped; the indices are returned unchanged.
+    // Returns (mapped_palette, indices), i.e. the same encoding.
+    template<typename LabelMapper_t, typename T>
+    py::tuple py_apply_palette( LabelMapper_t & mapper, xt::pyarray<T> const & palette,
+                                py::array indices, bool allow_unmapped )
+    {
+        if (palette.dimension() != 1)
+        {
+            throw std::runtime_error("apply_palette(): palette must be a 1D array");
+        }
+
+        typename LabelMapper_t::codomain_array_t mapped;
+        {
+            py::gil_scoped_release nogil;
+            mapped = mapper.apply(palette, allow_unmapped);
+        }
+        return py::make_tuple(std::move(mapped), indices);
+    }
+
+    // Loads a LabelMapper file (from LabelMapper.save()) as the LabelMapper
+    // class whose domain/codomain dtypes match the file.
+    py::object load_label_mapper_mmap( std::string const & path )
+    {
+        flat_label_map_header header;
+        {
+            std::shared_ptr<void const> mapping;
+            header = mmap_flat_label_map(path, mapping);
+        }
+
+        auto sizes = std::make_pair(header.key_size, header.value_size);
+        if (sizes == std::make_pair(8u, 8u))
+        {
+            return py::cast(LabelMapper<uint64_t, uint64_t>::load_mmap(path));
+        }
+        if (sizes == std::make_pair(8u, 4u))
+        {
+            return py::cast(LabelMapper<uint64_t, uint32_t>::load_mmap(path));
+        }
+        if (sizes == std::make_pair(4u, 8u))
+        {
+            return py::cast(LabelMapper<uint32_t, uint64_t>::load_mmap(path));
+        }
+        if (sizes == std::make_pair(4u, 4u))
+        {
+            return py::cast(LabelMapper<uint32_t, uint32_t>::load_mmap(path));
+        }
+        if (sizes == std::make_pair(2u, 2u))
+        {
+            return py::cast(LabelMapper<uint16_t, uint16_t>::load_mmap(path));
+        }
+        if (sizes == std::make_pair(1u, 1u))
+        {
+            return py::cast(LabelMapper<uint8_t, uint8_t>::load_mmap(path));
+        }
+        std::ostringstream ss;
+        ss << "No LabelMapper type for key/value sizes " << header.key_size << "/" << header.value_size << " in " << path;
+        throw std::runtime_error(ss.str());
+    }
+
+    template<typename domain_t, typename codomain_t, typename T>
+    xt::pyarray<codomain_t> py_downsample_labels_mapped( xt::pyarray<T> const & labels,
+                                                         LabelMapper<domain_t, codomain_t> & mapper,
+                                                         int factor, bool suppress_zero, bool allow_unmapped, int num_threads )
+    {
+        if (labels.shape().size() == 3)
+        {
+            return downsample_labels_mapped<xt::pyarray<T>, 3>(labels, mapper, factor, suppress_zero, allow_unmapped, num_threads);
+        }
+        if (labels.shape().size() == 2)
+        {
+            return downsample_labels_mapped<xt::pyarray<T>, 2>(labels, mapper, factor, suppress_zero, allow_unmapped, num_threads);
+        }
+        std::ostringstream ss;
+        ss << "Unsupported number of dimensions: " << labels.shape().size();
+        throw std::runtime_error(ss.str());
     }
 
     // Exports LabelMapper<D,C> as a Python class,
@@ -48,7 +153,12 @@ namespace dvidutils
         std::string name = "LabelMapper_" + dtype_pair_name<domain_t, codomain_t>();
 
         auto cls = py::class_<LabelMapper_t>(m, name.c_str());
-        cls.def(py::init<xt::pyarray<domain_t>, xt::pyarray<codomain_t>>());
+        cls.def(py::init<xt::pyarray<domain_t>, xt::pyarray<codomain_t>, size_t>(),
+                "domain"_a, "codomain"_a, "dense_max_bytes"_a=DEFAULT_DENSE_MAX_BYTES);
+        cls.def_property_readonly("strategy", &LabelMapper_t::strategy);
+        cls.def("__len__", &LabelMapper_t::size);
+        cls.def("save", &LabelMapper_t::save, "path"_a, py::call_guard<py::gil_scoped_release>());
+        cls.def_static("load_mmap", &LabelMapper_t::load_mmap, "path"_a);
 
 
         // Must provide overloads for all possible arguments,
@@ -59,83 +169,115 @@ namespace dvidutils
         // not in-place
         cls.def("apply",
                 &LabelMapper_t::template apply<xt::pyarray<uint8_t>>,
-                "src"_a, "allow_unmapped"_a=false,
+                "src"_a, "allow_unmapped"_a=false, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
 
         cls.def("apply",
                 &LabelMapper_t::template apply<xt::pyarray<uint16_t>>,
-                "src"_a, "allow_unmapped"_a=false,
+                "src"_a, "allow_unmapped"_a=false, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
         
         cls.def("apply",
                 &LabelMapper_t::template apply<xt::pyarray<uint32_t>>,
-                "src"_a, "allow_unmapped"_a=false,
+                "src"_a, "allow_unmapped"_a=false, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
         
         cls.def("apply",
                 &LabelMapper_t::template apply<xt::pyarray<uint64_t>>,
-                "src"_a, "allow_unmapped"_a=false,
+                "src"_a, "allow_unmapped"_a=false, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
 
         // in-place
         cls.def("apply_inplace",
                 &LabelMapper_t::template apply_inplace<xt::pyarray<uint8_t>>,
-                "src"_a, "allow_unmapped"_a=false,
+                "src"_a, "allow_unmapped"_a=false, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
 
         cls.def("apply_inplace",
                 &LabelMapper_t::template apply_inplace<xt::pyarray<uint16_t>>,
-                "src"_a, "allow_unmapped"_a=false,
+                "src"_a, "allow_unmapped"_a=false, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
 
         cls.def("apply_inplace",
                 &LabelMapper_t::template apply_inplace<xt::pyarray<uint32_t>>,
-                "src"_a, "allow_unmapped"_a=false,
+                "src"_a, "allow_unmapped"_a=false, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
         
         cls.def("apply_inplace",
                 &LabelMapper_t::template apply_inplace<xt::pyarray<uint64_t>>,
-                "src"_a, "allow_unmapped"_a=false,
+                "src"_a, "allow_unmapped"_a=false, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
         
+        // run-length encoded and palette-compressed labels
+        cls.def("apply_rle", &py_apply_rle<LabelMapper_t, uint8_t>,  "starts"_a, "lengths"_a, "values"_a, "allow_unmapped"_a=false);
+        cls.def("apply_rle", &py_apply_rle<LabelMapper_t, uint16_t>, "starts"_a, "lengths"_a, "values"_a, "allow_unmapped"_a=false);
+        cls.def("apply_rle", &py_apply_rle<LabelMapper_t, uint32_t>, "starts"_a, "lengths"_a, "values"_a, "allow_unmapped"_a=false);
+        cls.def("apply_rle", &py_apply_rle<LabelMapper_t, uint64_t>, "starts"_a, "lengths"_a, "values"_a, "allow_unmapped"_a=false);
+
+        cls.def("apply_palette", &py_apply_palette<LabelMapper_t, uint8_t>,  "palette"_a, "indices"_a, "allow_unmapped"_a=false);
+        cls.def("apply_palette", &py_apply_palette<LabelMapper_t, uint16_t>, "palette"_a, "indices"_a, "allow_unmapped"_a=false);
+        cls.def("apply_palette", &py_apply_palette<LabelMapper_t, uint32_t>, "palette"_a, "indices"_a, "allow_unmapped"_a=false);
+        cls.def("apply_palette", &py_apply_palette<LabelMapper_t, uint64_t>, "palette"_a, "indices"_a, "allow_unmapped"_a=false);
+
         // with-default
         cls.def("apply_with_default",
                 &LabelMapper_t::template apply_with_default<xt::pyarray<uint8_t>>,
-                "src"_a, "default"_a=0,
+                "src"_a, "default"_a=0, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
         
         cls.def("apply_with_default",
                 &LabelMapper_t::template apply_with_default<xt::pyarray<uint16_t>>,
-                "src"_a, "default"_a=0,
+                "src"_a, "default"_a=0, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
         
         cls.def("apply_with_default",
                 &LabelMapper_t::template apply_with_default<xt::pyarray<uint32_t>>,
-                "src"_a, "default"_a=0,
+                "src"_a, "default"_a=0, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
         
         cls.def("apply_with_default",
                 &LabelMapper_t::template apply_with_default<xt::pyarray<uint64_t>>,
-                "src"_a, "default"_a=0,
+                "src"_a, "default"_a=0, "num_threads"_a=1,
                 py::call_guard<py::gil_scoped_release>());
         
         
         // Add an overload for LabelMapper(), which is actually a function that returns
         // the appropriate LabelMapper type (e.g. LabelMapper_u64u32)
-        m.def("LabelMapper", make_label_mapper<domain_t, codomain_t>, "domain"_a, "codomain"_a);
+        m.def("LabelMapper", make_label_mapper<domain_t, codomain_t>, "domain"_a, "codomain"_a, "dense_max_bytes"_a=DEFAULT_DENSE_MAX_BYTES);
+
+        // Fused mapping + downsampling (see downsample_labels_mapped())
+        m.def("downsample_labels_mapped",
+              &py_downsample_labels_mapped<domain_t, codomain_t, uint8_t>,
+              "labels"_a, "mapper"_a, "factor"_a, "suppress_zero"_a=false, "allow_unmapped"_a=false, "num_threads"_a=1,
+              py::call_guard<py::gil_scoped_release>());
+
+        m.def("downsample_labels_mapped",
+              &py_downsample_labels_mapped<domain_t, codomain_t, uint16_t>,
+              "labels"_a, "mapper"_a, "factor"_a, "suppress_zero"_a=false, "allow_unmapped"_a=false, "num_threads"_a=1,
+              py::call_guard<py::gil_scoped_release>());
+
+        m.def("downsample_labels_mapped",
+              &py_downsample_labels_mapped<domain_t, codomain_t, uint32_t>,
+              "labels"_a, "mapper"_a, "factor"_a, "suppress_zero"_a=false, "allow_unmapped"_a=false, "num_threads"_a=1,
+              py::call_guard<py::gil_scoped_release>());
+
+        m.def("downsample_labels_mapped",
+              &py_downsample_labels_mapped<domain_t, codomain_t, uint64_t>,
+              "labels"_a, "mapper"_a, "factor"_a, "suppress_zero"_a=false, "allow_unmapped"_a=false, "num_threads"_a=1,
+              py::call_guard<py::gil_scoped_release>());
     }
 
     template <typename T>
-    xt::pyarray<T> py_downsample_labels(xt::pyarray<T> const & labels, int factor, bool suppress_zero )
+    xt::pyarray<T> py_downsample_labels(xt::pyarray<T> const & labels, int factor, bool suppress_zero, int num_threads )
     {
         // FIXME: There's GOT to be a more elegant way to auto-select the right call based on dimansionality
         if (labels.shape().size() == 3)
         {
-            return downsample_labels<xt::pyarray<T>, 3>(labels, factor, suppress_zero);
+            return downsample_labels<xt::pyarray<T>, 3>(labels, factor, suppress_zero, num_threads);
         }
         if (labels.shape().size() == 2)
         {
-            return downsample_labels<xt::pyarray<T>, 2>(labels, factor, suppress_zero);
+            return downsample_labels<xt::pyarray<T>, 2>(labels, factor, suppress_zero, num_threads);
         }
         std::ostringstream ss;
         ss << "Unsupported number of dimensions: " << labels.shape().size();
@@ -143,35 +285,436 @@ namespace dvidutils
     }
 
 
-    xt::pytensor<uint8_t, 2, xt::layout_type::row_major> py_destripe(xt::pytensor<uint8_t, 2> & image_array,
-                                                                     std::vector<int> const & seam)
+    template <typename T>
+    xt::pyarray<T> py_downsample_grayscale(xt::pyarray<T> const & image, int factor, std::string const & method, int num_threads )
+    {
+        auto reduction = parse_grayscale_reduction(method);
+        if (image.shape().size() == 3)
+        {
+            return downsample_grayscale<xt::pyarray<T>, 3>(image, factor, reduction, num_threads);
+        }
+        if (image.shape().size() == 2)
+        {
+            return downsample_grayscale<xt::pyarray<T>, 2>(image, factor, reduction, num_threads);
+        }
+        std::ostringstream ss;
+        ss << "Unsupported number of dimensions: " << image.shape().size();
+        throw std::runtime_error(ss.str());
+    }
+
+    template <typename T>
+    std::vector<xt::pyarray<T>> py_downsample_labels_pyramid(xt::pyarray<T> const & labels, int levels, bool suppress_zero, int num_threads )
+    {
+        size_t ndim = labels.shape().size();
+        if (ndim != 2 && ndim != 3)
+        {
+            std::ostringstream ss;
+            ss << "Unsupported number of dimensions: " << ndim;
+            throw std::runtime_error(ss.str());
+        }
+
+        // Allocate the results while we still hold the GIL,
+        // then release it while the pyramid is computed.
+        std::vector<xt::pyarray<T>> pyramid;
+        for (auto const & shape : downsample_labels_pyramid_shapes(labels.shape(), levels))
+        {
+            pyramid.push_back(xt::pyarray<T>::from_shape(shape));
+        }
+
+        {
+            py::gil_scoped_release nogil;
+            if (ndim == 3)
+            {
+                downsample_labels_pyramid_into<3>(labels, pyramid, suppress_zero, num_threads);
+            }
+            else
+            {
+                downsample_labels_pyramid_into<2>(labels, pyramid, suppress_zero, num_threads);
+            }
+        }
+        return pyramid;
+    }
+
+
+    template <int N, typename T>
+    void py_downsample_labels_chunked_nd( xt::pyarray<T> const & labels, int factor, xt::pyarray<T> & out,
+                                          bool suppress_zero, int slab_depth, int num_threads )
+    {
+        check_chunked_output(labels.shape(), factor, out);
+
+        py::gil_scoped_release nogil;
+        downsample_labels_chunked<N>(labels, out.data(), factor, suppress_zero, slab_depth, num_threads);
+    }
+
+    // Downsamples 'labels' (typically a numpy.memmap) into 'out' (also typically a memmap),
+    // one slab at a time, so neither needs to fit in RAM.
+    template <typename T>
+    void py_downsample_labels_chunked( xt::pyarray<T> const & labels, int factor, xt::pyarray<T> & out,
+                                       bool suppress_zero, int slab_depth, int num_threads )
+    {
+        if (labels.shape().size() == 3)
+        {
+            return py_downsample_labels_chunked_nd<3>(labels, factor, out, suppress_zero, slab_depth, num_threads);
+        }
+        if (labels.shape().size() == 2)
+        {
+            return py_downsample_labels_chunked_nd<2>(labels, factor, out, suppress_zero, slab_depth, num_threads);
+        }
+        std::ostringstream ss;
+        ss << "Unsupported number of dimensions: " << labels.shape().size();
+        throw std::runtime_error(ss.str());
+    }
+
+    template <int N, typename T>
+    void py_downsample_labels_from_reader_nd( py::function reader, int factor, xt::pyarray<T> & out,
+                                              bool suppress_zero, int slab_depth, int num_threads )
+    {
+        std::vector<size_t> input_shape;
+        for (auto s : out.shape())
+        {
+            input_shape.push_back(s * factor);
+        }
+
+        // The two most recent slabs returned by the reader (see downsample_labels_streaming).
+        xt::pyarray<T> slabs[2];
+        size_t num_loaded = 0;
+
+        auto load_slab = [&](size_t begin, size_t end)
+        {
+            py::gil_scoped_acquire gil;
+            xt::pyarray<T> & slab = slabs[num_loaded++ % 2];
+            slab = reader(begin, end).template cast<xt::pyarray<T>>();
+
+            std::vector<size_t> expected_shape = input_shape;
+            expected_shape[0] = end - begin;
+            if (!std::equal(expected_shape.begin(), expected_shape.end(), slab.shape().begin(), slab.shape().end()))
+            {
+                std::ostringstream ss;
+                ss << "reader(" << begin << ", " << end << ") returned an array of the wrong shape: (";
+                for (auto d : slab.shape())
+                {
+                    ss << d << ", ";
+                }
+                ss << ")";
+                throw std::runtime_error(ss.str());
+            }
+            if (!rows_are_contiguous(slab))
+            {
+                throw std::runtime_error("reader() must return arrays with contiguous rows");
+            }
+            return label_slab<T>{ slab.data(), std::vector<std::ptrdiff_t>(slab.strides().begin(), slab.strides().end()) };
+        };
+
+        py::gil_scoped_release nogil;
+        downsample_labels_streaming<N>(load_slab, input_shape, out.data(), factor, suppress_zero, slab_depth, num_threads);
+    }
+
+    // Like the above, but the input is obtained from a Python callable,
+    // reader(start, stop) -> array of slices [start, stop) along the first axis,
+    // which is called for the next slab while the current one is being downsampled.
+    template <typename T>
+    void py_downsample_labels_from_reader( py::function reader, int factor, xt::pyarray<T> & out,
+                                           bool suppress_zero, int slab_depth, int num_threads )
+    {
+        if (!is_c_contiguous(out))
+        {
+            throw std::runtime_error("Output array must be C-contiguous");
+        }
+        if (out.shape().size() == 3)
+        {
+            return py_downsample_labels_from_reader_nd<3>(reader, factor, out, suppress_zero, slab_depth, num_threads);
+        }
+        if (out.shape().size() == 2)
+        {
+            return py_downsample_labels_from_reader_nd<2>(reader, factor, out, suppress_zero, slab_depth, num_threads);
+        }
+        std::ostringstream ss;
+        ss << "Unsupported number of dimensions: " << out.shape().size();
+        throw std::runtime_error(ss.str());
+    }
+
+
+    template <int N, typename T>
+    py::tuple py_label_stats_nd( xt::pyarray<T> const & labels, int num_threads )
+    {
+        label_stats_result<T, N> stats;
+        {
+            py::gil_scoped_release nogil;
+            stats = label_stats<xt::pyarray<T>, N>(labels, num_threads);
+        }
+
+        size_t n = stats.ids.size();
+        xt::pyarray<T> ids = xt::pyarray<T>::from_shape(std::vector<size_t>{n});
+        xt::pyarray<uint64_t> counts = xt::pyarray<uint64_t>::from_shape(std::vector<size_t>{n});
+        xt::pyarray<int64_t> min_corners = xt::pyarray<int64_t>::from_shape(std::vector<size_t>{n, size_t(N)});
+        xt::pyarray<int64_t> max_corners = xt::pyarray<int64_t>::from_shape(std::vector<size_t>{n, size_t(N)});
+        for (size_t i = 0; i < n; ++i)
+        {
+            ids(i) = stats.ids[i];
+            counts(i) = stats.counts[i];
+            for (int d = 0; d < N; ++d)
+            {
+                min_corners(i, d) = stats.min_corners[i][d];
+                max_corners(i, d) = stats.max_corners[i][d];
+            }
+        }
+        return py::make_tuple(std::move(ids), std::move(counts), std::move(min_corners), std::move(max_corners));
+    }
+
+    // Returns (ids, counts, min_corners, max_corners), sorted by label.
+    // The corners are inclusive.
+    template <typename T>
+    py::tuple py_label_stats( xt::pyarray<T> const & labels, int num_threads )
+    {
+        if (labels.shape().size() == 3)
+        {
+            return py_label_stats_nd<3>(labels, num_threads);
+        }
+        if (labels.shape().size() == 2)
+        {
+            return py_label_stats_nd<2>(labels, num_threads);
+        }
+        std::ostringstream ss;
+        ss << "Unsupported number of dimensions: " << labels.shape().size();
+        throw std::runtime_error(ss.str());
+    }
+
+
+    // Returns (vertices, faces, old_to_new), after merging duplicate vertices
+    // (or, if tolerance is non-zero, vertices within tolerance of each other).
+    std::tuple<xt::pytensor<float, 2>, xt::pytensor<uint32_t, 2>, xt::pytensor<uint32_t, 1>>
+    py_weld_vertices( xt::pytensor<float, 2> const & vertices, xt::pytensor<uint32_t, 2> const & faces, float tolerance )
+    {
+        welded_mesh welded;
+        {
+            py::gil_scoped_release nogil;
+            welded = weld_vertices(vertices, faces, tolerance);
+        }
+
+        xt::pytensor<float, 2>::shape_type verts_shape = {{welded.vertices.size() / 3, 3}};
+        xt::pytensor<float, 2> new_vertices(verts_shape);
+        std::copy(welded.vertices.begin(), welded.vertices.end(), new_vertices.data());
+
+        xt::pytensor<uint32_t, 2>::shape_type faces_shape = {{welded.faces.size() / 3, 3}};
+        xt::pytensor<uint32_t, 2> new_faces(faces_shape);
+        std::copy(welded.faces.begin(), welded.faces.end(), new_faces.data());
+
+        xt::pytensor<uint32_t, 1>::shape_type mapping_shape = {{welded.old_to_new.size()}};
+        xt::pytensor<uint32_t, 1> old_to_new(mapping_shape);
+        std::copy(welded.old_to_new.begin(), welded.old_to_new.end(), old_to_new.data());
+
+        return std::make_tuple( std::move(new_vertices), std::move(new_faces), std::move(old_to_new) );
+    }
+
+    // Returns a dict of {label: (vertices, faces)}, with vertices in X,Y,Z order.
+    template <typename T>
+    py::dict py_mesh_labels( xt::pyarray<T> const & labels, std::vector<T> label_ids,
+                             std::array<float, 3> voxel_size, std::array<float, 3> offset, int num_threads )
+    {
+        std::vector<LabelMesh> meshes;
+        {
+            py::gil_scoped_release nogil;
+            meshes = mesh_labels(labels, label_ids, voxel_size, offset, num_threads);
+        }
+
+        py::dict result;
+        for (size_t i = 0; i < meshes.size(); ++i)
+        {
+            auto & mesh = meshes[i];
+            xt::pytensor<float, 2>::shape_type verts_shape = {{mesh.vertices.size() / 3, 3}};
+            xt::pytensor<float, 2> vertices(verts_shape);
+            std::copy(mesh.vertices.begin(), mesh.vertices.end(), vertices.data());
+
+            xt::pytensor<uint32_t, 2>::shape_type faces_shape = {{mesh.faces.size() / 3, 3}};
+            xt::pytensor<uint32_t, 2> faces(faces_shape);
+            std::copy(mesh.faces.begin(), mesh.faces.end(), faces.data());
+
+            result[py::cast(label_ids[i])] = py::make_tuple(std::move(vertices), std::move(faces));
+        }
+        return result;
+    }
+
+    // Writes one '{label}.ngmesh' file per (non-empty) mesh into output_dir.
+    // Returns the list of labels which were written.
+    template <typename T>
+    std::vector<T> py_mesh_labels_to_ngmesh( xt::pyarray<T> const & labels, std::vector<T> label_ids, std::string const & output_dir,
+                                             std::array<float, 3> voxel_size, std::array<float, 3> offset, int num_threads )
+    {
+        auto meshes = mesh_labels(labels, label_ids, voxel_size, offset, num_threads);
+
+        std::vector<T> written;
+        for (size_t i = 0; i < meshes.size(); ++i)
+        {
+            if (meshes[i].faces.empty())
+            {
+                continue;
+            }
+            std::ostringstream path;
+            path << output_dir << "/" << uint64_t(label_ids[i]) << ".ngmesh";
+            write_ngmesh(path.str(), meshes[i]);
+            written.push_back(label_ids[i]);
+        }
+        return written;
+    }
+
+
+    // Returns the corrected image, or (if return_report is true) a tuple (image, report),
+    // where the report is a dict of timings and diagnostics (see DestripeReport).
+    //
+    // The input image is not modified.  If 'out' is given, the result is written there
+    // (and returned) instead of a new array.  It may be the input image itself.
+    py::object py_destripe(xt::pytensor<uint8_t, 2> const & image_array,
+                           std::vector<int> const & seam,
+                           int num_threads,
+                           bool return_report,
+                           py::object out)
     {
         // We assume c-contiguous input.
-        if (image_array.strides()[1] != 1)
+        if (!is_c_contiguous(image_array))
         {
             throw std::runtime_error("Input must be C_CONTIGUOUS");
         }
 
-        std::vector<uint8_t> corrected; // result
-
         auto s = image_array.shape();
         std::vector<size_t> shape( s.begin(), s.end() );
         size_t num_vertical_corrections = shape[0] / 1000;
 
+        // The result is written directly into its final numpy array (no intermediate copy).
+        // The caller's 'out' must be used as-is: converting it would write to a temporary copy.
+        py::object result;
+        uint8_t * output_ptr;
+        if (out.is_none())
+        {
+            xt::pytensor<uint8_t, 2>::shape_type result_shape = {{shape[0], shape[1]}};
+            xt::pytensor<uint8_t, 2> result_array(result_shape);
+            output_ptr = result_array.data();
+            result = py::cast(std::move(result_array));
+        }
+        else
+        {
+            if (!py::isinstance<py::array>(out))
+            {
+                throw std::runtime_error("out must be a numpy array");
+            }
+            auto out_array = out.cast<py::array>();
+            if ( !out_array.dtype().is(py::dtype::of<uint8_t>())
+                 || out_array.ndim() != 2
+                 || size_t(out_array.shape(0)) != shape[0]
+                 || size_t(out_array.shape(1)) != shape[1]
+                 || !(out_array.flags() & py::array::c_style)
+                 || !out_array.writeable() )
+            {
+                throw std::runtime_error("out must be a writeable, C_CONTIGUOUS uint8 array with the same shape as the image");
+            }
+            output_ptr = static_cast<uint8_t *>(out_array.mutable_data());
+
+            // In-place correction needs out to be exactly the image.  If it only partly overlaps,
+            // destripe() would read pixels which it (on another thread) has already overwritten.
+            uint8_t const * input_begin = image_array.data();
+            uint8_t const * input_end = input_begin + shape[0] * shape[1];
+            if ( output_ptr != input_begin
+                 && output_ptr < input_end
+                 && input_begin < output_ptr + shape[0] * shape[1] )
+            {
+                throw std::runtime_error("out overlaps the image (it must be either the image itself or a separate array)");
+            }
+            result = out;
+        }
+
+        DestripeReport report;
+
         // Release the GIL while the actual computation is running,
-        // but not when constructing the returned pytensor
-        // (I'm not sure if its safe to create a pytensor without the GIL.)
+        // but not when constructing the returned arrays.
         {
             py::gil_scoped_release nogil;
+            destripe(image_array.data(), output_ptr, shape[1], shape[0], num_vertical_corrections, seam, false,
+                     num_threads, &report);
+        }
 
-            uint8_t* image_ptr = &(image_array.at(0,0));
-            corrected = destripe(image_ptr, shape[1], shape[0], num_vertical_corrections, seam, false);
+        if (!return_report)
+        {
+            return result;
         }
 
-        // This implicit conversion will make a full copy,
-        // adding a second or so to the runtime of this function,
-        // which isn't so much compared to the ~1.5 minutes it takes to execute anyway.
-        return xt::adapt<xt::layout_type::row_major>(corrected, shape);
+        py::dict report_dict;
+        report_dict["column_stats_seconds"] = report.column_stats_seconds;
+        report_dict["slab_normalization_seconds"] = report.slab_normalization_seconds;
+        report_dict["seam_stats_seconds"] = report.seam_stats_seconds;
+        report_dict["correction_seconds"] = report.correction_seconds;
+        report_dict["total_seconds"] = report.total_seconds;
+        report_dict["num_threads"] = report.num_threads;
+        report_dict["ys"] = report.ys;
+        report_dict["slab_means"] = report.slab_means;
+        report_dict["measurements"] = report.measurements;
+        report_dict["plausible_measurements"] = report.plausible_measurements;
+        report_dict["left_corrections"] = report.left_corrections;
+        report_dict["right_corrections"] = report.right_corrections;
+        report_dict["unmatched_columns"] = report.unmatched_columns;
+        return py::make_tuple(result, report_dict);
+    }
+
+
+    // Decodes rows [start, start+n) of the png file into a new array.
+    template <typename T>
+    py::object read_png_rows(PngRowReader & reader, size_t start, size_t n)
+    {
+        typename xt::pytensor<T, 2>::shape_type shape = {{n, size_t(reader.width())}};
+        xt::pytensor<T, 2> rows(shape);
+        {
+            py::gil_scoped_release nogil;
+            reader.skip_rows(int(start));
+            reader.read_rows(rows.data(), int(n));
+        }
+        return py::cast(std::move(rows));
+    }
+
+    // Reads a grayscale png file (or just rows [start_row, stop_row) of it)
+    // as a 2D uint8 or uint16 array (for 16 bit files).
+    // The rows are decoded straight into the returned array.
+    py::object py_read_png(std::string const & path, int start_row, py::object stop_row)
+    {
+        PngRowReader reader(path.c_str());
+        int stop = stop_row.is_none() ? reader.height() : stop_row.cast<int>();
+        if (start_row < 0 || stop < start_row || stop > reader.height())
+        {
+            std::ostringstream ss;
+            ss << "Invalid row range [" << start_row << ", " << stop << ") for an image with "
+               << reader.height() << " rows";
+            throw std::runtime_error(ss.str());
+        }
+
+        size_t n = size_t(stop - start_row);
+        if (reader.bit_depth() == 16)
+        {
+            return read_png_rows<uint16_t>(reader, size_t(start_row), n);
+        }
+        return read_png_rows<uint8_t>(reader, size_t(start_row), n);
+    }
+
+
+    // Writes a 2D uint8 array as a grayscale png file.
+    // filters is a png filter name (none, sub, up, avg, paeth, all) or a comma-separated list of them.
+    // With num_threads > 1, bands of rows are compressed in parallel (see write_8bit_png()).
+    void py_write_png(std::string const & path, xt::pytensor<uint8_t, 2> const & image,
+                      int compression_level, std::string const & filters, int num_threads)
+    {
+        if (!is_c_contiguous(image))
+        {
+            throw std::runtime_error("Image must be C_CONTIGUOUS");
+        }
+
+        PngWriteOptions options;
+        options.compression_level = compression_level;
+        options.filters = png_filters_from_names(filters.c_str());
+        options.num_threads = num_threads;
+        if (options.filters == 0)
+        {
+            throw std::runtime_error("Unknown png filter(s): " + filters);
+        }
+
+        auto shape = image.shape();
+        py::gil_scoped_release nogil;
+        write_8bit_png(path.c_str(), image.data(), int(shape[1]), int(shape[0]), options);
     }
 
 
@@ -199,12 +742,52 @@ namespace dvidutils
         export_label_mapper<uint16_t, uint16_t>(m);
         export_label_mapper<uint8_t,  uint8_t>(m);
 
-        m.def("downsample_labels", &py_downsample_labels<uint64_t>, "labels"_a, "factor"_a, "suppress_zero"_a=false, py::call_guard<py::gil_scoped_release>());
-        m.def("downsample_labels", &py_downsample_labels<uint32_t>, "labels"_a, "factor"_a, "suppress_zero"_a=false, py::call_guard<py::gil_scoped_release>());
-        m.def("downsample_labels", &py_downsample_labels<uint16_t>, "labels"_a, "factor"_a, "suppress_zero"_a=false, py::call_guard<py::gil_scoped_release>());
-        m.def("downsample_labels", &py_downsample_labels<uint8_t>,  "labels"_a, "factor"_a, "suppress_zero"_a=false, py::call_guard<py::gil_scoped_release>());
+        m.def("load_label_mapper_mmap", &load_label_mapper_mmap, "path"_a);
+
+        m.def("downsample_labels", &py_downsample_labels<uint64_t>, "labels"_a, "factor"_a, "suppress_zero"_a=false, "num_threads"_a=1, py::call_guard<py::gil_scoped_release>());
+        m.def("downsample_labels", &py_downsample_labels<uint32_t>, "labels"_a, "factor"_a, "suppress_zero"_a=false, "num_threads"_a=1, py::call_guard<py::gil_scoped_release>());
+        m.def("downsample_labels", &py_downsample_labels<uint16_t>, "labels"_a, "factor"_a, "suppress_zero"_a=false, "num_threads"_a=1, py::call_guard<py::gil_scoped_release>());
+        m.def("downsample_labels", &py_downsample_labels<uint8_t>,  "labels"_a, "factor"_a, "suppress_zero"_a=false, "num_threads"_a=1, py::call_guard<py::gil_scoped_release>());
+
+        m.def("downsample_labels_pyramid", &py_downsample_labels_pyramid<uint64_t>, "labels"_a, "levels"_a, "suppress_zero"_a=false, "num_threads"_a=1);
+        m.def("downsample_labels_pyramid", &py_downsample_labels_pyramid<uint32_t>, "labels"_a, "levels"_a, "suppress_zero"_a=false, "num_threads"_a=1);
+        m.def("downsample_labels_pyramid", &py_downsample_labels_pyramid<uint16_t>, "labels"_a, "levels"_a, "suppress_zero"_a=false, "num_threads"_a=1);
+        m.def("downsample_labels_pyramid", &py_downsample_labels_pyramid<uint8_t>,  "labels"_a, "levels"_a, "suppress_zero"_a=false, "num_threads"_a=1);
+
+        // float32 comes first, so that other dtypes (e.g. float64) are converted to it rather than to uint8.
+        m.def("downsample_grayscale", &py_downsample_grayscale<float>,    "image"_a, "factor"_a, "method"_a="mean", "num_threads"_a=1, py::call_guard<py::gil_scoped_release>());
+        m.def("downsample_grayscale", &py_downsample_grayscale<uint16_t>, "image"_a, "factor"_a, "method"_a="mean", "num_threads"_a=1, py::call_guard<py::gil_scoped_release>());
+        m.def("downsample_grayscale", &py_downsample_grayscale<uint8_t>,  "image"_a, "factor"_a, "method"_a="mean", "num_threads"_a=1, py::call_guard<py::gil_scoped_release>());
+
+        // Neither the input nor the output may be converted (copied),
+        // since they are typically memory-mapped and larger than RAM.
+        m.def("downsample_labels_chunked", &py_downsample_labels_chunked<uint64_t>, "labels"_a.noconvert(), "factor"_a, "out"_a.noconvert(), "suppress_zero"_a=false, "slab_depth"_a=0, "num_threads"_a=1);
+        m.def("downsample_labels_chunked", &py_downsample_labels_chunked<uint32_t>, "labels"_a.noconvert(), "factor"_a, "out"_a.noconvert(), "suppress_zero"_a=false, "slab_depth"_a=0, "num_threads"_a=1);
+        m.def("downsample_labels_chunked", &py_downsample_labels_chunked<uint16_t>, "labels"_a.noconvert(), "factor"_a, "out"_a.noconvert(), "suppress_zero"_a=false, "slab_depth"_a=0, "num_threads"_a=1);
+        m.def("downsample_labels_chunked", &py_downsample_labels_chunked<uint8_t>,  "labels"_a.noconvert(), "factor"_a, "out"_a.noconvert(), "suppress_zero"_a=false, "slab_depth"_a=0, "num_threads"_a=1);
+
+        m.def("downsample_labels_chunked", &py_downsample_labels_from_reader<uint64_t>, "reader"_a, "factor"_a, "out"_a.noconvert(), "suppress_zero"_a=false, "slab_depth"_a=0, "num_threads"_a=1);
+        m.def("downsample_labels_chunked", &py_downsample_labels_from_reader<uint32_t>, "reader"_a, "factor"_a, "out"_a.noconvert(), "suppress_zero"_a=false, "slab_depth"_a=0, "num_threads"_a=1);
+        m.def("downsample_labels_chunked", &py_downsample_labels_from_reader<uint16_t>, "reader"_a, "factor"_a, "out"_a.noconvert(), "suppress_zero"_a=false, "slab_depth"_a=0, "num_threads"_a=1);
+        m.def("downsample_labels_chunked", &py_downsample_labels_from_reader<uint8_t>,  "reader"_a, "factor"_a, "out"_a.noconvert(), "suppress_zero"_a=false, "slab_depth"_a=0, "num_threads"_a=1);
+
+        m.def("label_stats", &py_label_stats<uint64_t>, "labels"_a, "num_threads"_a=1);
+        m.def("label_stats", &py_label_stats<uint32_t>, "labels"_a, "num_threads"_a=1);
+        m.def("label_stats", &py_label_stats<uint16_t>, "labels"_a, "num_threads"_a=1);
+        m.def("label_stats", &py_label_stats<uint8_t>,  "labels"_a, "num_threads"_a=1);
+
+        m.def("mesh_labels", &py_mesh_labels<uint64_t>, "labels"_a, "label_ids"_a=std::vector<uint64_t>(), "voxel_size"_a=std::array<float, 3>{{1.0f, 1.0f, 1.0f}}, "offset"_a=std::array<float, 3>{{0.0f, 0.0f, 0.0f}}, "num_threads"_a=1);
+        m.def("mesh_labels", &py_mesh_labels<uint32_t>, "labels"_a, "label_ids"_a=std::vector<uint32_t>(), "voxel_size"_a=std::array<float, 3>{{1.0f, 1.0f, 1.0f}}, "offset"_a=std::array<float, 3>{{0.0f, 0.0f, 0.0f}}, "num_threads"_a=1);
+        m.def("mesh_labels", &py_mesh_labels<uint16_t>, "labels"_a, "label_ids"_a=std::vector<uint16_t>(), "voxel_size"_a=std::array<float, 3>{{1.0f, 1.0f, 1.0f}}, "offset"_a=std::array<float, 3>{{0.0f, 0.0f, 0.0f}}, "num_threads"_a=1);
+        m.def("mesh_labels", &py_mesh_labels<uint8_t>,  "labels"_a, "label_ids"_a=std::vector<uint8_t>(),  "voxel_size"_a=std::array<float, 3>{{1.0f, 1.0f, 1.0f}}, "offset"_a=std::array<float, 3>{{0.0f, 0.0f, 0.0f}}, "num_threads"_a=1);
+
+        m.def("mesh_labels_to_ngmesh", &py_mesh_labels_to_ngmesh<uint64_t>, "labels"_a, "label_ids"_a, "output_dir"_a, "voxel_size"_a=std::array<float, 3>{{1.0f, 1.0f, 1.0f}}, "offset"_a=std::array<float, 3>{{0.0f, 0.0f, 0.0f}}, "num_threads"_a=1, py::call_guard<py::gil_scoped_release>());
+        m.def("mesh_labels_to_ngmesh", &py_mesh_labels_to_ngmesh<uint32_t>, "labels"_a, "label_ids"_a, "output_dir"_a, "voxel_size"_a=std::array<float, 3>{{1.0f, 1.0f, 1.0f}}, "offset"_a=std::array<float, 3>{{0.0f, 0.0f, 0.0f}}, "num_threads"_a=1, py::call_guard<py::gil_scoped_release>());
+        m.def("mesh_labels_to_ngmesh", &py_mesh_labels_to_ngmesh<uint16_t>, "labels"_a, "label_ids"_a, "output_dir"_a, "voxel_size"_a=std::array<float, 3>{{1.0f, 1.0f, 1.0f}}, "offset"_a=std::array<float, 3>{{0.0f, 0.0f, 0.0f}}, "num_threads"_a=1, py::call_guard<py::gil_scoped_release>());
+        m.def("mesh_labels_to_ngmesh", &py_mesh_labels_to_ngmesh<uint8_t>,  "labels"_a, "label_ids"_a, "output_dir"_a, "voxel_size"_a=std::array<float, 3>{{1.0f, 1.0f, 1.0f}}, "offset"_a=std::array<float, 3>{{0.0f, 0.0f, 0.0f}}, "num_threads"_a=1, py::call_guard<py::gil_scoped_release>());
 
         m.def("remap_duplicates", &remap_duplicates<xt::pytensor<float, 2>, xt::pytensor<uint32_t, 2>>, "vertices"_a, py::call_guard<py::gil_scoped_release>());
+        m.def("weld_vertices", &py_weld_vertices, "vertices"_a, "faces"_a, "tolerance"_a=0.0f);
         
         m.def("encode_faces_to_custom_drc_bytes",
               &encode_faces_to_custom_drc_bytes, // <-- Wow, that's an important '&' character.  If omitted, it causes segfaults during DECODE???
@@ -230,7 +813,16 @@ namespace dvidutils
               "generic_quantization_bits"_a=DEFAULT_GENERIC_QUANTIZATION_BITS);
     
         m.def("decode_drc_bytes_to_faces", &decode_drc_bytes_to_faces, "drc_bytes"_a);
+        m.def("snap_vertices_to_quantization_grid",
+              &snap_vertices_to_quantization_grid,
+              "vertices"_a,
+              "fragment_shape"_a,
+              "fragment_origin"_a,
+              "position_quantization_bits"_a=DEFAULT_POSITION_QUANTIZATION_BITS);
+
+        m.def("destripe", &py_destripe, "image"_a, "seams"_a, "num_threads"_a=1, "return_report"_a=false, "out"_a=py::none());
 
-        m.def("destripe", &py_destripe, "image"_a, "seams"_a);
+        m.def("read_png", &py_read_png, "path"_a, "start_row"_a=0, "stop_row"_a=py::none());
+        m.def("write_png", &py_write_png, "path"_a, "image"_a, "compression_level"_a=6, "filters"_a="all", "num_threads"_a=1);
     }
 }
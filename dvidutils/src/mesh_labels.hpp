@@ -0,0 +1,422 @@
+#ifndef DVIDUTILS_MESH_LABELS_HPP
+#define DVIDUTILS_MESH_LABELS_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "parallel.hpp"
+
+namespace dvidutils {
+
+    // The surface of one label: vertices (x,y,z) and triangles, both flattened.
+    struct LabelMesh
+    {
+        std::vector<float> vertices;
+        std::vector<uint32_t> faces;
+    };
+
+    // Extracts the surfaces of the given labels from a 3D label volume (ZYX order),
+    // all in a single sweep over the volume.
+    //
+    // The surfaces are computed with "surface nets", the dual of marching cubes:
+    // each 2x2x2 cell of voxels which straddles a label's boundary gets one vertex
+    // (at the mean of its boundary-crossing edge midpoints), and each pair of adjacent
+    // voxels with different labels yields a quad (two triangles) joining the four cells
+    // around their shared edge. Since vertices are identified by their cell, the result
+    // is welded by construction. Voxels outside the volume are treated as background,
+    // so every surface is closed.
+    //
+    // Vertices are returned in XYZ order, in voxel-center coordinates scaled by
+    // voxel_size (XYZ) and shifted by offset (XYZ). Faces are oriented outward.
+    //
+    // The volume is split into slabs (along Z) which are meshed in parallel.
+    // Cells on slab seams are shared, so the per-thread results are welded when merged.
+    //
+    // If label_ids is empty, all non-zero labels in the volume are meshed.
+    // Returns one LabelMesh per label, in the same order as label_ids
+    // (or in ascending label order, if label_ids was empty).
+    template <typename label_array_t>
+    std::vector<LabelMesh> mesh_labels( label_array_t const & labels,
+                                        std::vector<typename label_array_t::value_type> & label_ids,
+                                        std::array<float, 3> voxel_size = {{1.0f, 1.0f, 1.0f}},
+                                        std::array<float, 3> offset = {{0.0f, 0.0f, 0.0f}},
+                                        int num_threads = 1 )
+    {
+        using label_t = typename label_array_t::value_type;
+
+        if (labels.shape().size() != 3)
+        {
+            std::ostringstream ss;
+            ss << "mesh_labels() requires a 3D volume, but got " << labels.shape().size() << " dimensions";
+            throw std::runtime_error(ss.str());
+        }
+
+        // Real volume shape, and the shape of the cell grid
+        // (cells straddle the one-voxel background border around the volume).
+        std::array<size_t, 3> shape;
+        std::array<size_t, 3> cells_shape;
+        std::array<std::ptrdiff_t, 3> strides;
+        for (int d = 0; d < 3; ++d)
+        {
+            shape[d] = labels.shape()[d];
+            cells_shape[d] = shape[d] + 1;
+            strides[d] = labels.strides()[d];
+        }
+        label_t const * data = labels.data();
+
+        // Returns true (and the label) if the padded voxel index lies within the real volume.
+        auto label_at = [&](size_t pz, size_t py, size_t px, label_t & label)
+        {
+            if (pz == 0 || py == 0 || px == 0 || pz > shape[0] || py > shape[1] || px > shape[2])
+            {
+                return false;
+            }
+            label = data[(pz-1)*strides[0] + (py-1)*strides[1] + (px-1)*strides[2]];
+            return true;
+        };
+
+        if (label_ids.empty())
+        {
+            std::unordered_map<label_t, bool> present;
+            for (size_t z = 0; z < shape[0]; ++z)
+            {
+                for (size_t y = 0; y < shape[1]; ++y)
+                {
+                    for (size_t x = 0; x < shape[2]; ++x)
+                    {
+                        label_t label = data[z*strides[0] + y*strides[1] + x*strides[2]];
+                        if (label != 0)
+                        {
+                            present[label] = true;
+                        }
+                    }
+                }
+            }
+            for (auto const & p : present)
+            {
+                label_ids.push_back(p.first);
+            }
+            std::sort(label_ids.begin(), label_ids.end());
+        }
+
+        std::unordered_map<label_t, int> label_indexes;
+        for (size_t i = 0; i < label_ids.size(); ++i)
+        {
+            label_indexes[label_ids[i]] = i;
+        }
+        int const num_labels = label_ids.size();
+
+        // Returns the index of the label in label_ids, or -1 if it wasn't requested.
+        auto label_index = [&](label_t label)
+        {
+            auto iter = label_indexes.find(label);
+            if (iter == label_indexes.end())
+            {
+                return -1;
+            }
+            return iter->second;
+        };
+
+        // Each thread owns a slab of cell slices (and the voxel edges in the same slices).
+        int const T = resolve_num_threads(cells_shape[0], num_threads);
+        std::vector<size_t> slab_begins;
+        for (int t = 0; t <= T; ++t)
+        {
+            slab_begins.push_back(cells_shape[0] * t / T);
+        }
+
+        // Vertex references in a slab's faces are local to the slab,
+        // or (with this bit set) refer to its 'ghost' layer: the last cell slice of the
+        // previous slab, which each thread recomputes instead of waiting for its neighbor.
+        uint32_t const GHOST = 0x80000000u;
+
+        struct SlabMeshes
+        {
+            std::vector<std::vector<float>> vertices;      // per label
+            std::vector<std::vector<uint32_t>> faces;      // per label
+            std::vector<uint32_t> last_layer_begin;        // per label: first vertex of the last cell slice
+        };
+        std::vector<SlabMeshes> slabs(T);
+
+        // The vertices of one slice of cells: for each cell, a list of (label index, vertex reference)
+        struct CellLayer
+        {
+            std::vector<uint32_t> first;
+            std::vector<std::pair<int, uint32_t>> entries;
+        };
+        size_t const layer_size = cells_shape[1] * cells_shape[2];
+
+        parallel_for_slabs(T, T, [&](size_t t_begin, size_t t_end)
+        {
+            for (size_t t = t_begin; t < t_end; ++t)
+            {
+                SlabMeshes & slab = slabs[t];
+                slab.vertices.resize(num_labels);
+                slab.faces.resize(num_labels);
+                slab.last_layer_begin.resize(num_labels);
+                std::vector<uint32_t> num_ghosts(num_labels, 0);
+
+                // Remember the most recent label lookup; neighboring boundary cells usually share labels.
+                label_t last_label = 0;
+                int last_index = label_index(0);
+                auto cached_label_index = [&](label_t label)
+                {
+                    if (label != last_label)
+                    {
+                        last_label = label;
+                        last_index = label_index(label);
+                    }
+                    return last_index;
+                };
+
+                // Computes the vertices (one per label with a boundary in the cell)
+                // of every cell in slice cz.
+                auto compute_layer = [&](size_t cz, bool ghost, CellLayer & layer)
+                {
+                    layer.first.resize(layer_size + 1);
+                    layer.entries.clear();
+                    for (size_t cy = 0; cy < cells_shape[1]; ++cy)
+                    {
+                        for (size_t cx = 0; cx < cells_shape[2]; ++cx)
+                        {
+                            layer.first[cy*cells_shape[2] + cx] = layer.entries.size();
+
+                            // Corner i is at offset (i>>2 & 1, i>>1 & 1, i & 1) in (z,y,x)
+                            label_t corners[8];
+                            bool valid[8];
+                            for (int i = 0; i < 8; ++i)
+                            {
+                                valid[i] = label_at(cz + ((i>>2) & 1), cy + ((i>>1) & 1), cx + (i & 1), corners[i]);
+                            }
+
+                            bool uniform = true;
+                            for (int i = 1; i < 8; ++i)
+                            {
+                                uniform = uniform && (valid[i] == valid[0]) && (corners[i] == corners[0] || !valid[i]);
+                            }
+                            if (uniform)
+                            {
+                                continue;
+                            }
+
+                            for (int i = 0; i < 8; ++i)
+                            {
+                                if (!valid[i])
+                                {
+                                    continue;
+                                }
+
+                                // Only handle each distinct label once per cell
+                                bool seen = false;
+                                for (int j = 0; j < i; ++j)
+                                {
+                                    seen = seen || (valid[j] && corners[j] == corners[i]);
+                                }
+                                int index = seen ? -1 : cached_label_index(corners[i]);
+                                if (index < 0)
+                                {
+                                    continue;
+                                }
+
+                                int inside = 0;
+                                for (int j = 0; j < 8; ++j)
+                                {
+                                    inside |= (valid[j] && corners[j] == corners[i]) << j;
+                                }
+                                if (inside == 0xFF)
+                                {
+                                    continue;
+                                }
+
+                                if (ghost)
+                                {
+                                    layer.entries.emplace_back(index, GHOST | num_ghosts[index]++);
+                                    continue;
+                                }
+
+                                // Mean of the midpoints of the edges which cross the boundary
+                                float sum[3] = {0.0f, 0.0f, 0.0f};
+                                int crossings = 0;
+                                for (int j = 0; j < 8; ++j)
+                                {
+                                    for (int bit = 1; bit < 8; bit <<= 1)
+                                    {
+                                        int k = j | bit;
+                                        if ((j & bit) || ((inside >> j) & 1) == ((inside >> k) & 1))
+                                        {
+                                            continue;
+                                        }
+                                        sum[0] += ((j>>2) & 1) + ((k>>2) & 1);
+                                        sum[1] += ((j>>1) & 1) + ((k>>1) & 1);
+                                        sum[2] += (j & 1) + (k & 1);
+                                        ++crossings;
+                                    }
+                                }
+
+                                // Padded cell index -> voxel-center coordinates
+                                float zyx[3] = { float(cz) - 1.0f + sum[0] / (2*crossings),
+                                                 float(cy) - 1.0f + sum[1] / (2*crossings),
+                                                 float(cx) - 1.0f + sum[2] / (2*crossings) };
+
+                                auto & vertices = slab.vertices[index];
+                                layer.entries.emplace_back(index, vertices.size() / 3);
+                                for (int k = 0; k < 3; ++k)
+                                {
+                                    vertices.push_back(zyx[2-k] * voxel_size[k] + offset[k]);
+                                }
+                            }
+                        }
+                    }
+                    layer.first[layer_size] = layer.entries.size();
+                };
+
+                auto find_vertex = [&](CellLayer const & layer, size_t cy, size_t cx, int index)
+                {
+                    size_t cell = cy*cells_shape[2] + cx;
+                    for (uint32_t e = layer.first[cell]; e < layer.first[cell+1]; ++e)
+                    {
+                        if (layer.entries[e].first == index)
+                        {
+                            return layer.entries[e].second;
+                        }
+                    }
+                    throw std::runtime_error("mesh_labels(): internal error: missing cell vertex");
+                };
+
+                CellLayer layers[2];
+                size_t const slab_begin = slab_begins[t];
+                size_t const slab_end = slab_begins[t+1];
+                if (slab_begin > 0)
+                {
+                    compute_layer(slab_begin - 1, true, layers[(slab_begin - 1) % 2]);
+                }
+
+                for (size_t pz = slab_begin; pz < slab_end; ++pz)
+                {
+                    if (pz == slab_end - 1)
+                    {
+                        for (int index = 0; index < num_labels; ++index)
+                        {
+                            slab.last_layer_begin[index] = slab.vertices[index].size() / 3;
+                        }
+                    }
+                    compute_layer(pz, false, layers[pz % 2]);
+
+                    // An edge from padded voxel p to p+1 along array axis 'a' (real voxels only on the
+                    // other axes) is surrounded by the cells p-1 and p on the other two axes, and p on axis a.
+                    // All of those cells are in this slice or the previous one.
+                    for (size_t py = 0; py <= shape[1]; ++py)
+                    {
+                        for (size_t px = 0; px <= shape[2]; ++px)
+                        {
+                            label_t label_p = 0;
+                            bool valid_p = label_at(pz, py, px, label_p);
+                            size_t p[3] = {pz, py, px};
+
+                            for (int a = 0; a < 3; ++a)
+                            {
+                                // Array axes u and v follow a in (x,y,z) right-handed order,
+                                // so (u,v) counter-clockwise is facing +a.
+                                // (Array axis d is xyz axis 2-d.)
+                                int A = 2 - a;
+                                int u = 2 - (A+1) % 3;
+                                int v = 2 - (A+2) % 3;
+                                if (p[u] == 0 || p[v] == 0 || p[u] > shape[u] || p[v] > shape[v])
+                                {
+                                    continue;
+                                }
+
+                                size_t q[3] = {p[0], p[1], p[2]};
+                                q[a] += 1;
+                                label_t label_q = 0;
+                                bool valid_q = label_at(q[0], q[1], q[2], label_q);
+                                if (valid_p == valid_q && (!valid_p || label_p == label_q))
+                                {
+                                    continue;
+                                }
+
+                                // The lower voxel's surface faces +a; the upper voxel's faces -a.
+                                for (int side = 0; side < 2; ++side)
+                                {
+                                    bool valid = (side == 0) ? valid_p : valid_q;
+                                    label_t label = (side == 0) ? label_p : label_q;
+                                    int index = valid ? cached_label_index(label) : -1;
+                                    if (index < 0)
+                                    {
+                                        continue;
+                                    }
+
+                                    // Corner cells, counter-clockwise around +a
+                                    static const int du[4] = {1, 0, 0, 1};
+                                    static const int dv[4] = {1, 1, 0, 0};
+                                    uint32_t quad[4];
+                                    for (int k = 0; k < 4; ++k)
+                                    {
+                                        int corner = (side == 0) ? k : (3 - k);
+                                        size_t c[3] = {p[0], p[1], p[2]};
+                                        c[u] -= du[corner];
+                                        c[v] -= dv[corner];
+                                        quad[k] = find_vertex(layers[c[0] % 2], c[1], c[2], index);
+                                    }
+
+                                    auto & faces = slab.faces[index];
+                                    faces.insert(faces.end(), {quad[0], quad[1], quad[2]});
+                                    faces.insert(faces.end(), {quad[0], quad[2], quad[3]});
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        });
+
+        // Merge the slabs, welding each slab's ghost vertices to its predecessor's last layer.
+        std::vector<LabelMesh> meshes(num_labels);
+        for (int index = 0; index < num_labels; ++index)
+        {
+            auto & mesh = meshes[index];
+            uint32_t previous_offset = 0;
+            for (int t = 0; t < T; ++t)
+            {
+                auto const & slab = slabs[t];
+                uint32_t offset = mesh.vertices.size() / 3;
+                uint32_t ghost_offset = (t > 0) ? previous_offset + slabs[t-1].last_layer_begin[index] : 0;
+                for (auto f : slab.faces[index])
+                {
+                    mesh.faces.push_back((f & GHOST) ? (ghost_offset + (f & ~GHOST)) : (offset + f));
+                }
+                mesh.vertices.insert(mesh.vertices.end(), slab.vertices[index].begin(), slab.vertices[index].end());
+                previous_offset = offset;
+            }
+        }
+        return meshes;
+    }
+
+    // Writes a mesh in the (legacy neuroglancer) 'ngmesh' format:
+    // uint32 vertex count, float32 xyz vertices, then uint32 triangle indices.
+    inline void write_ngmesh(std::string const & path, LabelMesh const & mesh)
+    {
+        std::ofstream f(path, std::ios::binary);
+        if (!f)
+        {
+            throw std::runtime_error("Could not open " + path + " for writing");
+        }
+        uint32_t num_vertices = mesh.vertices.size() / 3;
+        f.write(reinterpret_cast<char const *>(&num_vertices), sizeof(num_vertices));
+        f.write(reinterpret_cast<char const *>(mesh.vertices.data()), mesh.vertices.size() * sizeof(float));
+        f.write(reinterpret_cast<char const *>(mesh.faces.data()), mesh.faces.size() * sizeof(uint32_t));
+        if (!f)
+        {
+            throw std::runtime_error("Failed to write " + path);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef DVIDUTILS_PARALLEL_HPP
+#define DVIDUTILS_PARALLEL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace dvidutils
+{
+    // Returns the number of threads to actually use for n work items,
+    // given the caller's request (num_threads <= 0 means "one per core").
+    inline int resolve_num_threads(std::size_t n, int num_threads)
+    {
+        if (num_threads <= 0)
+        {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        return static_cast<int>(std::max<std::size_t>(1, std::min<std::size_t>(n, num_threads)));
+    }
+
+    // Splits the range [0, n) into contiguous slabs, one per thread,
+    // and calls f(begin, end) for each of them.
+    //
+    // With a single thread, f is simply called on the calling thread.
+    // If any slab throws, all threads are joined first, and then the exception
+    // from the EARLIEST slab is re-thrown, so errors are reported as they
+    // would have been by a serial loop over [0, n).
+    template <typename F>
+    void parallel_for_slabs(std::size_t n, int num_threads, F && f)
+    {
+        num_threads = resolve_num_threads(n, num_threads);
+        if (num_threads == 1)
+        {
+            f(std::size_t(0), n);
+            return;
+        }
+
+        std::vector<std::exception_ptr> errors(num_threads);
+        std::vector<std::thread> threads;
+        threads.reserve(num_threads);
+        for (int t = 0; t < num_threads; ++t)
+        {
+            std::size_t begin = n * t / num_threads;
+            std::size_t end = n * (t+1) / num_threads;
+            threads.emplace_back([&f, &errors, t, begin, end]() {
+                try
+                {
+                    f(begin, end);
+                }
+                catch (...)
+                {
+                    errors[t] = std::current_exception();
+                }
+            });
+        }
+        for (auto & thread : threads)
+        {
+            thread.join();
+        }
+        for (auto & error : errors)
+        {
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+    // True if the array's elements are laid out in C order, without gaps,
+    // i.e. it can be split into flat ranges of elements.
+    template <typename array_t>
+    bool is_c_contiguous(array_t const & a)
+    {
+        std::ptrdiff_t expected = 1;
+        for (int d = int(a.shape().size()) - 1; d >= 0; --d)
+        {
+            if (a.shape()[d] != 1 && a.strides()[d] != expected)
+            {
+                return false;
+            }
+            expected *= a.shape()[d];
+        }
+        return true;
+    }
+}
+
+#endif // DVIDUTILS_PARALLEL_HPP
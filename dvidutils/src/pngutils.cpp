@@ -1,94 +1,471 @@
+#include <algorithm>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <strings.h>
 #include <vector>
 
 #include <png.h>
+#include <zlib.h>
 #include "pngutils.hpp"
+#include "parallel.hpp"
+
+int png_filters_from_names(const char *names)
+{
+    static const char *filter_names[] = {"none", "sub", "up", "avg", "paeth"};
+    int filters = 0;
+    std::string list(names);
+    size_t start = 0;
+    while (true) {
+        size_t comma = list.find(',', start);
+        std::string name = list.substr(start, (comma == std::string::npos) ? std::string::npos : comma - start);
+        int flags = (strcasecmp(name.c_str(), "all") == 0) ? PNG_ALL_FILTERS : 0;
+        for(int type=0; type<5; type++) {
+            if (strcasecmp(name.c_str(), filter_names[type]) == 0)
+                flags = PNG_FILTER_NONE << type;
+        }
+        if (flags == 0)
+            return 0;
+        filters |= flags;
+        if (comma == std::string::npos)
+            return filters;
+        start = comma + 1;
+    }
+}
 
 // Reads an 8 bit png file.
+// The rows are decoded directly into the returned buffer (which the caller must free()).
 uint8* read_8bit_png_file(const char *file_name, int &w, int &h)
 {
-    FILE *fp = fopen(file_name, "rb");
-    if (!fp) {
+    try {
+        PngRowReader reader(file_name);
+        printf("width %d, height %d, bit depth %d\n", reader.width(), reader.height(), reader.bit_depth());
+        if (reader.bit_depth() != 8) {
+            printf("Trying 8 bit read; Cannot read .png file '%s' with bit depth %d\n", file_name, reader.bit_depth());
+            return NULL;
+        }
+        uint8* rslt = (uint8 *)malloc(reader.row_bytes() * reader.height());
+        if (!rslt)
+            return NULL;
+        try {
+            reader.read_rows(rslt, reader.height());
+        }
+        catch (...) {
+            free(rslt);
+            throw;
+        }
+        w = reader.width();   // returned values
+        h = reader.height();
+        return rslt;
+    }
+    catch (std::exception const & e) {
+        printf("%s\n", e.what());
         return NULL;
     }
+}
+
+// libpng reports errors by longjmp()ing back to the most recent setjmp() on png_jmpbuf(png_ptr).
+// Each function below that calls libpng sets that point (with no C++ objects in scope that would be skipped),
+// and turns a jump into an exception.
+
+PngRowReader::PngRowReader(const char *file_name)
+{
+    fp = fopen(file_name, "rb");
+    if (!fp)
+        throw std::runtime_error(std::string("Could not open '") + file_name + "'");
+
     const int number=8;  // read this many bytes
     png_byte header[number];
-    fread(header, 1, number, fp);
-    bool is_png = !png_sig_cmp(header, 0, number);
-    if (!is_png) {
-        return NULL;  // not a .png file
-    }
-    
-    // create the structures
-    png_structp png_ptr = png_create_read_struct
-    (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL); // use default error handlers
-    if (!png_ptr)
-        return NULL;
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-        return NULL;
+    if (fread(header, 1, number, fp) != number || png_sig_cmp(header, 0, number)) {
+        fclose(fp);
+        throw std::runtime_error(std::string("Not a .png file: '") + file_name + "'");
     }
-    
-    png_init_io(png_ptr, fp);
-    png_set_sig_bytes(png_ptr, number);
-    
-    png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_SWAP_ENDIAN, NULL);
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+    int bit_depth = 0, color_type = 0, interlace_type = 0;
+    bool failed = !info_ptr;
+    if (!failed && setjmp(png_jmpbuf(png_ptr)))
+        failed = true;
+    else if (!failed) {
+        png_init_io(png_ptr, fp);
+        png_set_sig_bytes(png_ptr, number);
+        png_read_info(png_ptr, info_ptr);
+
+        png_uint_32 width, height;
+        png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
+        w = width;
+        h = height;
+
+        if (color_type == PNG_COLOR_TYPE_GRAY && interlace_type == PNG_INTERLACE_NONE) {
+            if (bit_depth < 8)
+                png_set_expand_gray_1_2_4_to_8(png_ptr);
+
+            // png stores 16 bit samples big-endian.
+            const uint16_t one = 1;
+            if (bit_depth == 16 && *reinterpret_cast<const uint8 *>(&one) == 1)
+                png_set_swap(png_ptr);
+
+            png_read_update_info(png_ptr, info_ptr);
+            depth = (bit_depth == 16) ? 16 : 8;
+        }
+    }
+    if (failed || color_type != PNG_COLOR_TYPE_GRAY || interlace_type != PNG_INTERLACE_NONE) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        fclose(fp);
+        if (failed)
+            throw std::runtime_error(std::string("Could not read .png header of '") + file_name + "'");
+        throw std::runtime_error(std::string("Only non-interlaced grayscale .png files can be read by rows: '") + file_name + "'");
+    }
+}
+
+PngRowReader::~PngRowReader()
+{
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
     fclose(fp);
-    
-    // now get some info about the
-    int bit_depth, color_type;
-    png_uint_32 width, height;
-    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, NULL, NULL, NULL);
-    printf("width %d, height %d, bit depth %d, color_type %d\n", width, height, bit_depth, color_type);
-    
-    // get the pointers to each row.
-    uint8* rslt = (uint8 *)malloc(height*width*sizeof(uint8));
-    if (bit_depth == 8){
-        png_byte **row_ptrs = (png_byte**)png_get_rows(png_ptr, info_ptr);
-        int n=0;
-        for(int y=0; y<height; y++)
-            for(int x=0; x<width; x++)
-                rslt[n++] = row_ptrs[y][x];
-    }
-    else {
-        printf("Trying 8 bit read; Cannot read .png file '%s' with bit depth %d\n", file_name, bit_depth);
-        free(rslt);
-        rslt = NULL;
-    }
-    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);  // we've made a copy, so free original
-    w = width;   // returned values.  Just to make types 'int' for convenience
-    h = height;
-    return rslt;
 }
 
-// Writes an in-memory raster as an 8 bit .png file
-void write_8bit_png_file(const char* file_name, unsigned char *raster, int width, int  height)
-{
-    /* create file */
-    FILE *fp = fopen(file_name, "w");
-    if (fp == NULL) {
-        printf("Open for write of 8-bit '%s' failed\n", file_name);
-        exit(-1);
-    }
-    
-    /* initialize stuff */
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_infop  info_ptr = png_create_info_struct(png_ptr);
-    png_init_io(png_ptr, fp);
-    
-    png_byte bit_depth = 8;
-    png_byte color_type = PNG_COLOR_TYPE_GRAY;
-    png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-    png_write_info(png_ptr, info_ptr);
-    
-    // create the row pointers
-    std::vector<png_byte *> row_pointers(height);
-    for(int i=0; i<height; i++)
-        row_pointers[i] = (png_byte *)(raster+i*width);
-    png_write_image(png_ptr, &row_pointers[0]);
-    
+void PngRowReader::read_rows(void *buf, int n)
+{
+    if (n < 0 || n > h - y)
+        throw std::runtime_error("Attempt to read past the last row of a .png file");
+    if (setjmp(png_jmpbuf(png_ptr)))
+        throw std::runtime_error("Error while reading .png rows");
+    uint8 *rows = static_cast<uint8 *>(buf);
+    for(int i=0; i<n; i++)
+        png_read_row(png_ptr, rows + size_t(i)*row_bytes(), NULL);
+    y += n;
+}
+
+void PngRowReader::skip_rows(int n)
+{
+    if (n < 0 || n > h - y)
+        throw std::runtime_error("Attempt to skip past the last row of a .png file");
+    if (setjmp(png_jmpbuf(png_ptr)))
+        throw std::runtime_error("Error while reading .png rows");
+    // (The rows must still be decoded, but with no destination they aren't copied anywhere.)
+    for(int i=0; i<n; i++)
+        png_read_row(png_ptr, NULL, NULL);
+    y += n;
+}
+
+static void check_options(PngWriteOptions const & options)
+{
+    if (options.compression_level < -1 || options.compression_level > 9)
+        throw std::runtime_error("Invalid png compression level: " + std::to_string(options.compression_level));
+    if (options.filters == 0 || (options.filters & ~PNG_ALL_FILTERS) != 0)
+        throw std::runtime_error("Invalid png filters: " + std::to_string(options.filters));
+}
+
+PngRowWriter::PngRowWriter(const char *file_name, int width, int height, PngWriteOptions const & options)
+: w(width)
+{
+    check_options(options);
+    fp = fopen(file_name, "wb");
+    if (!fp)
+        throw std::runtime_error(std::string("Open for write of 8-bit '") + file_name + "' failed");
+
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+    bool failed = !info_ptr;
+    if (!failed && setjmp(png_jmpbuf(png_ptr)))
+        failed = true;
+    else if (!failed) {
+        png_init_io(png_ptr, fp);
+        png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+        png_set_compression_level(png_ptr, options.compression_level);
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, options.filters);
+        png_write_info(png_ptr, info_ptr);
+    }
+    if (failed) {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        fclose(fp);
+        throw std::runtime_error(std::string("Could not start writing '") + file_name + "'");
+    }
+}
+
+PngRowWriter::~PngRowWriter()
+{
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    if (fp)
+        fclose(fp);
+}
+
+void PngRowWriter::write_rows(uint8 const *buf, int n)
+{
+    if (setjmp(png_jmpbuf(png_ptr)))
+        throw std::runtime_error("Error while writing .png rows");
+    for(int i=0; i<n; i++)
+        png_write_row(png_ptr, const_cast<png_bytep>(buf + size_t(i)*w));
+}
+
+void PngRowWriter::finish()
+{
+    if (setjmp(png_jmpbuf(png_ptr)))
+        throw std::runtime_error("Error while finishing .png file");
     png_write_end(png_ptr, NULL);
-    fclose(fp);
+    int closed = fclose(fp);
+    fp = nullptr;
+    if (closed != 0)
+        throw std::runtime_error("Error while closing .png file");
+}
+
+//
+// Parallel writing:  the image is split into bands of rows, and each band is filtered and deflated
+// on its own thread, into a piece of one zlib stream.  Each band (except the last) ends with
+// a sync flush, so the pieces can simply be concatenated, and starts with the previous 32K of
+// filtered data as its dictionary, so the compression is nearly as good as a single stream's.
+// The adler32 checksums of the bands are combined for the zlib trailer.
+//
+
+// The png filter types, i.e. the byte that starts each filtered row.
+enum { FILTER_NONE = 0, FILTER_SUB, FILTER_UP, FILTER_AVG, FILTER_PAETH };
+
+static inline int paeth_predictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return (pb <= pc) ? b : c;
+}
+
+// Filters one row with the given filter type into out (1 + w bytes, starting with the type).
+// prev is the (unfiltered) row above, or NULL for the first row.
+static void filter_row(uint8 const *row, uint8 const *prev, int w, int type, uint8 *out)
+{
+    *out++ = uint8(type);
+    switch (type) {
+    case FILTER_NONE:
+        memcpy(out, row, w);
+        break;
+    case FILTER_SUB:
+        out[0] = row[0];
+        for(int x=1; x<w; x++)
+            out[x] = uint8(row[x] - row[x-1]);
+        break;
+    case FILTER_UP:
+        if (!prev)
+            memcpy(out, row, w);
+        else
+            for(int x=0; x<w; x++)
+                out[x] = uint8(row[x] - prev[x]);
+        break;
+    case FILTER_AVG:
+        for(int x=0; x<w; x++) {
+            int left = x ? row[x-1] : 0;
+            int up = prev ? prev[x] : 0;
+            out[x] = uint8(row[x] - ((left + up) >> 1));
+        }
+        break;
+    case FILTER_PAETH:
+        for(int x=0; x<w; x++) {
+            int left = x ? row[x-1] : 0;
+            int up = prev ? prev[x] : 0;
+            int up_left = (x && prev) ? prev[x-1] : 0;
+            out[x] = uint8(row[x] - paeth_predictor(left, up, up_left));
+        }
+        break;
+    }
+}
+
+// Filters rows with the allowed filter types (PNG_FILTER_* flags).
+// If more than one type is allowed, each row gets the one with the smallest sum of
+// absolute (signed) values, which is libpng's heuristic.
+class RowFilter {
+public:
+    RowFilter(int width, int filters_) : w(width), filters(filters_), best(w+1), candidate(w+1) {}
+
+    // Returns the filtered row (1 + w bytes), which is valid until the next call.
+    uint8 const *filter(uint8 const *row, uint8 const *prev) {
+        size_t best_sum = SIZE_MAX;
+        for(int type=FILTER_NONE; type<=FILTER_PAETH; type++) {
+            if (!(filters & (PNG_FILTER_NONE << type)))
+                continue;
+            if (filters == (PNG_FILTER_NONE << type)) {
+                filter_row(row, prev, w, type, best.data());
+                break;
+            }
+            filter_row(row, prev, w, type, candidate.data());
+            size_t sum = 0;
+            for(int x=1; x<=w; x++)
+                sum += (candidate[x] < 128) ? candidate[x] : 256 - candidate[x];
+            if (sum < best_sum) {
+                best_sum = sum;
+                best.swap(candidate);
+            }
+        }
+        return best.data();
+    }
+
+private:
+    int w, filters;
+    std::vector<uint8> best, candidate;
+};
+
+struct DeflatedBand {
+    std::vector<uint8> data;  // the band's piece of the zlib stream (no header or trailer)
+    uLong adler = 1;          // adler32 of the band's filtered rows
+    size_t filtered_bytes = 0;
+};
+
+// Filters and deflates rows [y0, y1) of the raster.
+static void deflate_band(uint8 const *raster, int w, int y0, int y1, bool last,
+                         PngWriteOptions const & options, DeflatedBand & band)
+{
+    size_t row_bytes = size_t(w) + 1;
+    auto row = [&](int y) { return raster + size_t(y) * w; };
+    auto above = [&](int y) { return y ? row(y-1) : (uint8 const *)NULL; };
+    RowFilter filter(w, options.filters);
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int strategy = (options.filters == PNG_FILTER_NONE) ? Z_DEFAULT_STRATEGY : Z_FILTERED;  // as libpng does
+    if (deflateInit2(&zs, options.compression_level, Z_DEFLATED, -15, 8, strategy) != Z_OK)
+        throw std::runtime_error("Could not initialize zlib");
+    std::unique_ptr<z_stream, int(*)(z_stream *)> cleanup(&zs, deflateEnd);
+
+    // Start with the window that a single stream would have had here.
+    if (y0 > 0) {
+        const size_t window = 32768;
+        int k = std::min<int>(y0, int((window + row_bytes - 1) / row_bytes));
+        std::vector<uint8> dict;
+        dict.reserve(k * row_bytes);
+        for(int y=y0-k; y<y0; y++) {
+            uint8 const *f = filter.filter(row(y), above(y));
+            dict.insert(dict.end(), f, f + row_bytes);
+        }
+        size_t n = std::min(dict.size(), window);
+        deflateSetDictionary(&zs, dict.data() + dict.size() - n, uInt(n));
+    }
+
+    const size_t chunk = 1 << 16;
+    size_t used = 0;
+    band.adler = adler32(0, NULL, 0);
+    for(int y=y0; y<y1; y++) {
+        uint8 const *f = filter.filter(row(y), above(y));
+        band.adler = adler32(band.adler, f, uInt(row_bytes));
+        zs.next_in = const_cast<Bytef *>(f);
+        zs.avail_in = uInt(row_bytes);
+        int flush = (y < y1-1) ? Z_NO_FLUSH : (last ? Z_FINISH : Z_SYNC_FLUSH);
+        do {
+            if (band.data.size() - used < chunk)
+                band.data.resize(std::max(2 * band.data.size(), used + chunk));
+            zs.next_out = band.data.data() + used;
+            zs.avail_out = uInt(band.data.size() - used);
+            int ret = deflate(&zs, flush);
+            if (ret == Z_STREAM_ERROR)
+                throw std::runtime_error("zlib deflate failed");
+            used = band.data.size() - zs.avail_out;
+        } while (zs.avail_out == 0);
+    }
+    band.data.resize(used);
+    band.filtered_bytes = size_t(y1 - y0) * row_bytes;
+}
+
+static void put_u32(std::vector<uint8> & v, uLong x)
+{
+    uint8 b[4] = {uint8(x >> 24), uint8(x >> 16), uint8(x >> 8), uint8(x)};
+    v.insert(v.end(), b, b+4);
+}
+
+static void write_chunk(FILE *fp, const char *type, uint8 const *data, size_t n)
+{
+    std::vector<uint8> head;
+    put_u32(head, uLong(n));
+    head.insert(head.end(), type, type+4);
+    uLong crc = crc32(0, head.data() + 4, 4);
+    if (n)
+        crc = crc32(crc, data, uInt(n));  // (crc32() with no data would return the initial value)
+    std::vector<uint8> tail;
+    put_u32(tail, crc);
+    if (fwrite(head.data(), 1, head.size(), fp) != head.size()
+        || (n && fwrite(data, 1, n, fp) != n)
+        || fwrite(tail.data(), 1, tail.size(), fp) != tail.size())
+        throw std::runtime_error("Error while writing .png file");
+}
+
+static void write_8bit_png_parallel(const char *file_name, uint8 const *raster, int width, int height,
+                                    PngWriteOptions const & options, int bands)
+{
+    std::vector<DeflatedBand> deflated(bands);
+    dvidutils::parallel_for_slabs(bands, bands, [&](size_t b0, size_t b1) {
+        for(size_t b=b0; b<b1; b++) {
+            int y0 = int(size_t(height) * b / bands);
+            int y1 = int(size_t(height) * (b+1) / bands);
+            deflate_band(raster, width, y0, y1, b == size_t(bands-1), options, deflated[b]);
+        }
+    });
+
+    // zlib header (no preset dictionary), with the level hint that zlib itself would write
+    int level = (options.compression_level < 0) ? 6 : options.compression_level;
+    int flevel = (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+    uint8 cmf = 0x78;
+    uint8 flg = uint8(flevel << 6);
+    flg += uint8(31 - (cmf * 256 + flg) % 31);
+    deflated[0].data.insert(deflated[0].data.begin(), {cmf, flg});
+
+    uLong adler = deflated[0].adler;
+    for(int b=1; b<bands; b++)
+        adler = adler32_combine(adler, deflated[b].adler, z_off_t(deflated[b].filtered_bytes));
+    put_u32(deflated[bands-1].data, adler);
+
+    std::unique_ptr<FILE, int(*)(FILE *)> fp(fopen(file_name, "wb"), fclose);
+    if (!fp)
+        throw std::runtime_error(std::string("Open for write of 8-bit '") + file_name + "' failed");
+
+    static const uint8 signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    if (fwrite(signature, 1, 8, fp.get()) != 8)
+        throw std::runtime_error("Error while writing .png file");
+
+    std::vector<uint8> ihdr;
+    put_u32(ihdr, uLong(width));
+    put_u32(ihdr, uLong(height));
+    ihdr.insert(ihdr.end(), {8, PNG_COLOR_TYPE_GRAY, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE, PNG_INTERLACE_NONE});
+    write_chunk(fp.get(), "IHDR", ihdr.data(), ihdr.size());
+
+    const size_t max_idat = 1 << 24;
+    for(auto const & band : deflated) {
+        for(size_t i=0; i<band.data.size(); i+=max_idat)
+            write_chunk(fp.get(), "IDAT", band.data.data() + i, std::min(max_idat, band.data.size() - i));
+    }
+    write_chunk(fp.get(), "IEND", NULL, 0);
+
+    if (fclose(fp.release()) != 0)
+        throw std::runtime_error("Error while closing .png file");
+}
+
+void write_8bit_png(const char *file_name, uint8 const *raster, int width, int height,
+                    PngWriteOptions const & options)
+{
+    check_options(options);
+    if (width <= 0 || height <= 0)
+        throw std::runtime_error("Invalid png dimensions: " + std::to_string(width) + " x " + std::to_string(height));
+
+    int bands = dvidutils::resolve_num_threads(size_t(height), options.num_threads);
+    if (bands > 1) {
+        write_8bit_png_parallel(file_name, raster, width, height, options, bands);
+        return;
+    }
+    PngRowWriter writer(file_name, width, height, options);
+    writer.write_rows(raster, height);
+    writer.finish();
+}
+
+// Writes an in-memory raster as an 8 bit .png file
+bool write_8bit_png_file(const char *file_name, uint8 const *raster, int width, int height,
+                         PngWriteOptions const & options)
+{
+    try {
+        write_8bit_png(file_name, raster, width, height, options);
+        return true;
+    }
+    catch (std::exception const & e) {
+        printf("Write of 8-bit '%s' failed: %s\n", file_name, e.what());
+        return false;
+    }
 }
@@ -1,5 +1,98 @@
+#ifndef PNGUTILS_HPP
+#define PNGUTILS_HPP
+
+#include <cstddef>
+#include <cstdio>
+
+#include <png.h>
 
 typedef unsigned char uint8;
 
+// How png files are compressed.  (The defaults are libpng's.)
+// For intermediate products, a low level and PNG_FILTER_NONE (or PNG_FILTER_UP)
+// are much faster to write, at the cost of larger files.
+struct PngWriteOptions {
+    int compression_level = 6;        // zlib level: 0 (store only) to 9 (smallest)
+    int filters = PNG_ALL_FILTERS;    // PNG_FILTER_NONE, _SUB, _UP, _AVG, _PAETH, or several of them OR'ed together,
+                                      // in which case each row uses whichever seems to compress best.
+    int num_threads = 1;              // for write_8bit_png():  if > 1 (or <= 0, i.e. one per core),
+                                      // bands of rows are filtered and deflated in parallel.
+};
+
+// The PNG_FILTER_* flags for a filter name ("none", "sub", "up", "avg", "paeth", or "all"),
+// or a comma-separated list of them.  Returns 0 if any name is unknown.
+int png_filters_from_names(const char *names);
+
 uint8* read_8bit_png_file(const char *file_name, int &w, int &h);
-void write_8bit_png_file(const char* file_name, unsigned char *raster, int width, int  height);
+
+// Writes an in-memory raster as an 8 bit grayscale png file.
+// Errors are reported as std::runtime_error.
+void write_8bit_png(const char *file_name, uint8 const *raster, int width, int height,
+                    PngWriteOptions const & options=PngWriteOptions());
+
+// Same as above, but prints the error (and returns false) on failure.
+bool write_8bit_png_file(const char *file_name, uint8 const *raster, int width, int height,
+                         PngWriteOptions const & options=PngWriteOptions());
+
+// Reads a grayscale (non-interlaced) png file, a few rows at a time,
+// so the whole image never needs to be in memory.
+// Rows are decoded directly into the caller's buffer:  8 bit files
+// (and 1, 2, or 4 bit files, expanded to 8 bits) as uint8 pixels,
+// and 16 bit files as uint16 pixels in the machine's byte order.
+// Errors are reported as std::runtime_error.
+class PngRowReader {
+public:
+    explicit PngRowReader(const char *file_name);
+    ~PngRowReader();
+
+    int width() const {return w;}
+    int height() const {return h;}
+    int bit_depth() const {return depth;}  // of the decoded pixels:  8 or 16
+    size_t row_bytes() const {return size_t(w) * (depth / 8);}
+
+    // The row that the next read_rows() or skip_rows() starts at.
+    int next_row() const {return y;}
+
+    // Reads the next n rows into buf (n * row_bytes() bytes).
+    void read_rows(void *buf, int n);
+
+    // Decodes and discards the next n rows (e.g. to start reading in the middle of the image).
+    void skip_rows(int n);
+
+private:
+    PngRowReader(PngRowReader const &) = delete;
+    PngRowReader & operator=(PngRowReader const &) = delete;
+
+    FILE *fp = nullptr;
+    png_structp png_ptr = nullptr;
+    png_infop info_ptr = nullptr;
+    int w = 0, h = 0;
+    int depth = 8;
+    int y = 0;
+};
+
+// Writes an 8 bit grayscale png file, a few rows at a time (always on one thread;
+// options.num_threads is ignored).
+// Errors are reported as std::runtime_error.
+class PngRowWriter {
+public:
+    PngRowWriter(const char *file_name, int width, int height, PngWriteOptions const & options=PngWriteOptions());
+    ~PngRowWriter();
+
+    // Writes the next n rows from buf (n * width bytes).
+    void write_rows(uint8 const *buf, int n);
+
+    // Completes the file, after all rows have been written.
+    void finish();
+
+private:
+    PngRowWriter(PngRowWriter const &) = delete;
+    PngRowWriter & operator=(PngRowWriter const &) = delete;
+
+    FILE *fp = nullptr;
+    png_structp png_ptr = nullptr;
+    png_infop info_ptr = nullptr;
+    int w = 0;
+};
+
+#endif // PNGUTILS_HPP
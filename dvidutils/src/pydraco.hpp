@@ -70,6 +70,57 @@ struct Quantizer {
   std::array<double, 3> fragment_shape_double; 
 };
 
+// Moves each vertex to the point that encode_faces_to_custom_drc_bytes() will
+// quantize it to, i.e. fragment_origin + q * fragment_shape / (2**bits - 1).
+//
+// Quantizing the result gives the same values as quantizing the input, so this
+// doesn't change the encoded mesh, but vertices which will be encoded as the
+// same point become identical (and can be welded without moving anything).
+// Adjacent fragments' grids coincide on their shared face, so a vertex on that
+// face is snapped to the same point in both fragments.
+vertices_array_t snap_vertices_to_quantization_grid( vertices_array_t const & vertices,
+                                                     coords_t const & fragment_shape,
+                                                     coords_t const & fragment_origin,
+                                                     int position_quantization_bits )
+{
+    if (vertices.shape()[1] != 3)
+    {
+        throw std::runtime_error("vertices must be an array of shape (N,3)");
+    }
+    if (fragment_shape.size() != 3 || fragment_origin.size() != 3)
+    {
+        throw std::runtime_error("fragment_shape and fragment_origin must have 3 elements");
+    }
+    if (xt::amin(fragment_shape)() <= 0)
+    {
+        throw std::runtime_error("fragment_shape must be positive");
+    }
+    if (position_quantization_bits < 1 || position_quantization_bits > 32)
+    {
+        throw std::runtime_error("position_quantization_bits must be between 1 and 32");
+    }
+
+    Quantizer quantizer(fragment_shape, fragment_origin, position_quantization_bits);
+
+    size_t const vertex_count = vertices.shape()[0];
+    vertices_array_t::shape_type shape = {{vertex_count, 3}};
+    vertices_array_t snapped(shape);
+    {
+        py::gil_scoped_release nogil;
+        for (size_t vi = 0; vi < vertex_count; ++vi)
+        {
+            std::array<float, 3> v{{ vertices(vi, 0), vertices(vi, 1), vertices(vi, 2) }};
+            std::array<uint32_t, 3> q = quantizer(v);
+            for (int i = 0; i < 3; ++i)
+            {
+                snapped(vi, i) = static_cast<float>(quantizer.offset[i] +
+                                                    q[i] * quantizer.fragment_shape_double[i] / quantizer.upper_bound[i]);
+            }
+        }
+    }
+    return snapped;
+}
+
 // Defaults from the draco_encoder command-line tool.
 int DEFAULT_COMPRESSION_LEVEL = 7;
 int DEFAULT_POSITION_QUANTIZATION_BITS = 14;
@@ -1,10 +1,14 @@
 #ifndef DVIDUTILS_REMAP_DUPLICATES_HPP
 #define DVIDUTILS_REMAP_DUPLICATES_HPP
 
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
-#include <unordered_map>
-
-#include <boost/functional/hash.hpp>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
 
 #include "xtensor/xtensor.hpp"
 #include "xtensor/xview.hpp"
@@ -17,6 +21,241 @@ using std::uint32_t;
 
 namespace dvidutils
 {
+    // A vertex, packed into a 12-byte key: the bit patterns of its three coordinates.
+    // (-0.0 is stored as 0.0, so the two compare equal, as they do for floats.)
+    struct packed_vertex
+    {
+        uint32_t bits[3];
+
+        bool operator==(packed_vertex const & other) const
+        {
+            return bits[0] == other.bits[0] && bits[1] == other.bits[1] && bits[2] == other.bits[2];
+        }
+    };
+    static_assert(sizeof(packed_vertex) == 3 * sizeof(float), "packed_vertex must be exactly three floats");
+
+    inline packed_vertex pack_vertex(float x, float y, float z)
+    {
+        float coords[3] = {x + 0.0f, y + 0.0f, z + 0.0f};
+        packed_vertex v;
+        std::memcpy(v.bits, coords, sizeof(v.bits));
+        return v;
+    }
+
+    inline uint64_t hash_packed_vertex(packed_vertex const & v)
+    {
+        uint64_t h = (uint64_t(v.bits[0]) | (uint64_t(v.bits[1]) << 32)) * 0x9E3779B97F4A7C15ull;
+        h ^= uint64_t(v.bits[2]) * 0xC2B2AE3D27D4EB4Full;
+        return h ^ (h >> 29);
+    }
+
+    // Identifies the unique vertices in an (N,3) array, in order of first appearance.
+    //
+    // Returns the unique vertices (packed), and fills old_to_new (the index of
+    // each vertex's unique copy) and first_indexes (for each unique vertex,
+    // the index where it first appears).
+    //
+    // The vertices are deduplicated with an open-addressing hash table of
+    // unique vertex indexes (linear probing), which is sized up front.
+    template <typename vertices_array_t>
+    std::vector<packed_vertex> find_unique_vertices( vertices_array_t const & vertices,
+                                                     std::vector<uint32_t> & old_to_new,
+                                                     std::vector<uint32_t> & first_indexes )
+    {
+        size_t const n = vertices.shape()[0];
+        if (vertices.shape().size() != 2 || vertices.shape()[1] != 3)
+        {
+            throw std::runtime_error("vertices must be an array of shape (N,3)");
+        }
+        if (n >= std::numeric_limits<uint32_t>::max())
+        {
+            throw std::runtime_error("Too many vertices (indexes must fit in uint32)");
+        }
+
+        auto const * data = vertices.data();
+        std::ptrdiff_t const s0 = vertices.strides()[0];
+        std::ptrdiff_t const s1 = vertices.strides()[1];
+
+        size_t capacity = 16;
+        int shift = 60;
+        while (capacity < 2 * n)
+        {
+            capacity *= 2;
+            --shift;
+        }
+        uint32_t const EMPTY = std::numeric_limits<uint32_t>::max();
+        std::vector<uint32_t> slots(capacity, EMPTY);
+        size_t const mask = capacity - 1;
+
+        std::vector<packed_vertex> unique;
+        old_to_new.resize(n);
+        first_indexes.clear();
+        for (size_t i = 0; i < n; ++i)
+        {
+            auto const * row = data + i * s0;
+            packed_vertex v = pack_vertex(row[0], row[s1], row[2*s1]);
+
+            size_t slot = size_t(hash_packed_vertex(v) >> shift);
+            while (slots[slot] != EMPTY && !(unique[slots[slot]] == v))
+            {
+                slot = (slot + 1) & mask;
+            }
+            if (slots[slot] == EMPTY)
+            {
+                slots[slot] = unique.size();
+                unique.push_back(v);
+                first_indexes.push_back(i);
+            }
+            old_to_new[i] = slots[slot];
+        }
+        return unique;
+    }
+
+    inline void prefetch(void const * p)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(p);
+#else
+        (void)p;
+#endif
+    }
+
+    // Like find_unique_vertices(), but vertices within 'tolerance' of each other
+    // (in every coordinate) are merged, too.
+    //
+    // Each vertex is merged into the closest earlier unique vertex (its 'representative')
+    // within tolerance, if there is one, and otherwise becomes a unique vertex itself.
+    // Merged vertices take the (original) position of their representative.
+    //
+    // To find candidates quickly, space is divided into a grid of cubic cells, 2*tolerance wide,
+    // and unique vertices are hashed by their cell (several may share a cell).
+    // Anything within tolerance of a vertex lies in the 2x2x2 block of cells nearest to it,
+    // so only those 8 cells need to be searched.
+    template <typename vertices_array_t>
+    std::vector<packed_vertex> find_unique_vertices_within( vertices_array_t const & vertices, float tolerance,
+                                                            std::vector<uint32_t> & old_to_new,
+                                                            std::vector<uint32_t> & first_indexes )
+    {
+        size_t const n = vertices.shape()[0];
+        if (vertices.shape().size() != 2 || vertices.shape()[1] != 3)
+        {
+            throw std::runtime_error("vertices must be an array of shape (N,3)");
+        }
+        if (n >= std::numeric_limits<uint32_t>::max())
+        {
+            throw std::runtime_error("Too many vertices (indexes must fit in uint32)");
+        }
+        if (!(tolerance > 0.0f))
+        {
+            throw std::runtime_error("Welding tolerance must be positive");
+        }
+
+        auto const * data = vertices.data();
+        std::ptrdiff_t const s0 = vertices.strides()[0];
+        std::ptrdiff_t const s1 = vertices.strides()[1];
+        double const cell_width = 2.0 * tolerance;
+
+        size_t capacity = 16;
+        int shift = 60;
+        while (capacity < 2 * n)
+        {
+            capacity *= 2;
+            --shift;
+        }
+        uint32_t const EMPTY = std::numeric_limits<uint32_t>::max();
+        std::vector<uint32_t> slots(capacity, EMPTY);
+        size_t const mask = capacity - 1;
+
+        std::vector<packed_vertex> unique;
+        std::vector<packed_vertex> unique_cells;
+
+        old_to_new.resize(n);
+        first_indexes.clear();
+        for (size_t i = 0; i < n; ++i)
+        {
+            auto const * row = data + i * s0;
+            float coords[3] = {row[0], row[s1], row[2*s1]};
+
+            // The vertex's cell, and (per axis) which neighbor is nearer: -1 or +1
+            packed_vertex cell;
+            int nearer[3];
+            for (int d = 0; d < 3; ++d)
+            {
+                double c = double(coords[d]) / cell_width;
+                double f = std::floor(c);
+                if (!(std::abs(f) < double(std::numeric_limits<int32_t>::max() - 1)))
+                {
+                    std::ostringstream ss;
+                    ss << "Vertex coordinate " << coords[d] << " is too large (or invalid) for welding tolerance " << tolerance;
+                    throw std::runtime_error(ss.str());
+                }
+                cell.bits[d] = uint32_t(int32_t(f));
+                nearer[d] = (c - f < 0.5) ? -1 : 1;
+            }
+
+            // Find the closest unique vertex in the 8 nearest cells.
+            // (The cells' slots are computed up front, so their cache misses overlap.)
+            packed_vertex neighbors[8];
+            size_t home_slots[8];
+            for (int corner = 0; corner < 8; ++corner)
+            {
+                neighbors[corner] = cell;
+                for (int d = 0; d < 3; ++d)
+                {
+                    neighbors[corner].bits[d] += uint32_t(((corner >> d) & 1) * nearer[d]);
+                }
+                home_slots[corner] = size_t(hash_packed_vertex(neighbors[corner]) >> shift);
+                prefetch(&slots[home_slots[corner]]);
+            }
+
+            uint32_t best = EMPTY;
+            float best_distance = tolerance;
+            for (int corner = 0; corner < 8; ++corner)
+            {
+                packed_vertex const & neighbor = neighbors[corner];
+                for (size_t slot = home_slots[corner]; slots[slot] != EMPTY; slot = (slot + 1) & mask)
+                {
+                    uint32_t candidate = slots[slot];
+                    if (!(unique_cells[candidate] == neighbor))
+                    {
+                        continue;
+                    }
+
+                    float rep_coords[3];
+                    std::memcpy(rep_coords, unique[candidate].bits, sizeof(rep_coords));
+                    float distance = 0.0f;
+                    for (int d = 0; d < 3; ++d)
+                    {
+                        distance = std::max(distance, std::abs(rep_coords[d] - coords[d]));
+                    }
+                    if (distance < best_distance || (distance == best_distance && candidate < best))
+                    {
+                        best = candidate;
+                        best_distance = distance;
+                    }
+                }
+            }
+
+            if (best != EMPTY)
+            {
+                old_to_new[i] = best;
+                continue;
+            }
+
+            size_t slot = size_t(hash_packed_vertex(cell) >> shift);
+            while (slots[slot] != EMPTY)
+            {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = unique.size();
+            old_to_new[i] = unique.size();
+            unique.push_back(pack_vertex(coords[0], coords[1], coords[2]));
+            unique_cells.push_back(cell);
+            first_indexes.push_back(i);
+        }
+        return unique;
+    }
+
     // The goal of this function is to tell you how to remove duplicate
     // rows from a list of vertices.  For each duplicate vertex we find,
     // it tells you which row (earlier in the list) it is a duplicate of.
@@ -24,7 +263,7 @@ namespace dvidutils
     // you can use this mapping to relabel those references so that the
     // 'duplicates' are no longer needed.  At that point, you could drop the
     // duplicate vertices from your list (as long as you renumber the face
-    // references accordingly).
+    // references accordingly).  (Or just use weld_vertices(), below.)
     //
     // Given an array of vertices (N,3), find those vertices which are
     // duplicates and return an index mapping that points only to the
@@ -44,48 +283,19 @@ namespace dvidutils
     template <typename vertices_array_t, typename index_map_array_t>
     index_map_array_t remap_duplicates(vertices_array_t const & vertices)
     {
-        // We would like to build a map of vertex -> first index where it appears,
-        // but that would require copying nearly all vertices, which is RAM-expensive.
-        // Instead, we use a map of index -> first equivalent index,
-        // via a custom hash function, saving on the RAM overhead of storing
-        // vertices as keys (we just store the indexes instead).
-        auto hasher = [&](uint32_t index) {
-            size_t hash = 0;
-            boost::hash_combine(hash, vertices(index, 0));
-            boost::hash_combine(hash, vertices(index, 1));
-            boost::hash_combine(hash, vertices(index, 2));
-            return hash;
-            
-        };
-
-        // Vertex index comparison.
-        // Two indexes are considered equal if they point to equivalent vertices.
-        auto comparer = [&](uint32_t const & left, uint32_t const & right) -> bool {
-            return xt::view(vertices, left) == xt::view(vertices, right);
-        };
-
-        typedef std::unordered_map<uint32_t, uint32_t,
-                                  decltype(hasher),
-                                  decltype(comparer)> index_map_t;
-
-        // Maps from an arbitrary vertex index to the index in which
-        // that vertex first appears in the array, as described above.
-        index_map_t to_first_mapper(10, hasher, comparer );
-
-        
-        // Simultaneously build the map and record the non-identity mappings.
+        std::vector<uint32_t> old_to_new;
+        std::vector<uint32_t> first_indexes;
+        find_unique_vertices(vertices, old_to_new, first_indexes);
+
+        // Record the non-identity mappings.
         std::vector<uint32_t> changes;
-        for (size_t i = 0; i < vertices.shape()[0]; ++i)
+        for (size_t i = 0; i < old_to_new.size(); ++i)
         {
-            auto iter = to_first_mapper.find(i);
-            if (iter == to_first_mapper.end())
-            {
-                to_first_mapper[i] = i;
-            }
-            else
+            uint32_t first = first_indexes[old_to_new[i]];
+            if (first != i)
             {
                 changes.push_back(i);
-                changes.push_back(iter->second);
+                changes.push_back(first);
             }
         }
 
@@ -94,6 +304,73 @@ namespace dvidutils
         index_map_array_t results = xt::adapt(changes, shape);
         return results;
     }
+
+    // A mesh whose duplicate vertices have been merged.
+    struct welded_mesh
+    {
+        std::vector<float> vertices;     // (U,3), flattened
+        std::vector<uint32_t> faces;     // (M,3), flattened
+        std::vector<uint32_t> old_to_new;  // (N,)
+    };
+
+    // Merges duplicate vertices of a mesh: either bitwise-identical vertices (if tolerance is 0),
+    // or vertices within tolerance of each other (see find_unique_vertices_within()).
+    //
+    // Returns the unique vertices (in order of first appearance),
+    // the faces renumbered to refer to them, and the mapping
+    // from each original vertex index to its new index.
+    //
+    // When welding with a tolerance, faces which become degenerate
+    // (i.e. two or more of their corners were merged) are dropped.
+    template <typename vertices_array_t, typename faces_array_t>
+    welded_mesh weld_vertices(vertices_array_t const & vertices, faces_array_t const & faces, float tolerance=0.0f)
+    {
+        welded_mesh result;
+        std::vector<uint32_t> first_indexes;
+        std::vector<packed_vertex> unique;
+        if (tolerance == 0.0f)
+        {
+            unique = find_unique_vertices(vertices, result.old_to_new, first_indexes);
+        }
+        else
+        {
+            unique = find_unique_vertices_within(vertices, tolerance, result.old_to_new, first_indexes);
+        }
+
+        result.vertices.resize(3 * unique.size());
+        std::memcpy(result.vertices.data(), unique.data(), unique.size() * sizeof(packed_vertex));
+
+        if (faces.shape().size() != 2 || faces.shape()[1] != 3)
+        {
+            throw std::runtime_error("faces must be an array of shape (M,3)");
+        }
+        size_t const num_faces = faces.shape()[0];
+        size_t const num_vertices = result.old_to_new.size();
+        result.faces.reserve(3 * num_faces);
+        for (size_t f = 0; f < num_faces; ++f)
+        {
+            uint32_t corners[3];
+            for (size_t k = 0; k < 3; ++k)
+            {
+                auto v = faces(f, k);
+                if (size_t(v) >= num_vertices)
+                {
+                    std::ostringstream ss;
+                    ss << "Face " << f << " refers to a nonexistent vertex: " << v;
+                    throw std::runtime_error(ss.str());
+                }
+                corners[k] = result.old_to_new[v];
+            }
+
+            bool degenerate = (corners[0] == corners[1] || corners[1] == corners[2] || corners[0] == corners[2]);
+            if (tolerance != 0.0f && degenerate)
+            {
+                continue;
+            }
+            result.faces.insert(result.faces.end(), corners, corners + 3);
+        }
+        return result;
+    }
 }
 
 #endif
@@ -0,0 +1,104 @@
+import pytest
+import numpy as np
+from dvidutils import destripe
+
+import faulthandler
+faulthandler.enable()
+
+
+def striped_image(shape, seed=0):
+    """
+    Random 'tissue' pixels, with a different brightness offset for every column.
+    """
+    rng = np.random.RandomState(seed)
+    image = rng.normal(150, 30, size=shape)
+    image += rng.randint(-20, 20, size=shape[1])[None, :]
+    return np.clip(image, 0, 255).astype(np.uint8)
+
+
+def test_destripe_column_means():
+    seams = [-1, 300, 600]
+    image = striped_image((2000, 600))
+    corrected = destripe(image.copy(), seams)
+    assert corrected.shape == image.shape
+    assert corrected.dtype == np.uint8
+
+    # Within each slab (excluding the seam column itself),
+    # the column means are normalized to the slab mean.
+    for xmin, xmax in [(0, 300), (301, 600)]:
+        means = corrected[:, xmin:xmax].mean(axis=0)
+        assert means.std() < 1.0
+        assert image[:, xmin:xmax].mean(axis=0).std() > 5.0
+
+
+def test_destripe_threads_and_report():
+    seams = [-1, 200, 450, 700]
+    image = striped_image((2500, 700), seed=1)
+    expected = destripe(image.copy(), seams)
+
+    for num_threads in (2, 3, 0):
+        corrected, report = destripe(image.copy(), seams, num_threads=num_threads, return_report=True)
+        assert (corrected == expected).all()
+
+        assert report['total_seconds'] >= report['correction_seconds'] >= 0
+        assert len(report['slab_means']) == len(seams) - 1
+        assert report['measurements'] == (len(seams) - 2) * (2500 // 1000)
+        assert report['unmatched_columns'] == [200, 450]
+
+
+def test_destripe_out():
+    seams = [-1, 300, 600]
+    image = striped_image((2000, 600), seed=2)
+    original = image.copy()
+
+    expected = destripe(image, seams)
+    assert (image == original).all(), "input should not be modified"
+
+    out = np.zeros_like(image)
+    result = destripe(image, seams, out=out)
+    assert result is out
+    assert (out == expected).all()
+
+    # In-place
+    result = destripe(image, seams, out=image)
+    assert result is image
+    assert (image == expected).all()
+
+
+def test_destripe_bad_out():
+    seams = [-1, 300, 600]
+    image = striped_image((2000, 600))
+    for out in [np.zeros((2000, 600), np.uint16),
+                np.zeros((2000, 601), np.uint8),
+                np.zeros((600, 2000), np.uint8).transpose()]:
+        with pytest.raises(RuntimeError):
+            destripe(image, seams, out=out)
+
+
+def test_destripe_overlapping_out():
+    seams = [-1, 300, 600]
+    buffer = np.zeros((2001, 600), np.uint8)
+    buffer[:2000] = striped_image((2000, 600))
+    image = buffer[:2000]
+
+    # out may be the image itself, but not an overlapping view at a different offset.
+    with pytest.raises(RuntimeError):
+        destripe(image, seams, out=buffer[1:])
+
+    expected = destripe(image.copy(), seams)
+    assert destripe(image, seams, out=image) is image
+    assert (image == expected).all()
+
+
+def test_destripe_bad_seams():
+    image = np.zeros((1000, 100), np.uint8)
+    with pytest.raises(RuntimeError):
+        destripe(image, [0, 50, 100])
+
+    # Not increasing
+    with pytest.raises(RuntimeError):
+        destripe(image, [-1, 60, 50, 100])
+
+
+if __name__ == "__main__":
+    pytest.main()
@@ -2,7 +2,7 @@ import sys
 from itertools import product
 import pytest
 import numpy as np
-from dvidutils import downsample_labels
+from dvidutils import LabelMapper, downsample_labels, downsample_labels_pyramid, downsample_labels_chunked, downsample_labels_mapped
 
 import faulthandler
 faulthandler.enable()
@@ -108,6 +108,183 @@ def test_downsample_with_ties_3d():
     assert (d == [[[2, 3, 1, 3]]]).all()
 
 
+def downsample_labels_reference(a, factor, suppress_zero=False):
+    """
+    Slow but obviously-correct numpy implementation, for comparison.
+    """
+    blocks_shape = sum(((s // factor, factor) for s in a.shape), ())
+    blocks = a.reshape(blocks_shape)
+    blocks = blocks.transpose(*range(0, 2*a.ndim, 2), *range(1, 2*a.ndim, 2))
+    blocks = blocks.reshape(*blocks.shape[:a.ndim], -1)
+
+    result = np.zeros(blocks.shape[:a.ndim], a.dtype)
+    for index in np.ndindex(*result.shape):
+        labels, counts = np.unique(blocks[index], return_counts=True)
+        if suppress_zero and labels[0] == 0 and len(labels) > 1:
+            labels, counts = labels[1:], counts[1:]
+        result[index] = labels[np.argmax(counts)] # argmax picks the first (lowest) tied label
+    return result
+
+
+@pytest.mark.parametrize("factor", [2, 4])
+@pytest.mark.parametrize("ndim", [2, 3])
+@pytest.mark.parametrize("suppress_zero", [False, True])
+def test_downsample_small_factors(factor, ndim, suppress_zero):
+    a = np.random.randint(0, 5, size=(16,)*ndim, dtype=np.uint32)
+    d = downsample_labels(a, factor, suppress_zero=suppress_zero)
+    assert (d == downsample_labels_reference(a, factor, suppress_zero)).all()
+
+    # Non-contiguous rows (last axis strided) use the generic path
+    b = np.random.randint(0, 5, size=(16,)*(ndim-1) + (32,), dtype=np.uint32)[..., ::2]
+    d = downsample_labels(b, factor, suppress_zero=suppress_zero)
+    assert (d == downsample_labels_reference(b, factor, suppress_zero)).all()
+
+
+@pytest.mark.parametrize("factor", [3, 5])
+@pytest.mark.parametrize("ndim", [2, 3])
+@pytest.mark.parametrize("suppress_zero", [False, True])
+def test_downsample_generic_factors(factor, ndim, suppress_zero):
+    a = np.random.randint(0, 5, size=(30,)*ndim, dtype=np.uint64)
+    d = downsample_labels(a, factor, suppress_zero=suppress_zero)
+    assert (d == downsample_labels_reference(a, factor, suppress_zero)).all()
+
+    # Strided outer axes (rows still contiguous)
+    b = np.random.randint(0, 5, size=(60,)*(ndim-1) + (30,), dtype=np.uint64)[::2]
+    d = downsample_labels(b, factor, suppress_zero=suppress_zero)
+    assert (d == downsample_labels_reference(b, factor, suppress_zero)).all()
+
+
+@pytest.mark.parametrize("shape", [(64,64,64), (30,64,62), (256,256)])
+@pytest.mark.parametrize("suppress_zero", [False, True])
+def test_downsample_num_threads(shape, suppress_zero):
+    # Few distinct labels, so ties are common
+    a = np.random.randint(0, 4, size=shape, dtype=np.uint64)
+    serial = downsample_labels(a, 2, suppress_zero=suppress_zero)
+    for num_threads in (2, 3, 0):
+        threaded = downsample_labels(a, 2, suppress_zero=suppress_zero, num_threads=num_threads)
+        assert (threaded == serial).all()
+
+
+@pytest.mark.parametrize("shape", [(64,64,64), (32,16,48), (256,128)])
+@pytest.mark.parametrize("suppress_zero", [False, True])
+def test_downsample_labels_pyramid(shape, suppress_zero):
+    a = np.random.randint(0, 4, size=shape, dtype=np.uint32)
+    pyramid = downsample_labels_pyramid(a, 4, suppress_zero=suppress_zero)
+    assert len(pyramid) == 4
+
+    # Must match repeated downsampling by 2 (including tie-breaking)
+    expected = a
+    for level in pyramid:
+        expected = downsample_labels(expected, 2, suppress_zero=suppress_zero)
+        assert level.dtype == a.dtype
+        assert level.shape == expected.shape
+        assert (level == expected).all()
+
+    threaded = downsample_labels_pyramid(a, 4, suppress_zero=suppress_zero, num_threads=3)
+    for level, expected in zip(threaded, pyramid):
+        assert (level == expected).all()
+
+
+def test_downsample_labels_pyramid_bad_shape():
+    a = np.zeros((24,16,16), np.uint64)
+    with pytest.raises(RuntimeError):
+        downsample_labels_pyramid(a, 4)
+    with pytest.raises(RuntimeError):
+        downsample_labels_pyramid(a, 0)
+
+    # 2**levels doesn't fit in 64 bits (and must not wrap around to a divisor)
+    a = np.zeros((16,16,16), np.uint64)
+    for levels in [5, 63, 64, 65, 1000]:
+        with pytest.raises(RuntimeError):
+            downsample_labels_pyramid(a, levels)
+
+
+@pytest.mark.parametrize("shape", [(64,32,48), (96,80)])
+@pytest.mark.parametrize("factor", [2, 3, 4])
+def test_downsample_labels_chunked(tmp_path, shape, factor):
+    shape = tuple(s - (s % factor) for s in shape)
+    out_shape = tuple(s // factor for s in shape)
+
+    a = np.random.randint(0, 4, size=shape, dtype=np.uint64)
+    expected = downsample_labels(a, factor, suppress_zero=True)
+
+    src = np.memmap(tmp_path / 'labels.raw', np.uint64, 'w+', shape=shape)
+    src[:] = a
+    src.flush()
+    src = np.memmap(tmp_path / 'labels.raw', np.uint64, 'r', shape=shape)
+    out = np.memmap(tmp_path / 'out.raw', np.uint64, 'w+', shape=out_shape)
+
+    # Small slabs, so there are several of them (including a partial one).
+    downsample_labels_chunked(src, factor, out, suppress_zero=True, slab_depth=3, num_threads=2)
+    assert (out == expected).all()
+
+    # Chunk reader callback
+    calls = []
+    def reader(start, stop):
+        calls.append((start, stop))
+        return a[start:stop]
+
+    out = np.zeros(out_shape, np.uint64)
+    downsample_labels_chunked(reader, factor, out, suppress_zero=True, slab_depth=3)
+    assert (out == expected).all()
+    assert calls[0] == (0, 3*factor)
+    assert calls[-1][1] == shape[0]
+
+
+def test_downsample_labels_chunked_errors():
+    a = np.zeros((16,16,16), np.uint32)
+    with pytest.raises(RuntimeError):
+        downsample_labels_chunked(a, 2, np.zeros((8,8,4), np.uint32))
+
+    # The output can't be converted, since the results would be lost.
+    with pytest.raises(TypeError):
+        downsample_labels_chunked(a, 2, np.zeros((8,8,8), np.uint64))
+
+    def bad_reader(start, stop):
+        return a[start:stop, :8]
+    with pytest.raises(RuntimeError):
+        downsample_labels_chunked(bad_reader, 2, np.zeros((8,8,8), np.uint32))
+
+
+@pytest.mark.parametrize("shape", [(24,24,24), (36,48)])
+@pytest.mark.parametrize("factor", [2, 3, 4])
+@pytest.mark.parametrize("suppress_zero", [False, True])
+def test_downsample_labels_mapped(shape, factor, suppress_zero):
+    shape = tuple(s - (s % factor) for s in shape)
+    a = np.random.randint(0, 10, size=shape, dtype=np.uint64)
+
+    # Several labels map to the same value (including 0),
+    # so the mode of the mapped labels differs from the mapped mode.
+    domain = np.arange(10, dtype=np.uint64)
+    codomain = (domain % 4).astype(np.uint32)
+    mapper = LabelMapper(domain, codomain)
+
+    expected = downsample_labels(mapper.apply(a), factor, suppress_zero=suppress_zero)
+    for num_threads in (1, 3):
+        d = downsample_labels_mapped(a, mapper, factor, suppress_zero=suppress_zero, num_threads=num_threads)
+        assert d.dtype == np.uint32
+        assert (d == expected).all()
+
+    # Non-contiguous rows
+    b = a[..., ::2][..., :shape[-1] // (2*factor) * factor]
+    expected = downsample_labels(mapper.apply(b), factor, suppress_zero=suppress_zero)
+    d = downsample_labels_mapped(b, mapper, factor, suppress_zero=suppress_zero)
+    assert (d == expected).all()
+
+
+def test_downsample_labels_mapped_unmapped():
+    a = np.random.randint(0, 10, size=(16,16,16), dtype=np.uint64)
+    a[5,5,5] = 127
+    mapper = LabelMapper(np.arange(10, dtype=np.uint64), np.arange(100, 110, dtype=np.uint64))
+
+    with pytest.raises(RuntimeError):
+        downsample_labels_mapped(a, mapper, 2)
+
+    expected = downsample_labels(mapper.apply(a, allow_unmapped=True), 2)
+    d = downsample_labels_mapped(a, mapper, 2, allow_unmapped=True)
+    assert (d == expected).all()
+
+
 def test_zero_size_array():
     a = np.zeros((20,0), np.uint64)
     with pytest.raises(RuntimeError):
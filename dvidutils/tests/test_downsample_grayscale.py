@@ -0,0 +1,74 @@
+import pytest
+import numpy as np
+from dvidutils import downsample_grayscale
+
+import faulthandler
+faulthandler.enable()
+
+
+def downsample_grayscale_reference(a, factor, method):
+    """
+    Simple numpy implementation, for comparison.
+    """
+    if a.ndim == 2:
+        blocks = a.reshape(a.shape[0]//factor, factor, a.shape[1]//factor, factor).transpose(0,2,1,3)
+    else:
+        blocks = a.reshape(a.shape[0]//factor, factor,
+                           a.shape[1]//factor, factor,
+                           a.shape[2]//factor, factor).transpose(0,2,4,1,3,5)
+    blocks = blocks.reshape(*blocks.shape[:a.ndim], -1)
+
+    if method == 'min':
+        return blocks.min(axis=-1)
+    if method == 'max':
+        return blocks.max(axis=-1)
+    if np.issubdtype(a.dtype, np.integer):
+        n = factor**a.ndim
+        return ((blocks.sum(axis=-1, dtype=np.uint64) + n//2) // n).astype(a.dtype)
+    return blocks.mean(axis=-1, dtype=np.float64).astype(a.dtype)
+
+
+def random_image(shape, dtype):
+    if dtype == np.float32:
+        return (np.random.random(shape) * 1000).astype(np.float32)
+    return np.random.randint(0, np.iinfo(dtype).max+1, size=shape).astype(dtype)
+
+
+@pytest.mark.parametrize("dtype", [np.uint8, np.uint16, np.float32])
+@pytest.mark.parametrize("method", ["mean", "min", "max"])
+@pytest.mark.parametrize("factor", [2, 3, 4])
+@pytest.mark.parametrize("shape", [(24,36,84), (60,132)])
+def test_downsample_grayscale(dtype, method, factor, shape):
+    shape = tuple(s - (s % factor) for s in shape)
+    a = random_image(shape, dtype)
+    expected = downsample_grayscale_reference(a, factor, method)
+
+    for num_threads in (1, 3):
+        d = downsample_grayscale(a, factor, method, num_threads=num_threads)
+        assert d.dtype == dtype
+        assert d.shape == expected.shape
+        if dtype == np.float32:
+            assert np.allclose(d, expected, rtol=1e-5)
+        else:
+            assert (d == expected).all()
+
+
+@pytest.mark.parametrize("dtype", [np.uint8, np.float32])
+def test_downsample_grayscale_noncontiguous(dtype):
+    a = random_image((32,32,64), dtype)[..., ::2]
+    for method in ("mean", "min", "max"):
+        d = downsample_grayscale(a, 2, method)
+        contiguous = downsample_grayscale(a.copy(), 2, method)
+        assert (d == contiguous).all()
+
+
+def test_downsample_grayscale_errors():
+    a = np.zeros((10,10), np.uint8)
+    with pytest.raises(RuntimeError):
+        downsample_grayscale(a, 3)
+    with pytest.raises(RuntimeError):
+        downsample_grayscale(a, 2, "median")
+
+
+if __name__ == "__main__":
+    pytest.main()
@@ -0,0 +1,56 @@
+import pytest
+import numpy as np
+from dvidutils import label_stats
+
+import faulthandler
+faulthandler.enable()
+
+
+def label_stats_reference(labels):
+    """
+    Simple numpy implementation, for comparison.
+    """
+    ids, counts = np.unique(labels, return_counts=True)
+    min_corners = []
+    max_corners = []
+    for label in ids:
+        coords = np.array(np.where(labels == label))
+        min_corners.append(coords.min(axis=1))
+        max_corners.append(coords.max(axis=1))
+    return ids, counts, np.array(min_corners), np.array(max_corners)
+
+
+@pytest.mark.parametrize("dtype", [np.uint8, np.uint16, np.uint32, np.uint64])
+@pytest.mark.parametrize("shape", [(20,30,40), (50,70)])
+def test_label_stats(dtype, shape):
+    labels = np.random.randint(0, 20, size=shape).astype(dtype)
+    # Add some long runs, and a label which touches only one corner
+    labels[..., 5:25] = 3
+    labels[(-1,)*len(shape)] = 100
+
+    expected = label_stats_reference(labels)
+    for num_threads in (1, 3, 0):
+        ids, counts, min_corners, max_corners = label_stats(labels, num_threads=num_threads)
+        assert ids.dtype == dtype
+        assert (ids == expected[0]).all()
+        assert (counts == expected[1]).all()
+        assert (min_corners == expected[2]).all()
+        assert (max_corners == expected[3]).all()
+
+
+def test_label_stats_noncontiguous():
+    labels = np.random.randint(0, 1000, size=(16,32,64)).astype(np.uint64)
+    view = labels[::2, :, ::3]
+    expected = label_stats_reference(view)
+    result = label_stats(view, num_threads=2)
+    for a, b in zip(result, expected):
+        assert (a == b).all()
+
+
+def test_label_stats_bad_dimensions():
+    with pytest.raises(RuntimeError):
+        label_stats(np.zeros((10,), np.uint64))
+
+
+if __name__ == "__main__":
+    pytest.main()
@@ -139,5 +139,232 @@ def test_larger_dtype():
     mapper.apply_inplace(remapped, allow_unmapped=True)
     assert (remapped == expected).all()
 
+def test_duplicate_keys():
+    """
+    If the domain contains duplicates, the last entry wins
+    (as if the entries were inserted into a dict in order).
+    """
+    domain = np.array([0, 5, 7, 5, 0], np.uint64)
+    codomain = np.array([1, 2, 3, 4, 5], np.uint64)
+    mapper = LabelMapper(domain, codomain)
+    assert len(mapper) == 3
+    assert (mapper.apply(np.array([0, 5, 7], np.uint64)) == [5, 4, 3]).all()
+
+
+def test_large_mapping():
+    domain = np.unique(np.random.randint(1, 2**63, size=200_000, dtype=np.uint64))
+    codomain = np.arange(len(domain), dtype=np.uint64)
+    mapper = LabelMapper(domain, codomain)
+    assert mapper.strategy == "hash"
+    assert len(mapper) == len(domain)
+
+    original = domain[np.random.randint(0, len(domain), size=(50,60))]
+    expected = np.searchsorted(domain, original).astype(np.uint64)
+    assert (mapper.apply(original) == expected).all()
+
+    # 0 (and other missing values) are not in the mapping.
+    original[0,0] = 0
+    with pytest.raises(Exception):
+        mapper.apply(original)
+    assert mapper.apply(original, allow_unmapped=True)[0,0] == 0
+    assert mapper.apply_with_default(original, 17)[0,0] == 17
+
+
+def test_narrow_domain_no_truncation():
+    """
+    Input values which don't fit in the domain dtype are never
+    truncated into (and mapped like) some other label.
+    """
+    domain = np.array([232], np.uint8)
+    codomain = np.array([1], np.uint8)
+    mapper = LabelMapper(domain, codomain)
+
+    original = np.array([232, 1000], np.uint16)
+    assert (mapper.apply(original, allow_unmapped=True) == [1, 1000 % 256]).all()
+
+
+@pytest.mark.parametrize("num_threads", [2, 3, 0])
+def test_LabelMapper_threads(num_threads):
+    domain = np.arange(1000, dtype=np.uint64)
+    codomain = domain * 3
+    mapper = LabelMapper(domain, codomain)
+
+    original = np.random.randint(0, 1000, (40,50,60), dtype=np.uint64)
+    expected = original * 3
+    assert (mapper.apply(original, num_threads=num_threads) == expected).all()
+    assert (mapper.apply_with_default(original, 0, num_threads=num_threads) == expected).all()
+
+    remapped = original.copy()
+    mapper.apply_inplace(remapped, num_threads=num_threads)
+    assert (remapped == expected).all()
+
+    # Non-contiguous input is supported too (single-threaded).
+    assert (mapper.apply(original[:, ::2], num_threads=num_threads) == expected[:, ::2]).all()
+
+
+def test_LabelMapper_threads_first_missing_label():
+    """
+    With several unmapped labels, the error always names
+    the first one in array order, no matter how many threads are used.
+    """
+    mapper = LabelMapper(np.arange(100, dtype=np.uint64), np.arange(100, dtype=np.uint64))
+    original = np.random.randint(0, 100, (100,100,10), dtype=np.uint64)
+    original.flat[70_000] = 5001
+    original.flat[90_000] = 5002
+    original.flat[3_000] = 5000
+
+    for num_threads in (1, 2, 3, 8):
+        with pytest.raises(Exception, match="5000"):
+            mapper.apply(original, num_threads=num_threads)
+
+
+@pytest.mark.parametrize("dtype", UINT_DTYPES)
+def test_dense_strategy(dtype):
+    # Compact domain: every other label in [100, 200)
+    domain = np.arange(100, 200, 2, dtype=dtype)
+    codomain = (domain // 2).astype(dtype)
+    mapper = LabelMapper(domain, codomain)
+    assert mapper.strategy == "dense"
+
+    original = np.random.choice(domain, size=(20,30,40)).astype(dtype)
+    expected = original // 2
+    for num_threads in (1, 3):
+        assert (mapper.apply(original, num_threads=num_threads) == expected).all()
+
+    # Missing labels: below, inside, and above the table's range
+    original.flat[[10, 20_000, -1]] = [3, 101, 250]
+    with pytest.raises(Exception, match="3"):
+        mapper.apply(original)
+
+    expected.flat[[10, 20_000, -1]] = [3, 101, 250]
+    remapped = original.copy()
+    mapper.apply_inplace(remapped, allow_unmapped=True)
+    assert (remapped == expected).all()
+
+    expected.flat[[10, 20_000, -1]] = 7
+    assert (mapper.apply_with_default(original, 7) == expected).all()
+
+
+def test_dense_max_bytes():
+    domain = np.arange(1000, dtype=np.uint64)
+    assert LabelMapper(domain, domain).strategy == "dense"
+    assert LabelMapper(domain, domain, dense_max_bytes=1000).strategy == "hash"
+
+    # Sparse keys are not stored densely, even if the table would fit.
+    sparse = np.array([0, 10**6, 2*10**6], np.uint64)
+    assert LabelMapper(sparse, sparse).strategy == "hash"
+
+
+@pytest.mark.parametrize("dtypes", dtype_pairs)
+@pytest.mark.parametrize("keys", ["dense", "sparse"])
+def test_save_load_mmap(tmpdir, dtypes, keys):
+    dtype_in, dtype_out = dtypes
+    max_key = np.iinfo(dtype_in).max
+    if keys == "dense":
+        domain = np.arange(min(200, max_key), dtype=dtype_in)
+    else:
+        domain = np.unique(np.random.randint(0, max_key, size=200, dtype=dtype_in))
+    codomain = np.random.randint(0, np.iinfo(dtype_out).max, size=len(domain), dtype=dtype_out)
+
+    mapper = LabelMapper(domain, codomain)
+    path = str(tmpdir.join('mapping.lmap'))
+    mapper.save(path)
+
+    loaded = LabelMapper.load_mmap(path)
+    assert type(loaded) is type(mapper)
+    assert loaded.strategy == mapper.strategy
+    assert len(loaded) == len(mapper)
+
+    original = np.random.choice(domain, size=(10,20,30)).astype(dtype_in)
+    assert (loaded.apply(original) == mapper.apply(original)).all()
+    assert (loaded.apply(original, num_threads=2) == mapper.apply(original)).all()
+
+
+def test_load_mmap_errors(tmpdir):
+    with pytest.raises(RuntimeError):
+        LabelMapper.load_mmap(str(tmpdir.join('missing.lmap')))
+
+    path = tmpdir.join('garbage.lmap')
+    path.write_binary(b'x' * 1000)
+    with pytest.raises(RuntimeError):
+        LabelMapper.load_mmap(str(path))
+
+
+@pytest.mark.parametrize("keys", ["dense", "sparse"])
+def test_load_mmap_truncated(tmpdir, keys):
+    if keys == "dense":
+        domain = np.arange(1000, dtype=np.uint64)
+    else:
+        domain = np.arange(1000, dtype=np.uint64) * 1000003 + 1
+    mapper = LabelMapper(domain, domain.astype(np.uint32))
+    path = tmpdir.join('mapping.lmap')
+    mapper.save(str(path))
+    data = path.read_binary()
+
+    # Truncated file
+    truncated = tmpdir.join('truncated.lmap')
+    truncated.write_binary(data[:-64])
+    with pytest.raises(RuntimeError):
+        LabelMapper.load_mmap(str(truncated))
+
+    # Truncated file, whose header claims the truncated size (file_size is the last header field)
+    data = bytearray(data[:-64])
+    data[104:112] = np.uint64(len(data)).tobytes()
+    truncated.write_binary(bytes(data))
+    with pytest.raises(RuntimeError):
+        LabelMapper.load_mmap(str(truncated))
+
+
+def test_save_over_mapped_file(tmpdir):
+    domain = np.arange(1000, dtype=np.uint64) * 1000003 + 1
+    path = str(tmpdir.join('mapping.lmap'))
+    LabelMapper(domain, domain).save(path)
+    loaded = LabelMapper.load_mmap(path)
+
+    # Replacing the file doesn't disturb the existing mapping.
+    LabelMapper(domain, domain + 1).save(path)
+    assert (loaded.apply(domain) == domain).all()
+    assert (LabelMapper.load_mmap(path).apply(domain) == domain + 1).all()
+    assert tmpdir.listdir() == [tmpdir.join('mapping.lmap')]
+
+
+def test_apply_rle():
+    domain = np.arange(10, dtype=np.uint64)
+    mapper = LabelMapper(domain, domain + 100)
+
+    starts = np.array([0, 5, 7, 20], np.int64)
+    lengths = np.array([5, 2, 13, 1], np.int64)
+    values = np.array([3, 4, 3, 9], np.uint64)
+
+    new_starts, new_lengths, new_values = mapper.apply_rle(starts, lengths, values)
+    assert (new_starts == starts).all()
+    assert (new_lengths == lengths).all()
+    assert (new_values == [103, 104, 103, 109]).all()
+
+    values[1] = 50
+    with pytest.raises(Exception):
+        mapper.apply_rle(starts, lengths, values)
+    assert (mapper.apply_rle(starts, lengths, values, allow_unmapped=True)[2] == [103, 50, 103, 109]).all()
+
+    with pytest.raises(RuntimeError):
+        mapper.apply_rle(starts[:2], lengths, values)
+
+
+def test_apply_palette():
+    domain = np.arange(10, dtype=np.uint32)
+    mapper = LabelMapper(domain, domain * 2)
+
+    palette = np.array([7, 0, 5], np.uint32)
+    indices = np.random.randint(0, 3, size=(16,16,16)).astype(np.uint8)
+
+    new_palette, new_indices = mapper.apply_palette(palette, indices)
+    assert (new_palette == [14, 0, 10]).all()
+    assert new_indices.dtype == indices.dtype
+    assert (new_indices == indices).all()
+
+    # Same result as decompressing and mapping the full block
+    assert (new_palette[new_indices] == mapper.apply(palette[indices])).all()
+
+
 if __name__ == "__main__":
     pytest.main()
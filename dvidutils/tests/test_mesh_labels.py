@@ -0,0 +1,126 @@
+import os
+import struct
+
+import pytest
+import numpy as np
+from dvidutils import mesh_labels, mesh_labels_to_ngmesh
+
+import faulthandler
+faulthandler.enable()
+
+
+def signed_volume(vertices, faces):
+    """
+    Volume enclosed by a closed, outward-oriented triangle mesh.
+    """
+    v0, v1, v2 = (vertices[faces[:, i]].astype(np.float64) for i in range(3))
+    return np.einsum('ij,ij->i', v0, np.cross(v1, v2)).sum() / 6
+
+
+def is_closed(faces):
+    """
+    True if every (undirected) edge is shared by exactly two faces,
+    and every directed edge appears once (i.e. the faces are consistently oriented).
+    """
+    edges = np.concatenate([faces[:, [0,1]], faces[:, [1,2]], faces[:, [2,0]]])
+    directed = {tuple(e) for e in edges}
+    if len(directed) != len(edges):
+        return False
+    return all((b,a) in directed for (a,b) in directed)
+
+
+def sphere(shape, center, radius):
+    z, y, x = np.indices(shape)
+    return ((z - center[0])**2 + (y - center[1])**2 + (x - center[2])**2) <= radius**2
+
+
+def test_mesh_labels_single_voxel():
+    labels = np.zeros((3,3,3), np.uint64)
+    labels[1,1,1] = 7
+
+    meshes = mesh_labels(labels)
+    assert list(meshes.keys()) == [7]
+
+    vertices, faces = meshes[7]
+    assert vertices.dtype == np.float32
+    assert faces.dtype == np.uint32
+    assert vertices.shape == (8,3)
+    assert faces.shape == (12,3)
+    assert is_closed(faces)
+    assert signed_volume(vertices, faces) > 0
+
+    # Vertices surround the voxel center
+    assert np.allclose(vertices.mean(axis=0), (1,1,1))
+
+
+@pytest.mark.parametrize("dtype", [np.uint8, np.uint16, np.uint32, np.uint64])
+def test_mesh_labels_sphere(dtype):
+    labels = np.zeros((40,40,40), dtype)
+    labels[sphere(labels.shape, (20,20,20), 12)] = 3
+    labels[sphere(labels.shape, (8,8,30), 5)] = 5
+
+    meshes = mesh_labels(labels)
+    assert sorted(meshes.keys()) == [3,5]
+
+    for label, radius in [(3, 12), (5, 5)]:
+        vertices, faces = meshes[label]
+        assert is_closed(faces)
+        expected = 4/3 * np.pi * radius**3
+        assert abs(signed_volume(vertices, faces) - expected) / expected < 0.15
+
+
+def test_mesh_labels_selected_ids_and_scaling():
+    labels = np.zeros((20,20,20), np.uint32)
+    labels[2:8, 2:8, 2:8] = 1
+    labels[10:18, 10:18, 10:18] = 2
+
+    meshes = mesh_labels(labels, [2, 9], voxel_size=(2,2,2), offset=(100, 200, 300))
+    assert sorted(meshes.keys()) == [2, 9]
+
+    # Not present in the volume
+    assert meshes[9][0].shape == (0,3)
+    assert meshes[9][1].shape == (0,3)
+
+    vertices, _faces = meshes[2]
+    unscaled, _ = mesh_labels(labels, [2])[2]
+    assert np.allclose(vertices, unscaled * 2 + (100, 200, 300))
+
+
+def test_mesh_labels_threads():
+    labels = np.random.randint(0, 4, size=(33,25,17)).astype(np.uint64)
+    single = mesh_labels(labels)
+    for num_threads in (2, 3, 8):
+        multi = mesh_labels(labels, num_threads=num_threads)
+        assert single.keys() == multi.keys()
+        for label in single.keys():
+            # Identical vertices (welded across slab seams) and faces.
+            assert (single[label][0] == multi[label][0]).all()
+            assert (single[label][1] == multi[label][1]).all()
+
+
+def test_mesh_labels_to_ngmesh(tmpdir):
+    labels = np.zeros((30,30,30), np.uint64)
+    labels[sphere(labels.shape, (15,15,15), 8)] = 12
+
+    written = mesh_labels_to_ngmesh(labels, [12, 13], str(tmpdir))
+    assert written == [12]
+    assert os.listdir(str(tmpdir)) == ['12.ngmesh']
+
+    with open(str(tmpdir.join('12.ngmesh')), 'rb') as f:
+        data = f.read()
+    num_vertices = struct.unpack('I', data[:4])[0]
+    vertices = np.frombuffer(data[4:4+12*num_vertices], np.float32).reshape(-1,3)
+    faces = np.frombuffer(data[4+12*num_vertices:], np.uint32).reshape(-1,3)
+
+    expected_vertices, expected_faces = mesh_labels(labels, [12])[12]
+    assert (vertices == expected_vertices).all()
+    assert (faces == expected_faces).all()
+
+
+def test_mesh_labels_bad_dimensions():
+    with pytest.raises(RuntimeError):
+        mesh_labels(np.zeros((10,10), np.uint64))
+
+
+if __name__ == "__main__":
+    pytest.main()
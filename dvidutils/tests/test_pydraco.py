@@ -3,7 +3,8 @@ from itertools import product
 import pytest
 import numpy as np
 import pandas as pd
-from dvidutils import encode_faces_to_drc_bytes, decode_drc_bytes_to_faces
+from dvidutils import (encode_faces_to_drc_bytes, encode_faces_to_custom_drc_bytes, decode_drc_bytes_to_faces,
+                       snap_vertices_to_quantization_grid, weld_vertices)
 
 import faulthandler
 faulthandler.enable()
@@ -129,6 +130,67 @@ def test_random_roundtrip():
     _compare(vertices, normals, faces, rt_vertices, rt_normals, rt_faces, True)
 
 
+def test_snap_and_weld_adjacent_fragments():
+    """
+    Two fragments which share the face x == 100, each snapped to its own quantization grid and welded.
+    Vertices on the shared face must still coincide in both fragments.
+    """
+    box, bits = 100, 10
+    step = box / (2**bits - 1)
+    rng = np.random.RandomState(0)
+
+    # Points on the shared face, and near-duplicates of them just inside fragment A.
+    # The near-duplicates come first, so a tolerance-based weld would pick them as representatives.
+    boundary = rng.uniform(0, box, size=(200, 3)).astype(np.float32)
+    boundary[:, 0] = box
+    near = boundary - [0.3 * step, 0, 0]
+    near = near.astype(np.float32)
+
+    interior_a = rng.uniform(0, box, size=(200, 3)).astype(np.float32)
+    interior_b = rng.uniform(box, 2*box, size=(200, 3)).astype(np.float32)
+    interior_b[:, 1:] -= box
+
+    vertices_a = np.concatenate([near, boundary, interior_a])
+    vertices_b = np.concatenate([boundary, interior_b])
+    faces_a = rng.randint(0, len(vertices_a), size=(300, 3)).astype(np.uint32)
+    faces_b = rng.randint(0, len(vertices_b), size=(300, 3)).astype(np.uint32)
+
+    shape = np.array([box, box, box])
+    welded = []
+    for vertices, faces, origin in [(vertices_a, faces_a, [0, 0, 0]), (vertices_b, faces_b, [box, 0, 0])]:
+        origin = np.array(origin)
+        snapped = snap_vertices_to_quantization_grid(vertices, shape, origin, bits)
+
+        # Nothing moves by more than half a grid step, and everything lands on the grid.
+        assert np.abs(snapped - vertices).max() <= step / 2 + 1e-4
+        grid_coords = (snapped - origin) / step
+        assert np.abs(grid_coords - np.round(grid_coords)).max() < 1e-3
+
+        # Snapping doesn't change the encoded mesh.
+        normals = np.zeros((0, 3), np.float32)
+        assert (encode_faces_to_custom_drc_bytes(snapped, normals, faces, shape, origin, position_quantization_bits=bits)
+                == encode_faces_to_custom_drc_bytes(vertices, normals, faces, shape, origin, position_quantization_bits=bits))
+
+        welded.append(weld_vertices(snapped, faces, tolerance=step/4))
+
+    (new_vertices_a, _, old_to_new_a), (new_vertices_b, _, old_to_new_b) = welded
+    boundary_a = new_vertices_a[old_to_new_a[len(near):len(near) + len(boundary)]]
+    boundary_b = new_vertices_b[old_to_new_b[:len(boundary)]]
+    assert (boundary_a == boundary_b).all()
+    assert (boundary_a[:, 0] == box).all()
+
+    # The near-duplicates were merged into the boundary points on the same grid points, at least some of the time.
+    assert len(new_vertices_a) < len(vertices_a)
+
+
+def test_snap_bad_args():
+    vertices = np.zeros((3, 3), np.float32)
+    with pytest.raises(RuntimeError):
+        snap_vertices_to_quantization_grid(vertices, np.array([0, 100, 100]), np.array([0, 0, 0]), 10)
+    with pytest.raises(RuntimeError):
+        snap_vertices_to_quantization_grid(vertices, np.array([100, 100, 100]), np.array([0, 0, 0]), 0)
+
+
 def _compare(vertices, normals, faces, rt_vertices, rt_normals, rt_faces, check_normals): 
     # Draco compression involves dropping some bits during quantization
     # For comparisons, we need to round the results.
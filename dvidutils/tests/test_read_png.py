@@ -0,0 +1,142 @@
+import struct
+import zlib
+
+import pytest
+import numpy as np
+from dvidutils import read_png, write_png
+
+import faulthandler
+faulthandler.enable()
+
+
+def write_gray_png(path, image):
+    """
+    Minimal grayscale png writer (8 or 16 bit), so the tests don't depend on an imaging library.
+    """
+    assert image.ndim == 2 and image.dtype in (np.uint8, np.uint16)
+    h, w = image.shape
+    bit_depth = 8 * image.dtype.itemsize
+
+    def chunk(kind, data):
+        body = kind + data
+        return struct.pack('>I', len(data)) + body + struct.pack('>I', zlib.crc32(body) & 0xffffffff)
+
+    big_endian = image.astype(image.dtype.newbyteorder('>'))
+    raw = b''.join(b'\0' + big_endian[y].tobytes() for y in range(h))
+    with open(path, 'wb') as f:
+        f.write(b'\x89PNG\r\n\x1a\n')
+        f.write(chunk(b'IHDR', struct.pack('>IIBBBBB', w, h, bit_depth, 0, 0, 0, 0)))
+        f.write(chunk(b'IDAT', zlib.compress(raw)))
+        f.write(chunk(b'IEND', b''))
+
+
+@pytest.fixture(params=[np.uint8, np.uint16])
+def png_file(request, tmpdir):
+    dtype = request.param
+    rng = np.random.RandomState(0)
+    image = rng.randint(0, np.iinfo(dtype).max, size=(123, 77)).astype(dtype)
+    path = str(tmpdir.join('image.png'))
+    write_gray_png(path, image)
+    return path, image
+
+
+def test_read_png(png_file):
+    path, image = png_file
+    result = read_png(path)
+    assert result.dtype == image.dtype
+    assert result.shape == image.shape
+    assert (result == image).all()
+
+
+def test_read_png_rows(png_file):
+    path, image = png_file
+    assert (read_png(path, 10, 20) == image[10:20]).all()
+    assert (read_png(path, 100) == image[100:]).all()
+    assert (read_png(path, stop_row=1) == image[:1]).all()
+    assert read_png(path, 50, 50).shape == (0, image.shape[1])
+
+
+def test_read_png_bad_rows(png_file):
+    path, image = png_file
+    with pytest.raises(RuntimeError):
+        read_png(path, 0, image.shape[0] + 1)
+    with pytest.raises(RuntimeError):
+        read_png(path, 20, 10)
+    with pytest.raises(RuntimeError):
+        read_png(path, -1)
+
+
+def test_read_png_bad_file(tmpdir):
+    with pytest.raises(RuntimeError):
+        read_png(str(tmpdir.join('missing.png')))
+
+    path = str(tmpdir.join('not-a.png'))
+    with open(path, 'wb') as f:
+        f.write(b'not a png file')
+    with pytest.raises(RuntimeError):
+        read_png(path)
+
+
+def check_png_container(path, shape):
+    """
+    Checks a png file's structure independently of libpng:  the chunk CRCs,
+    the IHDR, and that the concatenated IDAT data is one valid zlib stream
+    (header, adler32 trailer) of the right length.
+    """
+    with open(path, 'rb') as f:
+        data = f.read()
+    assert data[:8] == b'\x89PNG\r\n\x1a\n'
+
+    pos = 8
+    chunks = []
+    while pos < len(data):
+        length, = struct.unpack('>I', data[pos:pos+4])
+        kind = data[pos+4:pos+8]
+        body = data[pos+8:pos+8+length]
+        crc, = struct.unpack('>I', data[pos+8+length:pos+12+length])
+        assert crc == zlib.crc32(kind + body) & 0xffffffff, kind
+        chunks.append((kind, body))
+        pos += 12 + length
+
+    assert chunks[0][0] == b'IHDR'
+    assert struct.unpack('>IIBBBBB', chunks[0][1]) == (shape[1], shape[0], 8, 0, 0, 0, 0)
+    assert chunks[-1] == (b'IEND', b'')
+
+    idat = b''.join(body for kind, body in chunks if kind == b'IDAT')
+    decompressor = zlib.decompressobj()
+    raw = decompressor.decompress(idat)
+    assert decompressor.eof and not decompressor.unused_data
+    assert len(raw) == shape[0] * (shape[1] + 1)
+
+
+@pytest.mark.parametrize("num_threads", [1, 2, 4, 7])
+@pytest.mark.parametrize("filters", ["none", "sub", "up", "avg", "paeth", "all", "up,sub"])
+def test_write_png_roundtrip(tmpdir, num_threads, filters):
+    rng = np.random.RandomState(0)
+    path = str(tmpdir.join('image.png'))
+    for width in [1, 3, 100]:
+        for height in [1, 2, 5, 301]:
+            # Smooth gradients plus noise, so every filter type gets used
+            image = (np.add.outer(3*np.arange(height), 5*np.arange(width)) + rng.randint(0, 7, (height, width)))
+            image = image.astype(np.uint8)
+            for level in [0, 1, 6, 9]:
+                write_png(path, image, compression_level=level, filters=filters, num_threads=num_threads)
+                check_png_container(path, image.shape)
+                result = read_png(path)
+                assert result.dtype == np.uint8
+                assert (result == image).all(), (width, height, level)
+
+
+def test_write_png_errors(tmpdir):
+    image = np.zeros((10, 10), np.uint8)
+    path = str(tmpdir.join('image.png'))
+    with pytest.raises(RuntimeError):
+        write_png(path, image, filters="bogus")
+    with pytest.raises(RuntimeError):
+        write_png(path, image, compression_level=10)
+    with pytest.raises(RuntimeError):
+        write_png(str(tmpdir.join('missing-dir', 'image.png')), image, num_threads=2)
+
+
+if __name__ == "__main__":
+    pytest.main()
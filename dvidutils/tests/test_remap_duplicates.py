@@ -2,7 +2,7 @@ import sys
 from itertools import product
 import pytest
 import numpy as np
-from dvidutils import remap_duplicates
+from dvidutils import remap_duplicates, weld_vertices
 
 import faulthandler
 faulthandler.enable()
@@ -17,5 +17,79 @@ def test_basic():
     assert (duplicate_mapping == expected).all()
     
 
+def test_weld_vertices():
+    vertices = np.zeros((10, 3), np.float32)
+    vertices[:, 2] = np.arange(10, dtype=int) % 3
+    faces = np.array([[0,1,2], [3,4,5], [9,8,7]], np.uint32)
+
+    new_vertices, new_faces, old_to_new = weld_vertices(vertices, faces)
+    assert (new_vertices == vertices[:3]).all()
+    assert (old_to_new == np.arange(10) % 3).all()
+    assert (new_faces == [[0,1,2], [0,1,2], [0,2,1]]).all()
+
+
+def test_weld_vertices_random():
+    # Many duplicates, in random order
+    unique = np.random.random((1000, 3)).astype(np.float32)
+    vertices = unique[np.random.randint(0, 1000, size=5000)]
+    faces = np.random.randint(0, 5000, size=(3000, 3)).astype(np.uint32)
+
+    new_vertices, new_faces, old_to_new = weld_vertices(vertices, faces)
+
+    # Unique vertices are in order of first appearance
+    _, first_indexes = np.unique(vertices, axis=0, return_index=True)
+    assert (new_vertices == vertices[np.sort(first_indexes)]).all()
+
+    assert (new_vertices[old_to_new] == vertices).all()
+    assert (new_vertices[new_faces] == vertices[faces]).all()
+
+    # Consistent with remap_duplicates()
+    mapping = remap_duplicates(vertices)
+    assert (old_to_new[mapping[:,0]] == old_to_new[mapping[:,1]]).all()
+
+
+def test_weld_vertices_bad_face():
+    vertices = np.zeros((3, 3), np.float32)
+    faces = np.array([[0,1,3]], np.uint32)
+    with pytest.raises(RuntimeError):
+        weld_vertices(vertices, faces)
+
+
+def test_weld_vertices_tolerance():
+    # A grid of points, 1.0 apart, and a jittered copy of it
+    grid = np.indices((5,5,5)).reshape(3,-1).transpose().astype(np.float32)
+    jittered = grid + np.random.uniform(-0.01, 0.01, size=grid.shape).astype(np.float32)
+    vertices = np.concatenate([grid, jittered])
+    faces = np.array([[0, 1, 2], [125, 126, 127], [0, 125, 1]], np.uint32)
+
+    new_vertices, new_faces, old_to_new = weld_vertices(vertices, faces, tolerance=0.05)
+
+    # Each jittered point is merged into its original grid point
+    assert (new_vertices == grid).all()
+    assert (old_to_new == np.arange(250) % 125).all()
+
+    # The third face is degenerate after welding, so it's dropped.
+    assert (new_faces == [[0, 1, 2], [0, 1, 2]]).all()
+
+    # Grid points are too far apart to merge
+    new_vertices, new_faces, old_to_new = weld_vertices(grid, faces[:1], tolerance=0.5)
+    assert (new_vertices == grid).all()
+
+
+def test_weld_vertices_tolerance_closest():
+    # The last vertex is within tolerance of both others, but closer to the second.
+    vertices = np.array([[0.0, 0, 0], [1.0, 0, 0], [0.55, 0, 0]], np.float32)
+    faces = np.zeros((0,3), np.uint32)
+    _, _, old_to_new = weld_vertices(vertices, faces, tolerance=0.6)
+    assert (old_to_new == [0, 1, 1]).all()
+
+
+def test_weld_vertices_bad_tolerance():
+    vertices = np.zeros((3, 3), np.float32)
+    faces = np.array([[0,1,2]], np.uint32)
+    with pytest.raises(RuntimeError):
+        weld_vertices(vertices, faces, tolerance=-1.0)
+
+
 if __name__ == "__main__":
     pytest.main()
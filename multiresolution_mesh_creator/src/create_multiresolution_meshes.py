@@ -2,7 +2,7 @@ from contextlib import ExitStack
 import trimesh
 from trimesh.intersections import slice_faces_plane
 import numpy as np
-from dvidutils import encode_faces_to_custom_drc_bytes
+from dvidutils import encode_faces_to_custom_drc_bytes, snap_vertices_to_quantization_grid, weld_vertices
 import time
 import os
 from os import listdir
@@ -15,6 +15,9 @@ import logging
 
 logger = logging.getLogger(__name__)
 
+# Draco position quantization used for every fragment
+POSITION_QUANTIZATION_BITS = 10
+
 
 def my_slice_faces_plane(vertices, faces, plane_normal, plane_origin):
     """Wrapper for trimesh slice_faces_plane to catch error that happens if the
@@ -179,13 +182,38 @@ def generate_mesh_decomposition(mesh_path, lod_0_box_size, grid_origin,
     # Return combined_fragments_dictionary
     for fragment_pos, fragment in combined_fragments_dictionary.items():
         current_box_size = lod_0_box_size * 2**current_lod
+
+        fragment_shape = np.asarray(3 * [current_box_size])
+        fragment_origin = np.asarray(fragment_pos) * current_box_size
+
+        # Slicing leaves near-coincident vertices along the cut planes.
+        # Draco quantizes each coordinate to a grid with a step of
+        # box / (2**bits - 1), so snap the vertices to that grid first (which
+        # doesn't change the encoded mesh), and then weld only the vertices
+        # that landed on the same grid point, dropping the collapsed faces.
+        # Nothing moves any further than the encoding would move it anyway,
+        # and neighboring fragments' grids coincide on their shared face, so
+        # the vertices on the cut planes still match across fragments.
+        # (Welding unsnapped vertices within a tolerance can move a boundary
+        # vertex in one fragment but not its neighbor, opening cracks.)
+        vertices = snap_vertices_to_quantization_grid(
+            np.asarray(fragment.vertices, dtype=np.float32),
+            fragment_shape,
+            fragment_origin,
+            position_quantization_bits=POSITION_QUANTIZATION_BITS)
+        quantization_step = current_box_size / (2**POSITION_QUANTIZATION_BITS - 1)
+        vertices, faces, _ = weld_vertices(
+            vertices,
+            np.asarray(fragment.faces, dtype=np.uint32),
+            tolerance=quantization_step / 4)
+
         draco_bytes = encode_faces_to_custom_drc_bytes(
-            fragment.vertices,
-            np.zeros(np.shape(fragment.vertices)),
-            fragment.faces,
-            np.asarray(3 * [current_box_size]),
-            np.asarray(fragment_pos) * current_box_size,
-            position_quantization_bits=10)
+            vertices,
+            np.zeros(np.shape(vertices)),
+            faces,
+            fragment_shape,
+            fragment_origin,
+            position_quantization_bits=POSITION_QUANTIZATION_BITS)
 
         if len(draco_bytes) > 12:
             # Then the mesh is not empty
@@ -197,49 +225,59 @@ def generate_mesh_decomposition(mesh_path, lod_0_box_size, grid_origin,
     return fragments
 
 
-def pyfqmr_decimate(input_path, output_path, id, lod, ext, decimation_factor,
-                    aggressiveness):
-    """Mesh decimation using pyfqmr.
+def pyfqmr_decimate_batch(input_path, output_path, ids, lods, ext,
+                          decimation_factor, aggressiveness):
+    """Mesh decimation of a batch of meshes using pyfqmr.
 
-    Decimation is performed on a mesh located at `input_path`/`id`.`ext`. The
-    target number of faces is 1/2**`lod` of the current number of faces. The
-    mesh is written to an ply file in `output_path`/s`lod`/`id`.ply. This
-    utilizes `dask.delayed`.
+    Each mesh located at `input_path`/`id`.`ext` is loaded once and decimated
+    for every lod in `lods` with a single `pyfqmr.simplify_many` call, which
+    runs without the GIL. Meshes are processed one at a time (with their
+    results written out before the next is loaded), so a task holds only one
+    mesh's lod chain in memory, no matter how many ids are in the batch.
+    The dask workers each run one task at a time on one thread, so
+    decimation uses a single thread too, rather than oversubscribing the node.
+    The target number of faces is 1/`decimation_factor`**`lod` of the current
+    number of faces. The meshes are written to ply files in
+    `output_path`/s`lod`/`id`.ply. This utilizes `dask.delayed`.
 
     Args:
         input_path [`str`]: The input path for s0 meshes
         output_path [`str`]: The output path
-        id [`int`]: The object id
-        lod [`int`]: The current level of detail
+        ids [`list`]: The object ids in this batch
+        lods [`list`]: The levels of detail to generate (excluding 0)
         ext [`str`]: The extension of the s0 meshes.
         decimation_factor [`float`]: The factor by which we decimate faces,
                                      scaled by 2**lod
         aggressiveness [`int`]: Aggressiveness for decimation
     """
 
-    vertices, faces = mesh_util.mesh_loader(f"{input_path}/{id}{ext}")
-    desired_faces = max(len(faces) // (decimation_factor**lod), 4)
-    mesh_simplifier = pyfqmr.Simplify()
-    mesh_simplifier.setMesh(vertices, faces)
-    del vertices
-    del faces
-    mesh_simplifier.simplify_mesh(target_count=desired_faces,
-                                  aggressiveness=aggressiveness,
-                                  preserve_border=False,
-                                  verbose=False)
-    vertices, faces, _ = mesh_simplifier.getMesh()
-    del mesh_simplifier
-
-    mesh = trimesh.Trimesh(vertices, faces)
-    del vertices
-    del faces
-    _ = mesh.export(f"{output_path}/s{lod}/{id}.ply")
+    for id in ids:
+        vertices, faces = mesh_util.mesh_loader(f"{input_path}/{id}{ext}")
+        target_counts = [
+            max(len(faces) // (decimation_factor**lod), 4) for lod in lods
+        ]
+        results = pyfqmr.simplify_many([(vertices, faces)] * len(lods),
+                                       target_counts,
+                                       num_threads=1,
+                                       aggressiveness=aggressiveness,
+                                       preserve_border=False)
+        del vertices, faces
+
+        for (lod_vertices, lod_faces), lod in zip(results, lods):
+            mesh = trimesh.Trimesh(lod_vertices, lod_faces)
+            _ = mesh.export(f"{output_path}/s{lod}/{id}.ply")
+        del results
 
 
 def generate_decimated_meshes(input_path, output_path, lods, ids, ext,
-                              decimation_factor, aggressiveness):
+                              decimation_factor, aggressiveness,
+                              batch_size=64):
     """Generate decimatated meshes for all ids in `ids`, over all lod in `lods`.
 
+    Ids are grouped into batches of `batch_size`, and each batch is a single
+    dask task, since for small meshes the per-task overhead is larger than
+    the decimation itself.
+
     Args:
         input_path (`str`): Input mesh paths
         output_path (`str`): Output mesh paths
@@ -249,9 +287,10 @@ def generate_decimated_meshes(input_path, output_path, lods, ids, ext,
         decimation_fraction [`float`]: The factor by which we decimate faces,
                                        scaled by 2**lod
         aggressiveness [`int`]: Aggressiveness for decimation
+        batch_size [`int`]: Number of ids decimated per dask task
     """
 
-    results = []
+    decimated_lods = []
     for current_lod in lods:
         if current_lod == 0:
             os.makedirs(f"{output_path}/mesh_lods/", exist_ok=True)
@@ -263,13 +302,16 @@ def generate_decimated_meshes(input_path, output_path, lods, ids, ext,
         else:
             os.makedirs(f"{output_path}/mesh_lods/s{current_lod}",
                         exist_ok=True)
-            for id in ids:
-                results.append(
-                    dask.delayed(pyfqmr_decimate)(input_path,
-                                                  f"{output_path}/mesh_lods",
-                                                  id, current_lod, ext,
-                                                  decimation_factor,
-                                                  aggressiveness))
+            decimated_lods.append(current_lod)
+
+    results = []
+    if decimated_lods:
+        for start in range(0, len(ids), batch_size):
+            results.append(
+                dask.delayed(pyfqmr_decimate_batch)(
+                    input_path, f"{output_path}/mesh_lods",
+                    ids[start:start + batch_size], decimated_lods, ext,
+                    decimation_factor, aggressiveness))
 
     dask.compute(*results)
 
@@ -473,6 +515,8 @@ def main():
     skip_decimation = optional_decimation_settings['skip_decimation']
     decimation_factor = optional_decimation_settings['decimation_factor']
     aggressiveness = optional_decimation_settings['aggressiveness']
+    decimation_batch_size = optional_decimation_settings[
+        'decimation_batch_size']
     delete_decimated_meshes = optional_decimation_settings[
         'delete_decimated_meshes']
 
@@ -505,7 +549,8 @@ def main():
                         generate_decimated_meshes(input_path, output_path,
                                                   lods, mesh_ids, mesh_ext,
                                                   decimation_factor,
-                                                  aggressiveness)
+                                                  aggressiveness,
+                                                  decimation_batch_size)
 
             # Restart dask to clean up cluster before multires assembly
             with dask_util.start_dask(num_workers, "multires creation",
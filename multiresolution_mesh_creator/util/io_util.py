@@ -86,6 +86,8 @@ def read_run_config(config_path):
             optional_decimation_settings["aggressiveness"] = 7
         if "delete_decimated_meshes" not in optional_decimation_settings:
             optional_decimation_settings["delete_decimated_meshes"] = False
+        if "decimation_batch_size" not in optional_decimation_settings:
+            optional_decimation_settings["decimation_batch_size"] = 64
 
         return required_settings, optional_decimation_settings
 
@@ -25,6 +25,12 @@
 #include <string>
 #include <math.h>
 #include <float.h> //FLT_EPSILON, DBL_EPSILON
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #define loopi(start_l,end_l) for ( int i=start_l;i<end_l;++i )
 #define loopi(start_l,end_l) for ( int i=start_l;i<end_l;++i )
@@ -244,32 +250,42 @@ double min(double v1, double v2) {
 }
 
 
-class SymetricMatrix {
+// Scalar type used to store the quadrics. Define PYFQMR_FLOAT_QUADRICS to
+// store them as float, which halves their memory; errors and determinants
+// are always evaluated in double.
+#ifdef PYFQMR_FLOAT_QUADRICS
+typedef float quadric_t;
+#else
+typedef double quadric_t;
+#endif
+
+template <typename T>
+class SymetricMatrixT {
 
   public:
 
   // Constructor
 
-  SymetricMatrix(double c=0) { loopi(0,10) m[i] = c;  }
+  SymetricMatrixT(double c=0) { loopi(0,10) m[i] = T(c);  }
 
-  SymetricMatrix( double m11, double m12, double m13, double m14,
-                  double m22, double m23, double m24,
-                              double m33, double m34,
-                                          double m44) {
-       m[0] = m11;  m[1] = m12;  m[2] = m13;  m[3] = m14;
-                    m[4] = m22;  m[5] = m23;  m[6] = m24;
-                                 m[7] = m33;  m[8] = m34;
-                                              m[9] = m44;
+  SymetricMatrixT( double m11, double m12, double m13, double m14,
+                   double m22, double m23, double m24,
+                               double m33, double m34,
+                                           double m44) {
+       m[0] = T(m11);  m[1] = T(m12);  m[2] = T(m13);  m[3] = T(m14);
+                       m[4] = T(m22);  m[5] = T(m23);  m[6] = T(m24);
+                                       m[7] = T(m33);  m[8] = T(m34);
+                                                       m[9] = T(m44);
   }
 
   // Make plane
 
-  SymetricMatrix(double a,double b,double c,double d)
+  SymetricMatrixT(double a,double b,double c,double d)
   {
-    m[0] = a*a;  m[1] = a*b;  m[2] = a*c;  m[3] = a*d;
-                 m[4] = b*b;  m[5] = b*c;  m[6] = b*d;
-                              m[7 ] =c*c; m[8 ] = c*d;
-                                           m[9 ] = d*d;
+    m[0] = T(a*a);  m[1] = T(a*b);  m[2] = T(a*c);  m[3] = T(a*d);
+                    m[4] = T(b*b);  m[5] = T(b*c);  m[6] = T(b*d);
+                                    m[7 ] =T(c*c); m[8 ] = T(c*d);
+                                                   m[9 ] = T(d*d);
   }
 
   double operator[](int c) const { return m[c]; }
@@ -278,31 +294,33 @@ class SymetricMatrix {
 
   double det( int a11, int a12, int a13,
         int a21, int a22, int a23,
-        int a31, int a32, int a33)
+        int a31, int a32, int a33) const
   {
+    double m[10]; loopi(0,10) m[i] = this->m[i];
     double det =  m[a11]*m[a22]*m[a33] + m[a13]*m[a21]*m[a32] + m[a12]*m[a23]*m[a31]
           - m[a13]*m[a22]*m[a31] - m[a11]*m[a23]*m[a32]- m[a12]*m[a21]*m[a33];
     return det;
   }
 
-  const SymetricMatrix operator+(const SymetricMatrix& n) const
+  const SymetricMatrixT operator+(const SymetricMatrixT& n) const
   {
-    return SymetricMatrix( m[0]+n[0],   m[1]+n[1],   m[2]+n[2],   m[3]+n[3],
-                                m[4]+n[4],   m[5]+n[5],   m[6]+n[6],
-                                             m[ 7]+n[ 7], m[ 8]+n[8 ],
-                                                          m[ 9]+n[9 ]);
+    return SymetricMatrixT( m[0]+n[0],   m[1]+n[1],   m[2]+n[2],   m[3]+n[3],
+                                 m[4]+n[4],   m[5]+n[5],   m[6]+n[6],
+                                              m[ 7]+n[ 7], m[ 8]+n[8 ],
+                                                           m[ 9]+n[9 ]);
   }
 
-  SymetricMatrix& operator+=(const SymetricMatrix& n)
+  SymetricMatrixT& operator+=(const SymetricMatrixT& n)
   {
-     m[0]+=n[0];   m[1]+=n[1];   m[2]+=n[2];   m[3]+=n[3];
-     m[4]+=n[4];   m[5]+=n[5];   m[6]+=n[6];   m[7]+=n[7];
-     m[8]+=n[8];   m[9]+=n[9];
+     m[0]+=n.m[0];   m[1]+=n.m[1];   m[2]+=n.m[2];   m[3]+=n.m[3];
+     m[4]+=n.m[4];   m[5]+=n.m[5];   m[6]+=n.m[6];   m[7]+=n.m[7];
+     m[8]+=n.m[8];   m[9]+=n.m[9];
     return *this;
   }
 
-  double m[10];
+  T m[10];
 };
+typedef SymetricMatrixT<quadric_t> SymetricMatrix;
 ///////////////////////////////////////////
 
 namespace Simplify
@@ -317,16 +335,19 @@ namespace Simplify
   struct Triangle { int v[3];double err[4];int deleted,dirty,attr;vec3f n;vec3f uvs[3];int material; };
   struct Vertex { vec3f p;int tstart,tcount;SymetricMatrix q;int border;};
   struct Ref { int tid,tvertex; };
-  std::vector<Triangle> triangles;
-  std::vector<Vertex> vertices;
-  std::vector<Ref> refs;
-    std::string mtllib; //
-    std::vector<std::string> materials; //
+  // The mesh state is per-thread, so that independent meshes can be
+  // simplified concurrently (see simplify_many below).
+  thread_local std::vector<Triangle> triangles;
+  thread_local std::vector<Vertex> vertices;
+  thread_local std::vector<Ref> refs;
+    thread_local std::string mtllib; //
+    thread_local std::vector<std::string> materials; //
 
   // Helper functions
 
-  double vertex_error(SymetricMatrix q, double x, double y, double z);
+  double vertex_error(const SymetricMatrix &q, double x, double y, double z);
   double calculate_error(int id_v1, int id_v2, vec3f &p_result);
+  void calculate_triangle_errors(Triangle &t);
   bool flipped(vec3f p,int i0,int i1,Vertex &v0,Vertex &v1,std::vector<int> &deleted);
   void update_uvs(int i0,const Vertex &v,const vec3f &p,std::vector<int> &deleted);
   void update_triangles(int i0,Vertex &v,std::vector<int> &deleted,int &deleted_triangles);
@@ -599,7 +620,6 @@ namespace Simplify
 
   void update_triangles(int i0,Vertex &v,std::vector<int> &deleted,int &deleted_triangles)
   {
-    vec3f p;
     loopk(0,v.tcount)
     {
       Ref &r=refs[v.tstart+k];
@@ -613,10 +633,7 @@ namespace Simplify
       }
       t.v[r.tvertex]=i0;
       t.dirty=1;
-      t.err[0]=calculate_error(t.v[0],t.v[1],p);
-      t.err[1]=calculate_error(t.v[1],t.v[2],p);
-      t.err[2]=calculate_error(t.v[2],t.v[0],p);
-      t.err[3]=min(t.err[0],min(t.err[1],t.err[2]));
+      calculate_triangle_errors(t);
       refs.push_back(r);
     }
   }
@@ -661,9 +678,7 @@ namespace Simplify
       loopi(0,triangles.size())
       {
         // Calc Edge Error
-        Triangle &t=triangles[i];vec3f p;
-        loopj(0,3) t.err[j]=calculate_error(t.v[j],t.v[(j+1)%3],p);
-        t.err[3]=min(t.err[0],min(t.err[1],t.err[2]));
+        calculate_triangle_errors(triangles[i]);
       }
     }
 
@@ -776,7 +791,7 @@ namespace Simplify
 
   // Error between vertex and Quadric
 
-  double vertex_error(SymetricMatrix q, double x, double y, double z)
+  double vertex_error(const SymetricMatrix &q, double x, double y, double z)
   {
     return   q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x + q[4]*y*y
          + 2*q[5]*y*z + 2*q[6]*y + q[7]*z*z + 2*q[8]*z + q[9];
@@ -817,6 +832,106 @@ namespace Simplify
     return error;
   }
 
+  // Errors of the three edges of a triangle (err[0..2]) and their minimum
+  // (err[3]), exactly as three calls of calculate_error() would give them.
+
+#ifdef __AVX2__
+
+  // The AVX2 version evaluates the three edges together, one per lane
+  // (lane 3 duplicates lane 0), with the same operation order as the
+  // scalar code.
+
+  static inline __m256d det4(const __m256d *m, int a11, int a12, int a13,
+                             int a21, int a22, int a23, int a31, int a32, int a33)
+  {
+    __m256d det =           _mm256_mul_pd(_mm256_mul_pd(m[a11], m[a22]), m[a33]);
+    det = _mm256_add_pd(det, _mm256_mul_pd(_mm256_mul_pd(m[a13], m[a21]), m[a32]));
+    det = _mm256_add_pd(det, _mm256_mul_pd(_mm256_mul_pd(m[a12], m[a23]), m[a31]));
+    det = _mm256_sub_pd(det, _mm256_mul_pd(_mm256_mul_pd(m[a13], m[a22]), m[a31]));
+    det = _mm256_sub_pd(det, _mm256_mul_pd(_mm256_mul_pd(m[a11], m[a23]), m[a32]));
+    det = _mm256_sub_pd(det, _mm256_mul_pd(_mm256_mul_pd(m[a12], m[a21]), m[a33]));
+    return det;
+  }
+
+  static inline __m256d vertex_error4(const __m256d *q, __m256d x, __m256d y, __m256d z)
+  {
+    const __m256d two = _mm256_set1_pd(2.0);
+    __m256d e =         _mm256_mul_pd(_mm256_mul_pd(q[0], x), x);
+    e = _mm256_add_pd(e, _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(two, q[1]), x), y));
+    e = _mm256_add_pd(e, _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(two, q[2]), x), z));
+    e = _mm256_add_pd(e, _mm256_mul_pd(_mm256_mul_pd(two, q[3]), x));
+    e = _mm256_add_pd(e, _mm256_mul_pd(_mm256_mul_pd(q[4], y), y));
+    e = _mm256_add_pd(e, _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(two, q[5]), y), z));
+    e = _mm256_add_pd(e, _mm256_mul_pd(_mm256_mul_pd(two, q[6]), y));
+    e = _mm256_add_pd(e, _mm256_mul_pd(_mm256_mul_pd(q[7], z), z));
+    e = _mm256_add_pd(e, _mm256_mul_pd(_mm256_mul_pd(two, q[8]), z));
+    e = _mm256_add_pd(e, q[9]);
+    return e;
+  }
+
+  void calculate_triangle_errors(Triangle &t)
+  {
+    alignas(32) double qs[10][4], p1s[3][4], p2s[3][4], border[4];
+    loopj(0,4)
+    {
+      const Vertex &v1 = vertices[t.v[j%3]];
+      const Vertex &v2 = vertices[t.v[(j+1)%3]];
+      SymetricMatrix q = v1.q + v2.q;
+      loopk(0,10) qs[k][j] = q[k];
+      p1s[0][j] = v1.p.x; p1s[1][j] = v1.p.y; p1s[2][j] = v1.p.z;
+      p2s[0][j] = v2.p.x; p2s[1][j] = v2.p.y; p2s[2][j] = v2.p.z;
+      border[j] = (v1.border & v2.border) ? 1.0 : 0.0;
+    }
+    __m256d q[10];
+    loopk(0,10) q[k] = _mm256_load_pd(qs[k]);
+
+    // q_delta invertible: optimal position
+    // (-1/det is exactly -(1/det), so one division serves all three)
+    __m256d det = det4(q, 0, 1, 2, 1, 4, 5, 2, 5, 7);
+    __m256d inv = _mm256_div_pd(_mm256_set1_pd(1.0), det);
+    __m256d neg_inv = _mm256_sub_pd(_mm256_setzero_pd(), inv);
+    __m256d x = _mm256_mul_pd(neg_inv, det4(q, 1, 2, 3, 4, 5, 6, 5, 7, 8));
+    __m256d y = _mm256_mul_pd(inv,     det4(q, 0, 2, 3, 1, 5, 6, 2, 7, 8));
+    __m256d z = _mm256_mul_pd(neg_inv, det4(q, 0, 1, 3, 1, 4, 6, 2, 5, 8));
+    __m256d error = vertex_error4(q, x, y, z);
+
+    __m256d use_optimal = _mm256_and_pd(_mm256_cmp_pd(det, _mm256_setzero_pd(), _CMP_NEQ_UQ),
+                                        _mm256_cmp_pd(_mm256_load_pd(border), _mm256_setzero_pd(), _CMP_EQ_OQ));
+
+    // otherwise: best of both ends and the midpoint (rarely needed)
+    if (_mm256_movemask_pd(use_optimal) != 0xF)
+    {
+      __m256d p1[3], p2[3], p3[3];
+      loopk(0,3)
+      {
+        p1[k] = _mm256_load_pd(p1s[k]);
+        p2[k] = _mm256_load_pd(p2s[k]);
+        p3[k] = _mm256_mul_pd(_mm256_add_pd(p1[k], p2[k]), _mm256_set1_pd(0.5));
+      }
+      __m256d error1 = vertex_error4(q, p1[0], p1[1], p1[2]);
+      __m256d error2 = vertex_error4(q, p2[0], p2[1], p2[2]);
+      __m256d error3 = vertex_error4(q, p3[0], p3[1], p3[2]);
+      __m256d fallback = _mm256_min_pd(error1, _mm256_min_pd(error2, error3));
+      error = _mm256_blendv_pd(fallback, error, use_optimal);
+    }
+    alignas(32) double err[4];
+    _mm256_store_pd(err, error);
+
+    loopj(0,3) t.err[j] = err[j];
+    t.err[3]=min(t.err[0],min(t.err[1],t.err[2]));
+  }
+
+#else
+
+  void calculate_triangle_errors(Triangle &t)
+  {
+    vec3f p;
+    loopj(0,3) t.err[j]=calculate_error(t.v[j],t.v[(j+1)%3],p);
+    t.err[3]=min(t.err[0],min(t.err[1],t.err[2]));
+  }
+
+#endif
+
   char *trimwhitespace(char *str)
   {
     char *end;
@@ -864,7 +979,7 @@ namespace Simplify
 
     while(fgets( line, 1000, fn ) != NULL)
     {
-      Vertex v;
+      Vertex v = Vertex(); // border is read before it is first computed
       vec3f uv;
 
       if (strncmp(line, "mtllib", 6) == 0)  ///not important
@@ -994,7 +1109,7 @@ namespace Simplify
     int N_vertices = verts.size();
     loopi(0,N_vertices)
     {
-      Vertex v;
+      Vertex v = Vertex(); // border is read before it is first computed
       v.p.x = verts[i][0];
       v.p.y = verts[i][1];
       v.p.z = verts[i][2];
@@ -1110,5 +1225,124 @@ namespace Simplify
     }
     fclose(file);
   }
+
+  //
+  // Batched simplification of many independent meshes
+  //
+  // Each task is either a file (input_path, .obj) or a flat vertex/face
+  // buffer. Results are written to output_path if one is given, otherwise
+  // they replace the task's vertices/faces buffers.
+  //
+  // Tasks are handed out largest-first from a shared counter, so idle threads
+  // keep pulling work until the batch is exhausted. Every worker thread owns
+  // its own copy of the (thread_local) mesh state above.
+  //
+
+  struct MeshTask
+  {
+    std::string input_path;
+    std::string output_path;
+    std::vector<double> vertices; // x0,y0,z0,x1,...
+    std::vector<int> faces;       // a0,b0,c0,a1,...
+    int target_count;
+    bool ok;
+  };
+
+  void setMeshFromFlat(const std::vector<double> &verts, const std::vector<int> &faces)
+  {
+    vertices.clear();
+    triangles.clear();
+    vertices.resize(verts.size()/3);
+    triangles.resize(faces.size()/3);
+    loopi(0,vertices.size())
+    {
+      vertices[i].p.x = verts[3*i+0];
+      vertices[i].p.y = verts[3*i+1];
+      vertices[i].p.z = verts[3*i+2];
+    }
+    loopi(0,triangles.size())
+    {
+      Triangle &t = triangles[i];
+      loopj(0,3) t.v[j] = faces[3*i+j];
+      t.attr = 0;
+      t.material = -1;
+    }
+  }
+
+  void getMeshToFlat(std::vector<double> &verts, std::vector<int> &faces)
+  {
+    verts.resize(vertices.size()*3);
+    faces.resize(triangles.size()*3);
+    loopi(0,vertices.size())
+    {
+      verts[3*i+0] = vertices[i].p.x;
+      verts[3*i+1] = vertices[i].p.y;
+      verts[3*i+2] = vertices[i].p.z;
+    }
+    loopi(0,triangles.size())
+    {
+      loopj(0,3) faces[3*i+j] = triangles[i].v[j];
+    }
+  }
+
+  void simplify_many(std::vector<MeshTask> &tasks, int num_threads=0, int update_rate=5,
+                     double agressiveness=7, int max_iterations=100, double alpha = 0.000000001,
+                     int K = 3, bool lossless=false, double threshold_lossless = 0.0001,
+                     bool preserve_border = false)
+  {
+    if (num_threads <= 0)
+      num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min<int>(num_threads, tasks.size());
+
+    // Largest meshes first, so a big straggler doesn't start last.
+    std::vector<int> order(tasks.size());
+    loopi(0,tasks.size()) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+      return tasks[a].faces.size() > tasks[b].faces.size();
+    });
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+      for (size_t n = next++; n < order.size(); n = next++)
+      {
+        MeshTask &task = tasks[order[n]];
+        task.ok = false;
+        // Don't carry the previous task's materials (on this thread) into this one.
+        materials.clear();
+        mtllib.clear();
+        if (!task.input_path.empty())
+        {
+          load_obj(task.input_path.c_str());
+          if (vertices.empty()) continue;
+        }
+        else
+        {
+          setMeshFromFlat(task.vertices, task.faces);
+        }
+        simplify_mesh(task.target_count, update_rate, agressiveness, false, max_iterations,
+                      alpha, K, lossless, threshold_lossless, preserve_border);
+        if (!task.output_path.empty())
+        {
+          write_obj(task.output_path.c_str());
+          task.vertices.clear();
+          task.faces.clear();
+        }
+        else
+        {
+          getMeshToFlat(task.vertices, task.faces);
+        }
+        task.ok = true;
+      }
+      // Release this thread's buffers before it exits.
+      std::vector<Triangle>().swap(triangles);
+      std::vector<Vertex>().swap(vertices);
+      std::vector<Ref>().swap(refs);
+    };
+
+    // The calling thread only waits, so its own mesh state is left untouched.
+    std::vector<std::thread> threads;
+    loopi(0,num_threads) threads.emplace_back(worker);
+    for (auto &t : threads) t.join();
+  }
 };
 ///////////////////////////////////////////
\ No newline at end of file
@@ -1,10 +1,14 @@
 # distutils: language = c++
 
 from libcpp.vector cimport vector
+from libcpp.string cimport string
 from libcpp cimport bool
+from libc.string cimport memcpy
 
 from time import time as _time
 
+import numpy as np
+
 class _hidden_ref(object):
     """Hidden Python object to keep a reference to our numpy arrays
     """
@@ -23,6 +27,19 @@ cdef extern from "Simplify.h" namespace "Simplify" :
     vector[vector[double]] getVertices()
     vector[vector[double]] getNormals()
 
+    cdef cppclass MeshTask:
+        string input_path
+        string output_path
+        vector[double] vertices
+        vector[int] faces
+        int target_count
+        bool ok
+
+    void simplify_many_cpp "Simplify::simplify_many" (
+                        vector[MeshTask]& tasks, int num_threads, int update_rate,
+                        double aggressiveness, int max_iterations, double alpha, int K,
+                        bool lossless, double threshold_lossless, bool preserve_border) nogil
+
 cdef class Simplify : 
 
     cdef int[:,:] faces_mv
@@ -141,6 +158,93 @@ cdef class Simplify :
             print('simplified mesh in {} seconds from {} to {} triangles'.format(round(t_end-t_start,4), N_start, N_end))
 
 
+def simplify_many(meshes, target_counts, output_paths=None, int num_threads=0,
+                  int update_rate=5, double aggressiveness=7., int max_iterations=100,
+                  bool lossless=False, double threshold_lossless=1e-3, double alpha=1e-9,
+                  int K=3, bool preserve_border=True):
+    """Simplify many independent meshes in one call, on a native thread pool.
+
+    Every mesh gets its own simplifier state, and the GIL is released for the
+    whole batch, so thousands of small meshes cost one call instead of one
+    task each.
+
+    Arguments
+    ---------
+    meshes : list
+        each entry is either a (vertices, faces) pair of arrays or the path
+        of an .obj file
+    target_counts : int or list of int
+        target number of triangles, for all meshes or per mesh
+    output_paths : list of str, optional
+        if given, each result is written to this .obj path instead of
+        being returned
+    num_threads : int
+        number of worker threads; 0 means one per core
+
+    The remaining parameters are the same as in Simplify.simplify_mesh.
+
+    Returns
+    -------
+    results : list
+        (vertices, faces) for each mesh, or None where it was written to disk
+    """
+    cdef vector[MeshTask] tasks
+    cdef double[::1] verts_mv
+    cdef int[::1] faces_mv
+    cdef size_t i
+
+    n = len(meshes)
+    if isinstance(target_counts, int):
+        target_counts = [target_counts] * n
+    if len(target_counts) != n or (output_paths is not None and len(output_paths) != n):
+        raise ValueError("meshes, target_counts and output_paths must have the same length")
+
+    tasks.resize(n)
+    for i in range(n):
+        mesh = meshes[i]
+        tasks[i].target_count = target_counts[i]
+        if output_paths is not None:
+            tasks[i].output_path = str(output_paths[i]).encode()
+        if isinstance(mesh, (str, bytes)) or hasattr(mesh, '__fspath__'):
+            tasks[i].input_path = str(mesh).encode()
+            continue
+        vertices, faces = mesh
+        verts_mv = np.ascontiguousarray(vertices, dtype="float64").reshape(-1)
+        faces_mv = np.ascontiguousarray(faces, dtype="int32").reshape(-1)
+        tasks[i].vertices.resize(verts_mv.shape[0])
+        tasks[i].faces.resize(faces_mv.shape[0])
+        if verts_mv.shape[0]:
+            memcpy(tasks[i].vertices.data(), &verts_mv[0], verts_mv.shape[0] * sizeof(double))
+        if faces_mv.shape[0]:
+            memcpy(tasks[i].faces.data(), &faces_mv[0], faces_mv.shape[0] * sizeof(int))
+
+    with nogil:
+        simplify_many_cpp(tasks, num_threads, update_rate, aggressiveness, max_iterations,
+                          alpha, K, lossless, threshold_lossless, preserve_border)
+
+    results = []
+    failed = []
+    for i in range(n):
+        if not tasks[i].ok:
+            failed.append(meshes[i])
+            results.append(None)
+        elif tasks[i].output_path.size():
+            results.append(None)
+        else:
+            verts = np.empty((tasks[i].vertices.size() // 3, 3), dtype="float64")
+            faces = np.empty((tasks[i].faces.size() // 3, 3), dtype="int32")
+            verts_mv = verts.reshape(-1)
+            faces_mv = faces.reshape(-1)
+            if verts_mv.shape[0]:
+                memcpy(&verts_mv[0], tasks[i].vertices.data(), verts_mv.shape[0] * sizeof(double))
+            if faces_mv.shape[0]:
+                memcpy(&faces_mv[0], tasks[i].faces.data(), faces_mv.shape[0] * sizeof(int))
+            results.append((verts, faces))
+    if failed:
+        raise RuntimeError("Could not simplify {} mesh(es), e.g. {!r}".format(len(failed), failed[0]))
+    return results
+
+
 cdef vector[vector[double]] setVerticesNogil(double[:,:] vertices, vector[vector[double]] vector_vertices )nogil:
     """nogil function for filling the vector of vertices, "vector_vertices",
     with the data found in the memory view of the array "vertices" 
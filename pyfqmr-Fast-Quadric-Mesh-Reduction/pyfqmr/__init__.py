@@ -1 +1 @@
-from .Simplify import *
\ No newline at end of file
+from .Simplify import Simplify, simplify_many
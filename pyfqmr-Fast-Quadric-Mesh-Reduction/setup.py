@@ -1,3 +1,5 @@
+import os
+import sys
 from setuptools import setup
 from setuptools.extension import Extension
 
@@ -5,6 +7,23 @@ from setuptools.extension import Extension
 # https://github.com/AshleySetter/HowToPackageCythonAndCppFuncs
 
 
+# simplify_many runs on std::thread
+if sys.platform == "win32":
+    compile_args = []
+    link_args = []
+else:
+    compile_args = ["-std=c++11", "-pthread"]
+    link_args = ["-pthread"]
+
+# Optional build flavours:
+#   PYFQMR_AVX2=1            evaluate the three edge errors of a triangle with AVX2
+#   PYFQMR_FLOAT_QUADRICS=1  store quadrics as float instead of double
+define_macros = []
+if os.environ.get("PYFQMR_AVX2"):
+    compile_args.append("/arch:AVX2" if sys.platform == "win32" else "-mavx2")
+if os.environ.get("PYFQMR_FLOAT_QUADRICS"):
+    define_macros.append(("PYFQMR_FLOAT_QUADRICS", None))
+
 # load version
 with open("VERSION", 'r') as f_vers:
     version = f_vers.read()
@@ -17,7 +36,10 @@ extensions = [
     Extension(
     name         = "pyfqmr.Simplify",        # name/path of generated .so file
     sources      = ["pyfqmr/Simplify.pyx"],  # cython generated cpp file
-    language     = "c++"),                  # tells python that the language of the extension is c++
+    language     = "c++",                   # tells python that the language of the extension is c++
+    define_macros      = define_macros,
+    extra_compile_args = compile_args,
+    extra_link_args    = link_args),
     ]
 
 setup(
@@ -17,3 +17,38 @@ def test_example():
     assert len(faces) / len(bunny.faces) == pytest.approx(.5, rel=.05)
     simplified = tr.Trimesh(vertices, faces, normals)
     assert simplified.area == pytest.approx(simplified.area, rel=.05)
+
+
+def test_simplify_many():
+    import trimesh as tr
+    meshes = [tr.creation.icosphere(subdivisions) for subdivisions in (2, 3, 4)]
+    targets = [len(mesh.faces) // 4 for mesh in meshes]
+
+    results = pyfqmr.simplify_many([(mesh.vertices, mesh.faces) for mesh in meshes],
+                                   targets, num_threads=2)
+
+    # Each mesh must come out exactly as it would from its own Simplify()
+    for mesh, target, (vertices, faces) in zip(meshes, targets, results):
+        simp = pyfqmr.Simplify()
+        simp.setMesh(mesh.vertices, mesh.faces)
+        simp.simplify_mesh(target, verbose=False)
+        expected_vertices, expected_faces, _ = simp.getMesh()
+        assert (faces == expected_faces).all()
+        assert (vertices == expected_vertices).all()
+
+
+def test_simplify_many_files(tmp_path):
+    import trimesh as tr
+    mesh = tr.creation.icosphere(3)
+    input_paths = []
+    output_paths = []
+    for i in range(4):
+        input_paths.append(str(tmp_path / f"{i}.obj"))
+        output_paths.append(str(tmp_path / f"{i}-simplified.obj"))
+        mesh.export(input_paths[-1])
+
+    results = pyfqmr.simplify_many(input_paths, len(mesh.faces) // 2, output_paths)
+    assert results == [None] * 4
+    for path in output_paths:
+        simplified = tr.load_mesh(path)
+        assert len(simplified.faces) / len(mesh.faces) == pytest.approx(.5, rel=.05)